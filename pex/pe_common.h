@@ -14,18 +14,24 @@
 #include <fcntl.h>
 #include <math.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define FIFO_EXCHANGE "/tmp/pe_exchange_%d"
 #define FIFO_TRADER "/tmp/pe_trader_%d"
 #define FEE_PERCENTAGE 1
+#define FEE_BPS_DENOMINATOR 10000 // Fees are charged in basis points of the match value
 #define BUF_LEN 128
+#define CMD_BUF_LEN 4096 // A bulk command carries up to BULK_LEGS_MAX orders
+#define BULK_LEGS_MAX 64
 #define INT_LEN 12
 #define PRODUCT_NAME_MAX 17
 #define PRODUCT_STR_LEN 16
@@ -36,30 +42,57 @@
 #define SELL_CMD_ARGS 4
 #define AMEND_CMD_ARGS 3
 #define CANCEL_CMD_ARGS 1
+#define MASS_CANCEL_CMD_ARGS 2
 #define MARKET_SELL_ARGS 3
 #define ACCEPTED_ARGS 1
+#define BINARY_LOG_MAGIC "PEXLOG1\n" // The first bytes of a binary log
+#define BINARY_LOG_MAGIC_LEN 8
+#define BINARY_LOG_FORMATS_MAX 256
 #define STR_HELPER(x) #x
 #define TO_STRING(x) STR_HELPER(x) 
 
 enum OrderType { 
     BUY, 
     SELL, 
+    ANY_SIDE, // Both sides, the side filter of a mass cancel
     // AMEND, 
     // CANCEL, 
     INVALID_ORDER 
 }; // The order type enum
 
+// A binary log is the magic followed by records, each starting with its type byte.
+// Lengths are uint16 and integers int64, in host byte order.
+enum BinaryLogRecord {
+    LOG_RECORD_FORMAT = 1, // uint16 id, uint16 length, the format string
+    LOG_RECORD_LINE, // uint16 format id, then the args of the format: int64 for %d and %ld, uint16 length and bytes for %s
+    LOG_RECORD_TEXT // uint16 length, preformatted text
+};
+
+enum TimeInForce {
+    TIF_DAY, // Rests until filled or cancelled
+    TIF_IOC, // Immediate or cancel, the unfilled remainder is cancelled
+    TIF_FOK, // Fill or kill, filled completely at once or not at all
+    TIF_GTT, // Good till time, rests until filled, cancelled or expired
+    TIF_MARKET // No price, sweeps the book and the unfilled remainder is cancelled
+}; // How long an order stays in the book
+
 enum OrderResponseType { 
     ACCEPTED, 
     AMENDED, 
     CANCELLED, 
+    MASS_CANCELLED,
+    BULK_ACCEPTED,
     INVALID,
     NORESPONSE
 }; // The market response type enum
 
+#define MARKET_PREFIX_MAX (PRODUCT_NAME_MAX + 16)
+
 struct product_list {
     int num_products;
     char (*names)[PRODUCT_NAME_MAX];
+    char (*market_prefixes)[2][MARKET_PREFIX_MAX]; // "MARKET BUY GPU " and "MARKET SELL GPU " by product and side
+    int (*market_prefix_lens)[2];
 }; // The list of products
 
 struct order {
@@ -69,31 +102,69 @@ struct order {
     char product[PRODUCT_NAME_MAX];
     int qty;
     int price;
-    struct order* next;
-}; // The order node structure
+    enum TimeInForce tif;
+    int display_qty; // The shown clip of an iceberg order, 0 if the whole quantity is shown
+    uint32_t expire_tick; // The timer wheel tick a good till time order expires at
+    int stop_price; // The trigger price of a stop order, 0 for other orders
+    uint32_t target; // The resting order referred to by an amend or cancel
+}; // The order parsed from a trader command
+
+struct book_order {
+    int price;
+    int qty;
+    int order_id;
+    int trader_id;
+    uint32_t next;
+    uint32_t prev;
+    uint32_t level; // The price level the order rests at
+    int reserve_qty; // The hidden quantity of an iceberg order
+}; // The resting order node, only the fields touched by matching (32 bytes)
+
+struct price_level {
+    int price;
+    int num_orders;
+    long int total_qty; // The shown quantity of the level
+    int num_icebergs; // The orders of the level with a hidden reserve
+    uint32_t head; // The first order of the level in time priority
+    uint32_t tail; // The last order of the level in time priority
+    uint32_t next; // The next worse level
+    uint32_t prev; // The next better level
+}; // The aggregate of the orders resting at one price
+
+struct order_info {
+    int product_idx;
+    enum OrderType order_type;
+    uint32_t trader_next; // The next resting order of the same trader
+    uint32_t trader_prev; // The previous resting order of the same trader
+    int display_qty; // The clip an iceberg order is replenished with
+    uint32_t expire_tick; // The tick a good till time order expires at
+    int timer_slot; // The timer wheel slot of the order, TIMER_NONE if it does not expire
+    uint32_t timer_next; // The next order in the same timer wheel slot
+    uint32_t timer_prev; // The previous order in the same timer wheel slot
+}; // The rarely used fields of a resting order, kept in a side table
 
 struct order_list {
-    struct order* buy_head;
-    struct order* sell_head;
+    uint32_t buy_head;
+    uint32_t sell_head;
+    uint32_t buy_level_head; // The best (highest) buy level
+    uint32_t sell_level_head; // The best (lowest) sell level
     int buy_list_size;
     int sell_list_size;
     int buy_levels;
     int sell_levels;
+    int last_price; // The price of the last trade, 0 before the first trade
+    int batch_orders; // The orders waiting for the next auction in batch auction mode
+    uint32_t batch_deadline; // The tick the batch is uncrossed at, with a batch interval
 }; // The list of buy and sell orders
 
-struct position {
-    char product[PRODUCT_NAME_MAX];
-    int qty;
-    long int profit;
-}; // The position of a product
-
 struct trader {
     int id;
     char *name;
     int num_orders;
     int pid;
     int is_alive;
-    struct position *positions;
+    uint32_t order_head; // The resting orders of the trader, linked through the order info table
+    int num_resting;
 }; // The trader structure
 
 #endif
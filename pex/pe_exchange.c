@@ -7,24 +7,115 @@
 #include "pe_exchange.h"
 
 volatile sig_atomic_t num_alive_traders = 0;;
+volatile sig_atomic_t disconnect_pending = 0;
+int *disconnected_ids = NULL; // The traders in the order they disconnected, filled by the SIGCHLD handler
+volatile sig_atomic_t num_disconnected = 0;
+int num_disconnects_reported = 0;
 struct pid_circular_queue pid_queue;
 struct trader_list traders;
 struct product_list products;
 struct order_list *order_book;
+struct order_pool order_pool;
+struct level_pool level_pool;
 long int exchange_fees;
+struct exchange_config config;
+struct bulk_order bulk_order;
+struct timer_wheel timer_wheel;
+struct stop_book *stop_books;
+uint32_t stop_seq = 0;
+int expiry_clock_running = 0;
+int num_pending_batches = 0; // The batches waiting for their interval
+int pre_open_pending = 0; // The market is in its opening call phase
+uint32_t market_open_tick = 0; // The tick the opening auction runs at
+uint32_t clock_base_tick = 0; // The tick current_tick resumes from after a recovery
+struct log_ring log_ring;
+struct book_diff book_diff;
+const char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899"; // "00" to "99", for format_int
+volatile sig_atomic_t snapshot_requested = 0;
+struct snapshot_writer snapshot_writer;
+uint32_t num_book_updates = 0; // For the snapshot count cadence
+uint32_t next_snapshot_tick = 0; // For the snapshot wall-clock cadence
+struct journal journal;
+int replaying = 0; // The journal is being replayed, nothing is sent to traders
+volatile sig_atomic_t checkpoint_requested = 0;
+volatile sig_atomic_t checkpoint_pid = 0; // The child writing a checkpoint, 0 if none
+volatile sig_atomic_t checkpoint_exit = -1; // The wait status of the checkpoint child, -1 until it exits
+long int checkpoint_offset = 0; // The journal offset of the checkpoint being written
+int checkpoint_commands = 0; // The commands since the last checkpoint
 
 #ifndef TESTING
 int main(int argc, char** argv){
-    if(argc < 3) {
-        printf("Not enough arguments. \nUsage: %s products.txt <./trader_a> ... <./trader_n>\n", argv[0]);
+    // Parse the options before the products file
+    int arg_idx = parse_exchange_options(argc, argv, &config);
+    if(arg_idx == -1 || argc - arg_idx < 2) {
+        printf("Not enough arguments. \nUsage: %s [options] products.txt <./trader_a> ... <./trader_n>\n", argv[0]);
+        printf("Options:\n");
+        printf("  --aggregate-fills    Send the aggressor one FILL per order instead of one per match\n");
+        printf("  --fill-vwap          Same as --aggregate-fills, with the average fill price appended\n");
+        printf("  --fee-file <file>    Read per product and per trader taker/maker fees in basis points\n");
+        printf("  --cancel-on-disconnect  Cancel the resting orders of a trader when it disconnects\n");
+        printf("  --batch-interval <ms>  Match in auctions, uncrossing each product this long after its first order\n");
+        printf("  --batch-size <n>     Match in auctions, uncrossing each product once it holds n new orders\n");
+        printf("  --pre-open <ms>      Collect orders for this long after MARKET OPEN, then open with an auction\n");
+        printf("  --binary-log <file>  Write the output as binary records to the file, read it with pe_logdecode\n");
+        printf("  --book-diffs         Print only the levels and positions each command changed\n");
+        printf("  --compact-positions  Print only the positions each command changed, with the full book\n");
+        printf("  --snapshot-every <n> Print the full book every n updates instead of after each one, and on SIGUSR2\n");
+        printf("  --snapshot-interval <ms>  Print the full book every ms instead of after each update, and on SIGUSR2\n");
+        printf("  --snapshot-file <file>  Write the snapshots to the file from a copy of the book, on a separate thread\n");
+        printf("  --journal <file>     Append the accepted commands to the file before responding, in group commits\n");
+        printf("  --journal-sync <mode>  Sync the journal per batch (default), always (per command), or none\n");
+        printf("  --replay <file>      Rebuild the book and positions from a journal before trading\n");
+        printf("  --checkpoint <file>  Write the exchange state to the file from a forked child, on SIGHUP\n");
+        printf("  --checkpoint-every <n>  Also write a checkpoint every n commands\n");
+        printf("  --checkpoint needs --journal, and --recover needs --replay with the same journal\n");
+        printf("  --recover <file>     Load a checkpoint before trading, --replay then starts at its journal offset\n");
+        printf("  --verbosity <level>  Print full output (default), matches, or errors only\n");
         return 1;
     }
 
+    // Output goes through the writer thread from here, and is written out on any exit
+    int log_fd = STDOUT_FILENO;
+    if(config.binary_log != NULL) {
+        log_fd = open(config.binary_log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(log_fd == -1) {
+            perror("Error opening binary log");
+            exit(1);
+        }
+    }
+    start_logger(&log_ring, log_fd, config.binary_log != NULL);
+    atexit(stop_logger);
+
     // Read products info from the product file.
-    read_product_file(argv[1], &products);
+    read_product_file(argv[arg_idx], &products);
 
     // Register traders
-    traders = init_traders(argc-2, argv+2, &products);
+    traders = init_traders(argc-arg_idx-1, argv+arg_idx+1, &products);
+    disconnected_ids = (int*)malloc(traders.num_traders * sizeof(int));
+    if(disconnected_ids == NULL) {
+        perror("Error allocating disconnect list");
+        exit(1);
+    }
+
+    // Snapshots are copied and written on their own thread
+    if(config.snapshot_file != NULL) {
+        start_snapshot_writer(&snapshot_writer, config.snapshot_file);
+    }
+
+    // Track the levels and positions each command changes
+    if(TRACK_CHANGES) {
+        init_book_diff(&book_diff, traders.num_traders, products.num_products);
+    }
+
+    // Override the default fees
+    if(config.fee_file != NULL) {
+        read_fee_file(config.fee_file, &traders, &products);
+    }
+
+    // Journal the accepted commands
+    if(config.journal_file != NULL) {
+        open_journal(&journal, config.journal_file, traders.num_traders, products.num_products);
+    }
 
     // Initialize circular pid queue
     init_pid_queue(&pid_queue, traders.num_traders * QUEUE_SIZE_BASE);
@@ -49,12 +140,62 @@ int main(int argc, char** argv){
         exit(1);
     }
 
+    // Register sigusr2 handler for full snapshots on demand
+    if(TRACK_CHANGES || PERIODIC_SNAPSHOTS || config.snapshot_file != NULL) {
+        struct sigaction sa_usr2 = {0};
+        sa_usr2.sa_handler = snapshot_request_handler;
+        sigemptyset(&sa_usr2.sa_mask);
+        sa_usr2.sa_flags = SA_RESTART;
+        if(sigaction(SIGUSR2, &sa_usr2, NULL) == -1) {
+            perror("Error registring sa for SIGUSR2");
+            exit(1);
+        }
+    }
+
+    // Register sighup handler for checkpoints on demand
+    if(config.checkpoint_file != NULL) {
+        struct sigaction sa_hup = {0};
+        sa_hup.sa_handler = checkpoint_request_handler;
+        sigemptyset(&sa_hup.sa_mask);
+        sa_hup.sa_flags = SA_RESTART;
+        if(sigaction(SIGHUP, &sa_hup, NULL) == -1) {
+            perror("Error registring sa for SIGHUP");
+            exit(1);
+        }
+    }
+
+    // Register sigalrm handler to wake up for order expiry, restarting interrupted pipe io
+    struct sigaction sa_alarm = {0};
+    sa_alarm.sa_handler = expiry_clock_handler;
+    sigemptyset(&sa_alarm.sa_mask);
+    sa_alarm.sa_flags = SA_RESTART;
+    if(sigaction(SIGALRM, &sa_alarm, NULL) == -1) {
+        perror("Error registring sa for SIGALRM");
+        exit(1);
+    }
+
     // Initialize order book, contains order lists for each product
     order_book = init_order_book(products.num_products);
 
     // Print exchange starting info
     show_pex_start(&products);
 
+    // Orders only queue until the opening auction, unless the recovered run already held it
+    pre_open_pending = config.pre_open_ms > 0;
+
+    // Recover the state of an earlier run, from a checkpoint and the journal after it
+    long int replay_offset = 0;
+    long int journal_id = 0;
+    if(config.recover_file != NULL) {
+        replay_offset = load_checkpoint(config.recover_file, &journal_id);
+    }
+    if(config.replay_file != NULL) {
+        replay_journal(config.replay_file, replay_offset, journal_id);
+    }
+    if(config.recover_file != NULL || config.replay_file != NULL) {
+        resume_clock(timer_wheel.now);
+    }
+
     // Make fifos, start traders and connect
     int *fds_exchange = NULL; //fds_exchange array for writing
     int *fds_trader = NULL; //fds_trader array for reading
@@ -63,15 +204,68 @@ int main(int argc, char** argv){
     // Send market open message to traders
     market_open_msg(fds_exchange, &traders);
 
+    // The first timed snapshot is one interval after the open
+    next_snapshot_tick = current_tick() + (config.snapshot_interval_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    // The call phase runs from the open
+    if(pre_open_pending) {
+        market_open_tick = current_tick() + (config.pre_open_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    }
+
     // Event loop
     while(1) {
+        // Log what the SIGCHLD handler recorded
+        report_child_exits();
+
+        // Cancel the orders left by disconnected traders
+        if(disconnect_pending && config.cancel_on_disconnect) {
+            purge_disconnected_traders(fds_exchange);
+        }
+
+        // Expire the good till time orders that are due
+        expire_orders(fds_exchange, current_tick());
+
+        // Take the snapshots asked for by SIGUSR2 or due on the clock
+        if(config.snapshot_interval_ms > 0 && (int32_t)(current_tick() - next_snapshot_tick) >= 0) {
+            snapshot_requested = 1;
+            next_snapshot_tick = current_tick() + (config.snapshot_interval_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        }
+        if(snapshot_requested) {
+            snapshot_requested = 0;
+            if(emit_book_snapshot() && TRACK_CHANGES) {
+                clear_book_diff(&book_diff);
+            }
+        }
+
+        // Take the checkpoint asked for by SIGHUP
+        if(checkpoint_requested) {
+            checkpoint_requested = 0;
+            start_checkpoint(fds_exchange);
+        }
+
+        // End the call phase with the opening auction
+        if(pre_open_pending && (int32_t)(current_tick() - market_open_tick) >= 0) {
+            open_market(fds_exchange);
+        }
+
+        // Uncross the auction batches that are due
+        if(config.batch_auction && !pre_open_pending) {
+            run_batch_auctions(fds_exchange, current_tick());
+        }
+
         // All traders disconnected
         if(num_alive_traders == 0) {
             break;
         }
 
         if(is_empty_queue(&pid_queue)){
-            // Wait for trader signal
+            // The batch ends when the commands run out, make it durable and send its messages
+            if(config.journal_file != NULL) {
+                commit_journal(&journal, fds_exchange);
+            }
+
+            // Wait for trader signal, or the next tick while orders may expire
+            update_expiry_clock();
             pause();
         } else {
             // Communicate with trader i, the front in the queue
@@ -102,12 +296,36 @@ int main(int argc, char** argv){
                 // Process order ----
                 process_order(response, fds_exchange, &received_order);
 
+                // Commit a full batch, or every command when asked to
+                if(config.journal_file != NULL && (journal.num_pending >= JOURNAL_BATCH_MAX || config.journal_sync == JOURNAL_SYNC_ALWAYS)) {
+                    commit_journal(&journal, fds_exchange);
+                }
+
+                // Checkpoint on the command cadence, a busy writer delays it to the next command
+                if(config.checkpoint_every > 0 && response != INVALID && response != NORESPONSE) {
+                    checkpoint_commands++;
+                }
+                if(config.checkpoint_every > 0 && checkpoint_commands >= config.checkpoint_every && start_checkpoint(fds_exchange)) {
+                    checkpoint_commands = 0;
+                }
+
                 // Unblocking SIGCHLD
                 sigprocmask(SIG_SETMASK, &oldmask, NULL);
             }
         }
     }
 
+    // Let the last checkpoint finish, and log the last disconnects
+    if(config.checkpoint_file != NULL) {
+        finish_checkpoint();
+    }
+    report_child_exits();
+
+    // Commit the last batch
+    if(config.journal_file != NULL) {
+        close_journal(&journal, fds_exchange);
+    }
+
     // Trading completed, print the ending information
     show_trading_end(exchange_fees);
 
@@ -129,6 +347,17 @@ int main(int argc, char** argv){
 
     // Free the pid queue
     free_pid_queue(&pid_queue);
+    free(disconnected_ids);
+
+    // Write the last snapshot
+    if(config.snapshot_file != NULL) {
+        stop_snapshot_writer(&snapshot_writer);
+    }
+
+    // Free the dirty sets
+    if(TRACK_CHANGES) {
+        free_book_diff(&book_diff);
+    }
     
     // Free product list
     free_product_list(&products);
@@ -137,6 +366,12 @@ int main(int argc, char** argv){
     // Free fds
     free_fds(fds_exchange, fds_trader);
 
+    // Write the rest of the output
+    stop_logger();
+    if(log_fd != STDOUT_FILENO) {
+        close(log_fd);
+    }
+
     return 0;
 }
 #endif
@@ -201,15 +436,571 @@ void exchange_handler(int sig, siginfo_t* info, void* ucontext) {
 
 void trader_disconnect_handler(int sig, siginfo_t* info, void* ucontext) {
     int status;
-    waitpid(info->si_pid, &status, 0);
+    pid_t reaped = waitpid(info->si_pid, &status, 0);
+    // Only record the exit, the event loop logs it. finish_checkpoint may have reaped it already
+    if(checkpoint_pid != 0 && info->si_pid == checkpoint_pid) {
+        if(reaped == info->si_pid) {
+            checkpoint_exit = status;
+        }
+        return;
+    }
     // Check the disconnected trader
     // if(WIFEXITED(status) && WEXITSTATUS(status)==0) {
     int id = get_traderid_by_pid(&traders, info->si_pid);
-    if(id != -1) {
+    if(id != -1 && traders.trader_arr[id].is_alive) {
         traders.trader_arr[id].is_alive = 0;
         num_alive_traders--;
-        printf(LOG_PREFIX" Trader %d disconnected\n", id);
+        disconnected_ids[num_disconnected] = id;
+        num_disconnected++;
+        disconnect_pending = 1;
+    }
+}
+
+void report_child_exits(void) {
+    // The handler writes an id before counting it, so the counted ids are complete
+    while(num_disconnects_reported < num_disconnected) {
+        PEX_LOG(LOG_ERRORS, LOG_PREFIX" Trader %d disconnected\n", disconnected_ids[num_disconnects_reported]);
+        num_disconnects_reported++;
+    }
+
+    // The next checkpoint can start once this one is reported
+    if(checkpoint_exit != -1) {
+        if(WIFEXITED(checkpoint_exit) && WEXITSTATUS(checkpoint_exit) == 0) {
+            PEX_LOG(LOG_FULL, LOG_PREFIX" Checkpoint written at journal offset %ld\n", checkpoint_offset);
+        } else {
+            PEX_LOG(LOG_ERRORS, LOG_PREFIX" Checkpoint failed\n");
+        }
+        checkpoint_exit = -1;
+        checkpoint_pid = 0;
+    }
+}
+
+void expiry_clock_handler(int sig) {
+    // Only wakes up the event loop
+}
+
+void update_expiry_clock(void) {
+    int needs_clock = timer_wheel.num_timers > 0 || num_pending_batches > 0 || pre_open_pending || config.snapshot_interval_ms > 0;
+    if(needs_clock == expiry_clock_running) {
+        return;
+    }
+
+    // Tick while orders may expire, and stay quiet otherwise
+    struct itimerval interval = {0};
+    if(needs_clock) {
+        interval.it_interval.tv_usec = TIMER_TICK_MS * 1000;
+        interval.it_value.tv_usec = TIMER_TICK_MS * 1000;
+    }
+    if(setitimer(ITIMER_REAL, &interval, NULL) == -1) {
+        perror("Error setting expiry clock");
+        exit(1);
+    }
+    expiry_clock_running = needs_clock;
+}
+
+void start_logger(struct log_ring *ring, int fd, int binary) {
+    ring->slots = (struct log_record*)malloc(LOG_RING_SLOTS * sizeof(struct log_record));
+    if(ring->slots == NULL) {
+        perror("Error allocating log ring");
+        exit(1);
+    }
+    for(size_t i=0; i<LOG_RING_SLOTS; i++) {
+        atomic_init(&ring->slots[i].seq, i);
+    }
+    atomic_init(&ring->enqueue_pos, 0);
+    ring->dequeue_pos = 0;
+    ring->fd = fd;
+    ring->owner = getpid();
+    ring->binary = binary;
+    ring->num_formats = 0;
+
+    // The thread inherits a full signal mask, so the event loop keeps receiving its signals
+    sigset_t mask, oldmask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    atomic_store(&ring->running, 1);
+    if(pthread_create(&ring->writer, NULL, logger_main, ring) != 0) {
+        perror("Error starting log writer");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+void stop_logger(void) {
+    // A forked trader that failed to exec has no writer thread
+    if(!atomic_load(&log_ring.running) || log_ring.owner != getpid()) {
+        return;
+    }
+    atomic_store(&log_ring.running, 0);
+    pthread_join(log_ring.writer, NULL);
+    free(log_ring.slots);
+    log_ring.slots = NULL;
+}
+
+void log_printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if(!atomic_load(&log_ring.running)) {
+        vprintf(fmt, args);
+        va_end(args);
+        return;
+    }
+
+    struct log_record *record = reserve_log_record(&log_ring);
+    // The scan below consumes args, so the formatted path takes clean copies made before it
+    va_list line_args, long_line_args;
+    va_copy(line_args, args);
+    va_copy(long_line_args, args);
+
+    // Keep the args of the supported conversions, the writer formats them
+    int num_args = 0;
+    size_t text_len = 0;
+    int is_compact = 1;
+    for(const char *c = fmt; *c && is_compact; c++) {
+        if(*c != '%') {
+            continue;
+        }
+        c++;
+        if(*c == '%') {
+            continue;
+        }
+        if(*c == '\0' || num_args == LOG_ARGS_MAX) {
+            is_compact = 0;
+        } else if(*c == 'd') {
+            record->args[num_args++] = va_arg(args, int);
+        } else if(c[0] == 'l' && c[1] == 'd') {
+            record->args[num_args++] = va_arg(args, long int);
+            c++;
+        } else if(*c == 's') {
+            const char *str = va_arg(args, const char*);
+            size_t str_len = strlen(str) + 1;
+            if(text_len + str_len > LOG_TEXT_MAX) {
+                is_compact = 0;
+            } else {
+                memcpy(record->text + text_len, str, str_len);
+                record->args[num_args++] = text_len;
+                text_len += str_len;
+            }
+        } else {
+            is_compact = 0;
+        }
+    }
+
+    if(is_compact) {
+        record->fmt = fmt;
+        record->num_args = num_args;
+        publish_log_record(&log_ring, record);
+    } else {
+        // Too many or too long args, or other conversions, send the formatted line
+        char line[BUF_LEN * 4];
+        int line_len = vsnprintf(line, sizeof(line), fmt, line_args);
+        char *text = line;
+        if(line_len >= (int)sizeof(line)) {
+            text = (char*)malloc(line_len + 1);
+            vsnprintf(text, line_len + 1, fmt, long_line_args);
+        }
+
+        // The claimed record carries the first chunk
+        size_t chunk_len = line_len < LOG_TEXT_MAX ? line_len : LOG_TEXT_MAX;
+        record->fmt = NULL;
+        record->num_args = chunk_len;
+        memcpy(record->text, text, chunk_len);
+        publish_log_record(&log_ring, record);
+        log_text(&log_ring, text + chunk_len, line_len - chunk_len);
+        if(text != line) {
+            free(text);
+        }
+    }
+    va_end(line_args);
+    va_end(long_line_args);
+    va_end(args);
+}
+
+void log_text(struct log_ring *ring, const char *text, size_t len) {
+    while(len > 0) {
+        size_t chunk_len = len < LOG_TEXT_MAX ? len : LOG_TEXT_MAX;
+        struct log_record *record = reserve_log_record(ring);
+        record->fmt = NULL;
+        record->num_args = chunk_len;
+        memcpy(record->text, text, chunk_len);
+        publish_log_record(ring, record);
+        text += chunk_len;
+        len -= chunk_len;
+    }
+}
+
+struct log_record *reserve_log_record(struct log_ring *ring) {
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    while(1) {
+        struct log_record *record = &ring->slots[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        if(seq == pos) {
+            // The slot is free, claim it unless another producer got there first
+            if(atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                return record;
+            }
+        } else if(seq < pos) {
+            // The ring is full, wait for the writer
+            sched_yield();
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+void publish_log_record(struct log_ring *ring, struct log_record *record) {
+    size_t pos = atomic_load_explicit(&record->seq, memory_order_relaxed);
+    atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+}
+
+size_t format_log_record(const struct log_record *record, char *buf, size_t cap) {
+    if(record->fmt == NULL) {
+        memcpy(buf, record->text, record->num_args);
+        return record->num_args;
+    }
+
+    // Only the conversions log_printf keeps unformatted can appear here
+    size_t len = 0;
+    int arg_idx = 0;
+    for(const char *c = record->fmt; *c; c++) {
+        if(*c != '%') {
+            buf[len++] = *c;
+            continue;
+        }
+        c++;
+        if(*c == '%') {
+            buf[len++] = '%';
+        } else if(*c == 'd') {
+            len += snprintf(buf + len, cap - len, "%d", (int)record->args[arg_idx++]);
+        } else if(*c == 'l') {
+            len += snprintf(buf + len, cap - len, "%ld", record->args[arg_idx++]);
+            c++;
+        } else {
+            const char *str = record->text + record->args[arg_idx++];
+            size_t str_len = strlen(str);
+            memcpy(buf + len, str, str_len);
+            len += str_len;
+        }
+    }
+    return len;
+}
+
+size_t encode_log_record(struct log_ring *ring, const struct log_record *record, char *buf, size_t cap) {
+    size_t len = 0;
+    uint16_t field;
+
+    // Find the id of the format, or define it
+    int format_id = -1;
+    if(record->fmt != NULL) {
+        for(int i=0; i<ring->num_formats; i++) {
+            if(ring->formats[i] == record->fmt) {
+                format_id = i;
+                break;
+            }
+        }
+        size_t fmt_len = strlen(record->fmt);
+        if(format_id == -1 && ring->num_formats < BINARY_LOG_FORMATS_MAX && fmt_len <= LOG_FORMAT_LEN_MAX) {
+            format_id = ring->num_formats;
+            ring->formats[ring->num_formats++] = record->fmt;
+            buf[len++] = LOG_RECORD_FORMAT;
+            field = format_id;
+            memcpy(buf + len, &field, sizeof(field));
+            len += sizeof(field);
+            field = fmt_len;
+            memcpy(buf + len, &field, sizeof(field));
+            len += sizeof(field);
+            memcpy(buf + len, record->fmt, fmt_len);
+            len += fmt_len;
+        }
+    }
+
+    // Without a format id the record is written as text
+    if(format_id == -1) {
+        char text[LOG_RECORD_OUT_MAX];
+        size_t text_len = format_log_record(record, text, sizeof(text));
+        buf[len++] = LOG_RECORD_TEXT;
+        field = text_len;
+        memcpy(buf + len, &field, sizeof(field));
+        len += sizeof(field);
+        memcpy(buf + len, text, text_len);
+        return len + text_len;
+    }
+
+    // The args in the order of the format
+    buf[len++] = LOG_RECORD_LINE;
+    field = format_id;
+    memcpy(buf + len, &field, sizeof(field));
+    len += sizeof(field);
+    int arg_idx = 0;
+    for(const char *c = record->fmt; *c; c++) {
+        if(*c != '%') {
+            continue;
+        }
+        c++;
+        if(*c == '%') {
+            continue;
+        }
+        if(*c == 's') {
+            const char *str = record->text + record->args[arg_idx++];
+            field = strlen(str);
+            memcpy(buf + len, &field, sizeof(field));
+            len += sizeof(field);
+            memcpy(buf + len, str, field);
+            len += field;
+        } else {
+            int64_t value = record->args[arg_idx++];
+            memcpy(buf + len, &value, sizeof(value));
+            len += sizeof(value);
+            if(*c == 'l') {
+                c++;
+            }
+        }
+    }
+    return len;
+}
+
+void *logger_main(void *arg) {
+    struct log_ring *ring = (struct log_ring*)arg;
+    char *batch = (char*)malloc(LOG_BATCH_BYTES);
+    size_t batch_len = 0;
+
+    // A binary log starts with its magic
+    if(ring->binary) {
+        memcpy(batch, BINARY_LOG_MAGIC, BINARY_LOG_MAGIC_LEN);
+        batch_len = BINARY_LOG_MAGIC_LEN;
+    }
+
+    while(1) {
+        // Take every published record, flushing whenever the batch may not hold the next one
+        struct log_record *record = &ring->slots[ring->dequeue_pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        if(seq == ring->dequeue_pos + 1) {
+            if(LOG_BATCH_BYTES - batch_len < LOG_RECORD_OUT_MAX) {
+                write_all(ring->fd, batch, batch_len);
+                batch_len = 0;
+            }
+            if(ring->binary) {
+                batch_len += encode_log_record(ring, record, batch + batch_len, LOG_BATCH_BYTES - batch_len);
+            } else {
+                batch_len += format_log_record(record, batch + batch_len, LOG_BATCH_BYTES - batch_len);
+            }
+            atomic_store_explicit(&record->seq, ring->dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+            ring->dequeue_pos++;
+            continue;
+        }
+
+        // The ring is empty, write the batch and stop or wait for more
+        if(batch_len > 0) {
+            write_all(ring->fd, batch, batch_len);
+            batch_len = 0;
+        }
+        if(!atomic_load(&ring->running) && atomic_load(&ring->enqueue_pos) == ring->dequeue_pos) {
+            break;
+        }
+        struct timespec idle = {0, LOG_IDLE_NS};
+        nanosleep(&idle, NULL);
+    }
+    free(batch);
+    return NULL;
+}
+
+void write_all(int fd, const char *buf, size_t len) {
+    while(len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+int parse_exchange_options(int argc, char **argv, struct exchange_config *config) {
+    static struct option long_options[] = {
+        {"aggregate-fills", no_argument, NULL, 'a'},
+        {"fill-vwap", no_argument, NULL, 'w'},
+        {"fee-file", required_argument, NULL, 'f'},
+        {"cancel-on-disconnect", no_argument, NULL, 'c'},
+        {"batch-interval", required_argument, NULL, 'i'},
+        {"batch-size", required_argument, NULL, 'n'},
+        {"pre-open", required_argument, NULL, 'p'},
+        {"binary-log", required_argument, NULL, 'b'},
+        {"book-diffs", no_argument, NULL, 'd'},
+        {"compact-positions", no_argument, NULL, 'm'},
+        {"snapshot-every", required_argument, NULL, 's'},
+        {"snapshot-interval", required_argument, NULL, 't'},
+        {"snapshot-file", required_argument, NULL, 'o'},
+        {"journal", required_argument, NULL, 'j'},
+        {"journal-sync", required_argument, NULL, 'y'},
+        {"replay", required_argument, NULL, 'r'},
+        {"checkpoint", required_argument, NULL, 'k'},
+        {"checkpoint-every", required_argument, NULL, 'e'},
+        {"recover", required_argument, NULL, 'l'},
+        {"verbosity", required_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // Default options keep the exchange behaviour of the spec
+    config->fill_report = FILL_PER_MATCH;
+    config->fee_file = NULL;
+    config->cancel_on_disconnect = 0;
+    config->batch_auction = 0;
+    config->batch_interval_ms = 0;
+    config->batch_size = 0;
+    config->pre_open_ms = 0;
+    config->binary_log = NULL;
+    config->book_diffs = 0;
+    config->compact_positions = 0;
+    config->snapshot_every = 0;
+    config->snapshot_interval_ms = 0;
+    config->snapshot_file = NULL;
+    config->journal_file = NULL;
+    config->journal_sync = JOURNAL_SYNC_BATCH;
+    config->replay_file = NULL;
+    config->checkpoint_file = NULL;
+    config->checkpoint_every = 0;
+    config->recover_file = NULL;
+    config->verbosity = LOG_FULL;
+
+    // Leading '+' stops at the products file, so trader args are never permuted
+    int opt;
+    optind = 1;
+    while((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                config->fill_report = FILL_AGGREGATE;
+                break;
+
+            case 'w':
+                config->fill_report = FILL_AGGREGATE_VWAP;
+                break;
+
+            case 'f':
+                config->fee_file = optarg;
+                break;
+
+            case 'c':
+                config->cancel_on_disconnect = 1;
+                break;
+
+            case 'i':
+                config->batch_interval_ms = atoi(optarg);
+                if(config->batch_interval_ms <= 0) {
+                    return -1;
+                }
+                config->batch_auction = 1;
+                break;
+
+            case 'n':
+                config->batch_size = atoi(optarg);
+                if(config->batch_size <= 0) {
+                    return -1;
+                }
+                config->batch_auction = 1;
+                break;
+
+            case 'p':
+                config->pre_open_ms = atoi(optarg);
+                if(config->pre_open_ms <= 0) {
+                    return -1;
+                }
+                break;
+
+            case 'b':
+                config->binary_log = optarg;
+                break;
+
+            case 'd':
+                config->book_diffs = 1;
+                break;
+
+            case 'm':
+                config->compact_positions = 1;
+                break;
+
+            case 's':
+                config->snapshot_every = atoi(optarg);
+                if(config->snapshot_every <= 0) {
+                    return -1;
+                }
+                break;
+
+            case 't':
+                config->snapshot_interval_ms = atoi(optarg);
+                if(config->snapshot_interval_ms <= 0) {
+                    return -1;
+                }
+                break;
+
+            case 'o':
+                config->snapshot_file = optarg;
+                break;
+
+            case 'j':
+                config->journal_file = optarg;
+                break;
+
+            case 'r':
+                config->replay_file = optarg;
+                break;
+
+            case 'k':
+                // The temporary file next to it must have a path too
+                if(strlen(optarg) + strlen(CHECKPOINT_TMP_SUFFIX) >= PATH_MAX) {
+                    return -1;
+                }
+                config->checkpoint_file = optarg;
+                break;
+
+            case 'e':
+                config->checkpoint_every = atoi(optarg);
+                if(config->checkpoint_every <= 0) {
+                    return -1;
+                }
+                break;
+
+            case 'l':
+                config->recover_file = optarg;
+                break;
+
+            case 'y':
+                if(strcmp(optarg, "batch") == 0) {
+                    config->journal_sync = JOURNAL_SYNC_BATCH;
+                } else if(strcmp(optarg, "always") == 0) {
+                    config->journal_sync = JOURNAL_SYNC_ALWAYS;
+                } else if(strcmp(optarg, "none") == 0) {
+                    config->journal_sync = JOURNAL_SYNC_NONE;
+                } else {
+                    return -1;
+                }
+                break;
+
+            case 'v':
+                if(strcmp(optarg, "full") == 0) {
+                    config->verbosity = LOG_FULL;
+                } else if(strcmp(optarg, "matches") == 0) {
+                    config->verbosity = LOG_MATCHES;
+                } else if(strcmp(optarg, "errors") == 0) {
+                    config->verbosity = LOG_ERRORS;
+                } else {
+                    return -1;
+                }
+                break;
+
+            default:
+                return -1;
+        }
+    }
+
+    // A checkpoint is only complete with the journal after its offset
+    if((config->checkpoint_file != NULL && config->journal_file == NULL) || (config->recover_file != NULL && config->replay_file == NULL)) {
+        return -1;
     }
+    return optind;
 }
 
 void read_product_file (const char *filename, struct product_list* products) {
@@ -246,6 +1037,20 @@ void read_product_file (const char *filename, struct product_list* products) {
     }
 
     fclose(fp_product);
+    init_message_templates(products);
+}
+
+void init_message_templates(struct product_list *products) {
+    products->market_prefixes = (char(*)[2][MARKET_PREFIX_MAX])malloc(products->num_products * sizeof(char[2][MARKET_PREFIX_MAX]));
+    products->market_prefix_lens = (int(*)[2])malloc(products->num_products * sizeof(int[2]));
+    if(products->market_prefixes == NULL || products->market_prefix_lens == NULL) {
+        perror("Error allocating message templates");
+        exit(1);
+    }
+    for(int i = 0; i < products->num_products; i++) {
+        products->market_prefix_lens[i][BUY] = snprintf(products->market_prefixes[i][BUY], MARKET_PREFIX_MAX, "MARKET BUY %s ", products->names[i]);
+        products->market_prefix_lens[i][SELL] = snprintf(products->market_prefixes[i][SELL], MARKET_PREFIX_MAX, "MARKET SELL %s ", products->names[i]);
+    }
 }
 
 struct trader_list init_traders (int num_traders, char **trader_names, struct product_list *products) {
@@ -253,6 +1058,21 @@ struct trader_list init_traders (int num_traders, char **trader_names, struct pr
     traders.num_traders = num_traders;
     traders.trader_arr = (struct trader*)malloc(num_traders * sizeof(struct trader));
 
+    // All positions start at zero
+    traders.positions.num_traders = num_traders;
+    traders.positions.num_products = products->num_products;
+    traders.positions.qty = (int*)calloc(num_traders * products->num_products, sizeof(int));
+    traders.positions.profit = (long int*)calloc(num_traders * products->num_products, sizeof(long int));
+
+    // Default fees, the aggressor pays FEE_PERCENTAGE and the resting order nothing
+    traders.fees.num_traders = num_traders;
+    traders.fees.num_products = products->num_products;
+    traders.fees.taker_bps = (int*)malloc(num_traders * products->num_products * sizeof(int));
+    traders.fees.maker_bps = (int*)calloc(num_traders * products->num_products, sizeof(int));
+    for(int i=0; i<num_traders * products->num_products; i++) {
+        traders.fees.taker_bps[i] = FEE_PERCENTAGE * 100;
+    }
+
     // Initialize each trader
     for(int i=0; i<traders.num_traders; i++) {
         traders.trader_arr[i].id = i;
@@ -260,60 +1080,618 @@ struct trader_list init_traders (int num_traders, char **trader_names, struct pr
         traders.trader_arr[i].num_orders = 0;
         traders.trader_arr[i].pid = -1; // Initialize as -1 until fork process
         traders.trader_arr[i].is_alive = 0; // Initialize as not alive until fork process
-        traders.trader_arr[i].positions = (struct position*)malloc(products->num_products * sizeof(struct position));
-
-        // Initialize the product positions of each trader
-        for(int j=0; j<products->num_products; j++) {
-            strcpy(traders.trader_arr[i].positions[j].product, products->names[j]);
-            traders.trader_arr[i].positions[j].qty = 0;
-            traders.trader_arr[i].positions[j].profit = 0;
-        }
-
+        traders.trader_arr[i].order_head = ORDER_NIL;
+        traders.trader_arr[i].num_resting = 0;
     }
     return traders;
 }
 
 void free_traders(struct trader_list *traders) {
-    // Free positions of each trader
-    for(int i = 0; i < traders->num_traders; i++) {
-        free(traders->trader_arr[i].positions);
-    }
+    // Free positions of all traders
+    free(traders->positions.qty);
+    free(traders->positions.profit);
+    // Free fee schedule
+    free(traders->fees.taker_bps);
+    free(traders->fees.maker_bps);
     // Free traders array
     free(traders->trader_arr);
 }
 
-int get_traderid_by_pid(struct trader_list *traders, int pid) {
-    for(int id=0; id<traders->num_traders; id++) {
-        if(traders->trader_arr[id].pid == pid) {
-            return id;
-        }
+void read_fee_file(const char *filename, struct trader_list *traders, struct product_list *products) {
+    FILE *fp_fee = fopen(filename, "r");
+    if(fp_fee == NULL) {
+        perror("Error opening fee file");
+        exit(1);
     }
-    return -1; // No such trader
-}
 
-struct order_list* init_order_book(int num_products) {
-   struct order_list *order_book = (struct order_list*)malloc(num_products * sizeof(struct order_list));
+    char line[BUF_LEN];
+    int line_num = 0;
+    while(fgets(line, BUF_LEN, fp_fee) != NULL) {
+        line_num++;
+        // Skip comments and blank lines
+        char *comment = strchr(line, '#');
+        if(comment != NULL) {
+            *comment = '\0';
+        }
+        char product[PRODUCT_NAME_MAX] = {'\0'};
+        char trader[INT_LEN] = {'\0'};
+        int taker_bps, maker_bps;
+        char extra;
+        int ret = sscanf(line, "%"TO_STRING(PRODUCT_STR_LEN)"s %11s %d %d %c", product, trader, &taker_bps, &maker_bps, &extra);
+        if(ret == EOF) {
+            continue;
+        }
 
-   // Initialize the buy and sell order list for each product
-   for(int i=0; i<num_products; i++) {
-        order_book[i].buy_head = NULL;
-        order_book[i].sell_head = NULL;
-        order_book[i].buy_list_size = 0;
-        order_book[i].sell_list_size = 0;
-        order_book[i].buy_levels = 0;
-        order_book[i].sell_levels = 0;
-   }
+        // Check the rule
+        int product_idx = -1;
+        int trader_id = -1;
+        int is_valid = (ret == 4);
+        if(is_valid && strcmp(product, "*") != 0) {
+            product_idx = get_productid_by_name(product, products);
+            is_valid = (product_idx != -1);
+        }
+        if(is_valid && strcmp(trader, "*") != 0) {
+            char *end;
+            trader_id = (int)strtol(trader, &end, 10);
+            is_valid = (*end == '\0' && trader_id >= 0 && trader_id < traders->num_traders);
+        }
+        if(is_valid) {
+            is_valid = (abs(taker_bps) <= FEE_BPS_DENOMINATOR && abs(maker_bps) <= FEE_BPS_DENOMINATOR);
+        }
+        if(!is_valid) {
+            fprintf(stderr, "Error in fee file %s line %d\n", filename, line_num);
+            exit(1);
+        }
+
+        // Apply the rule to the matching cells
+        for(int i=0; i<products->num_products; i++) {
+            if(product_idx != -1 && i != product_idx) {
+                continue;
+            }
+            for(int id=0; id<traders->num_traders; id++) {
+                if(trader_id != -1 && id != trader_id) {
+                    continue;
+                }
+                FEE_TAKER_BPS(&traders->fees, id, i) = taker_bps;
+                FEE_MAKER_BPS(&traders->fees, id, i) = maker_bps;
+            }
+        }
+    }
+    fclose(fp_fee);
+}
+
+long int compute_fee(long int match_value, int bps) {
+    // Integer form of round(match_value * bps / 10000.0), the division by a
+    // constant compiles to a multiply and shift
+    long int scaled = match_value * bps;
+    if(scaled < 0) {
+        return -((-scaled + FEE_BPS_DENOMINATOR / 2) / FEE_BPS_DENOMINATOR);
+    }
+    return (scaled + FEE_BPS_DENOMINATOR / 2) / FEE_BPS_DENOMINATOR;
+}
+
+long int product_net_exposure(struct trader_list *traders, int product_idx) {
+    // One contiguous column of the matrix
+    int *column = &POSITION_QTY(&traders->positions, 0, product_idx);
+    long int net = 0;
+    for(int id=0; id<traders->num_traders; id++) {
+        net += column[id];
+    }
+    return net;
+}
+
+int get_traderid_by_pid(struct trader_list *traders, int pid) {
+    for(int id=0; id<traders->num_traders; id++) {
+        if(traders->trader_arr[id].pid == pid) {
+            return id;
+        }
+    }
+    return -1; // No such trader
+}
+
+void init_order_pool(struct order_pool *pool, uint32_t capacity) {
+    pool->orders = (struct book_order*)malloc(capacity * sizeof(struct book_order));
+    pool->info = (struct order_info*)malloc(capacity * sizeof(struct order_info));
+    pool->capacity = capacity;
+    pool->used = 1; // Slot 0 is reserved as ORDER_NIL
+    pool->free_head = ORDER_NIL;
+}
+
+uint32_t alloc_book_order(struct order_pool *pool) {
+    // Reuse a released slot first
+    if(pool->free_head != ORDER_NIL) {
+        uint32_t ref = pool->free_head;
+        pool->free_head = pool->orders[ref].next;
+        return ref;
+    }
+
+    // Double the pool when it is full
+    if(pool->used == pool->capacity) {
+        pool->capacity *= 2;
+        pool->orders = (struct book_order*)realloc(pool->orders, pool->capacity * sizeof(struct book_order));
+        pool->info = (struct order_info*)realloc(pool->info, pool->capacity * sizeof(struct order_info));
+        if(pool->orders == NULL || pool->info == NULL) {
+            perror("Error growing order pool");
+            exit(1);
+        }
+    }
+    return pool->used++;
+}
+
+void release_book_order(struct order_pool *pool, uint32_t ref) {
+    pool->orders[ref].next = pool->free_head;
+    pool->free_head = ref;
+}
+
+void free_order_pool(struct order_pool *pool) {
+    free(pool->orders);
+    free(pool->info);
+    pool->orders = NULL;
+    pool->info = NULL;
+    pool->capacity = 0;
+    pool->used = 0;
+    pool->free_head = ORDER_NIL;
+}
+
+void init_level_pool(struct level_pool *pool, uint32_t capacity) {
+    pool->levels = (struct price_level*)malloc(capacity * sizeof(struct price_level));
+    pool->capacity = capacity;
+    pool->used = 1; // Slot 0 is reserved as LEVEL_NIL
+    pool->free_head = LEVEL_NIL;
+}
+
+uint32_t alloc_price_level(struct level_pool *pool) {
+    // Reuse a released slot first
+    if(pool->free_head != LEVEL_NIL) {
+        uint32_t ref = pool->free_head;
+        pool->free_head = pool->levels[ref].next;
+        return ref;
+    }
+
+    // Double the pool when it is full
+    if(pool->used == pool->capacity) {
+        pool->capacity *= 2;
+        pool->levels = (struct price_level*)realloc(pool->levels, pool->capacity * sizeof(struct price_level));
+        if(pool->levels == NULL) {
+            perror("Error growing level pool");
+            exit(1);
+        }
+    }
+    return pool->used++;
+}
+
+void release_price_level(struct level_pool *pool, uint32_t ref) {
+    pool->levels[ref].next = pool->free_head;
+    pool->free_head = ref;
+}
+
+void free_level_pool(struct level_pool *pool) {
+    free(pool->levels);
+    pool->levels = NULL;
+    pool->capacity = 0;
+    pool->used = 0;
+    pool->free_head = LEVEL_NIL;
+}
+
+struct order_list* init_order_book(int num_products) {
+   // The resting orders and levels of all products share one pool each
+   init_order_pool(&order_pool, ORDER_POOL_BASE);
+   init_level_pool(&level_pool, LEVEL_POOL_BASE);
+   init_timer_wheel(&timer_wheel);
+
+   // No stop orders yet, the stop books grow on the first order
+   stop_books = (struct stop_book*)calloc(num_products, sizeof(struct stop_book));
+
+   struct order_list *order_book = (struct order_list*)malloc(num_products * sizeof(struct order_list));
+
+   // Initialize the buy and sell order list for each product
+   for(int i=0; i<num_products; i++) {
+        order_book[i].buy_head = ORDER_NIL;
+        order_book[i].sell_head = ORDER_NIL;
+        order_book[i].buy_level_head = LEVEL_NIL;
+        order_book[i].sell_level_head = LEVEL_NIL;
+        order_book[i].buy_list_size = 0;
+        order_book[i].sell_list_size = 0;
+        order_book[i].buy_levels = 0;
+        order_book[i].sell_levels = 0;
+        order_book[i].last_price = 0;
+        order_book[i].batch_orders = 0;
+        order_book[i].batch_deadline = 0;
+   }
    return order_book;
 }
 
-void free_order_list(struct order *head) {
-    struct order* cursor;
+void init_timer_wheel(struct timer_wheel *wheel) {
+    wheel->now = 0;
+    wheel->num_timers = 0;
+    for(int i=0; i<TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++) {
+        wheel->slots[i] = ORDER_NIL;
+    }
+}
+
+uint32_t current_tick(void) {
+    static struct timespec start = {0, 0};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(start.tv_sec == 0 && start.tv_nsec == 0) {
+        start = now;
+    }
+    long int elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    return clock_base_tick + (uint32_t)(elapsed_ms / TIMER_TICK_MS);
+}
+
+void resume_clock(uint32_t tick) {
+    clock_base_tick = 0;
+    clock_base_tick = tick - current_tick();
+}
+
+void place_order_timer(struct timer_wheel *wheel, uint32_t ref) {
+    struct order_info *info = ORDER_INFO(ref);
+    uint32_t expire_tick = info->expire_tick;
+
+    // The level is the first whose slots cover the distance to the expiry
+    uint32_t delta = expire_tick - wheel->now;
+    int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >= (1u << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = level * TIMER_WHEEL_SLOTS + ((expire_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+
+    // Push at the head of the slot
+    info->timer_slot = slot;
+    info->timer_prev = ORDER_NIL;
+    info->timer_next = wheel->slots[slot];
+    if(wheel->slots[slot]) {
+        ORDER_INFO(wheel->slots[slot])->timer_prev = ref;
+    }
+    wheel->slots[slot] = ref;
+    wheel->num_timers++;
+}
+
+void arm_order_timer(struct timer_wheel *wheel, uint32_t ref, uint32_t expire_tick) {
+    // The slot of the current tick was already taken
+    if((int32_t)(expire_tick - wheel->now) <= 0) {
+        expire_tick = wheel->now + 1;
+    }
+    ORDER_INFO(ref)->expire_tick = expire_tick;
+    place_order_timer(wheel, ref);
+}
+
+void disarm_order_timer(struct timer_wheel *wheel, uint32_t ref) {
+    struct order_info *info = ORDER_INFO(ref);
+    if(info->timer_slot == TIMER_NONE) {
+        return;
+    }
+    if(info->timer_prev) {
+        ORDER_INFO(info->timer_prev)->timer_next = info->timer_next;
+    } else {
+        wheel->slots[info->timer_slot] = info->timer_next;
+    }
+    if(info->timer_next) {
+        ORDER_INFO(info->timer_next)->timer_prev = info->timer_prev;
+    }
+    info->timer_slot = TIMER_NONE;
+    wheel->num_timers--;
+}
+
+uint32_t advance_timer_wheel(struct timer_wheel *wheel, uint32_t target_tick) {
+    uint32_t expired_head = ORDER_NIL;
+    uint32_t expired_tail = ORDER_NIL;
+
+    while((int32_t)(target_tick - wheel->now) > 0) {
+        // Nothing armed, jump straight to the target
+        if(wheel->num_timers == 0) {
+            wheel->now = target_tick;
+            break;
+        }
+        wheel->now++;
+
+        // Cascade the higher level slots whose turn has come, from the top down
+        int cascade_levels = 0;
+        while(cascade_levels < TIMER_WHEEL_LEVELS - 1 && ((wheel->now >> (TIMER_WHEEL_BITS * cascade_levels)) & TIMER_WHEEL_MASK) == 0) {
+            cascade_levels++;
+        }
+        for(int level = cascade_levels; level > 0; level--) {
+            int slot = level * TIMER_WHEEL_SLOTS + ((wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+            uint32_t ref = wheel->slots[slot];
+            wheel->slots[slot] = ORDER_NIL;
+            while(ref) {
+                uint32_t next = ORDER_INFO(ref)->timer_next;
+                wheel->num_timers--;
+                place_order_timer(wheel, ref);
+                ref = next;
+            }
+        }
+
+        // Take the whole level 0 slot of this tick
+        int slot = wheel->now & TIMER_WHEEL_MASK;
+        uint32_t ref = wheel->slots[slot];
+        wheel->slots[slot] = ORDER_NIL;
+        while(ref) {
+            struct order_info *info = ORDER_INFO(ref);
+            uint32_t next = info->timer_next;
+            info->timer_slot = TIMER_NONE;
+            info->timer_next = ORDER_NIL;
+            if(expired_tail) {
+                ORDER_INFO(expired_tail)->timer_next = ref;
+            } else {
+                expired_head = ref;
+            }
+            expired_tail = ref;
+            wheel->num_timers--;
+            ref = next;
+        }
+    }
+    return expired_head;
+}
+
+int expire_orders(int *fds_exchange, uint32_t target_tick) {
+    uint32_t expired = advance_timer_wheel(&timer_wheel, target_tick);
+    if(expired == ORDER_NIL) {
+        return 0;
+    }
+    journal_event("EXPIRE", fds_exchange);
+
+    int num_expired = 0;
+    for(uint32_t ref = expired; ref; ref = ORDER_INFO(ref)->timer_next) {
+        num_expired++;
+    }
+
+    // Each trader gets one write, CANCELLED for its own orders and MARKET for the others
+    size_t batch_cap = (size_t)num_expired * BUF_LEN + 1;
+    char *batch = (char*)malloc(batch_cap);
+    for(int id=0; id<traders.num_traders; id++) {
+        if(!traders.trader_arr[id].is_alive) {
+            continue;
+        }
+        size_t batch_len = 0;
+        for(uint32_t ref = expired; ref; ref = ORDER_INFO(ref)->timer_next) {
+            struct book_order *order = ORDER_AT(ref);
+            struct order_info *info = ORDER_INFO(ref);
+            if(order->trader_id == id) {
+                batch_len += format_message(batch + batch_len, MSG_PREFIX("CANCELLED "), 1, (long int[]){order->order_id});
+            } else {
+                batch_len += format_message(batch + batch_len, products.market_prefixes[info->product_idx][info->order_type], products.market_prefix_lens[info->product_idx][info->order_type], 2, (long int[]){0, 0});
+            }
+        }
+        send_to_trader(fds_exchange, id, batch, batch_len);
+    }
+    free(batch);
+
+    // Remove the expired orders from the book
+    uint32_t ref = expired;
+    while(ref) {
+        uint32_t next = ORDER_INFO(ref)->timer_next;
+        remove_book_order(&(order_book[ORDER_INFO(ref)->product_idx]), ORDER_INFO(ref)->order_type, ref);
+        ref = next;
+    }
+
+    PEX_LOG(LOG_FULL, LOG_PREFIX" Expired %d orders\n", num_expired);
+    show_book_update();
+    return num_expired;
+}
+
+void add_to_batch(int product_idx) {
+    struct order_list *product_orders = &(order_book[product_idx]);
+    if(product_orders->batch_orders == 0 && config.batch_interval_ms > 0) {
+        product_orders->batch_deadline = timer_wheel.now + (config.batch_interval_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        num_pending_batches++;
+    }
+    product_orders->batch_orders++;
+}
+
+int joins_batch(struct order *received_order) {
+    return (config.batch_auction || pre_open_pending) && received_order->stop_price == 0 &&
+        (received_order->tif == TIF_DAY || received_order->tif == TIF_GTT);
+}
+
+int auction_clearing_price(int product_idx, int *clearing_qty) {
+    struct order_list *product_orders = &(order_book[product_idx]);
+    *clearing_qty = 0;
+    if(product_orders->buy_level_head == LEVEL_NIL || product_orders->sell_level_head == LEVEL_NIL) {
+        return 0;
+    }
+    int best_bid = LEVEL_AT(product_orders->buy_level_head)->price;
+    int best_ask = LEVEL_AT(product_orders->sell_level_head)->price;
+    if(best_bid < best_ask) {
+        return 0;
+    }
+
+    // The buy quantity at the lowest crossing price is every buy level down to the best ask
+    long int buy_qty = 0;
+    uint32_t buy_ref = product_orders->buy_level_head;
+    while(1) {
+        buy_qty += LEVEL_AT(buy_ref)->total_qty;
+        uint32_t next = LEVEL_AT(buy_ref)->next;
+        if(next == LEVEL_NIL || LEVEL_AT(next)->price < best_ask) {
+            break;
+        }
+        buy_ref = next;
+    }
+
+    // Walk the crossing prices upwards, the buy levels back from the lowest and the sell
+    // levels from the best. At each price the sell quantity has grown by the sells at
+    // the price, and the buy quantity shrinks by the buys at it after the price is checked.
+    uint32_t sell_ref = product_orders->sell_level_head;
+    long int sell_qty = 0;
+    int last_price = product_orders->last_price;
+    int clearing_price = 0;
+    long int best_imbalance = 0;
+    while(buy_ref || sell_ref) {
+        int price;
+        if(sell_ref == LEVEL_NIL || (buy_ref && LEVEL_AT(buy_ref)->price < LEVEL_AT(sell_ref)->price)) {
+            price = LEVEL_AT(buy_ref)->price;
+        } else {
+            price = LEVEL_AT(sell_ref)->price;
+        }
+        if(sell_ref && LEVEL_AT(sell_ref)->price == price) {
+            sell_qty += LEVEL_AT(sell_ref)->total_qty;
+            sell_ref = LEVEL_AT(sell_ref)->next;
+            if(sell_ref && LEVEL_AT(sell_ref)->price > best_bid) {
+                sell_ref = LEVEL_NIL;
+            }
+        }
+
+        int matched = buy_qty < sell_qty ? buy_qty : sell_qty;
+        long int imbalance = labs(buy_qty - sell_qty);
+        int is_better = matched > *clearing_qty;
+        if(matched == *clearing_qty && matched > 0) {
+            if(imbalance != best_imbalance) {
+                is_better = imbalance < best_imbalance;
+            } else if(abs(price - last_price) != abs(clearing_price - last_price)) {
+                is_better = abs(price - last_price) < abs(clearing_price - last_price);
+            } else {
+                is_better = price < clearing_price;
+            }
+        }
+        if(is_better) {
+            clearing_price = price;
+            *clearing_qty = matched;
+            best_imbalance = imbalance;
+        }
+
+        if(buy_ref && LEVEL_AT(buy_ref)->price == price) {
+            buy_qty -= LEVEL_AT(buy_ref)->total_qty;
+            buy_ref = LEVEL_AT(buy_ref)->prev;
+        }
+    }
+    return clearing_price;
+}
+
+void execute_auction_match(struct book_order *buy_order, struct book_order *sell_order, int match_qty, int price, int product_idx, int *fds_exchange) {
+    long int match_value = (long int)match_qty * price;
+    // Neither side took liquidity, both pay the maker fee
+    long int buy_fee = compute_fee(match_value, FEE_MAKER_BPS(&traders.fees, buy_order->trader_id, product_idx));
+    long int sell_fee = compute_fee(match_value, FEE_MAKER_BPS(&traders.fees, sell_order->trader_id, product_idx));
+
+    PEX_LOG(LOG_MATCHES, LOG_PREFIX" Auction match: Buy Order %d [T%d], Sell Order %d [T%d], value: $%ld, fee: $%ld.\n", buy_order->order_id, buy_order->trader_id, sell_order->order_id, sell_order->trader_id, match_value, buy_fee + sell_fee);
+
+    notify_filler(fds_exchange, buy_order->trader_id, buy_order->order_id, match_qty);
+    notify_filler(fds_exchange, sell_order->trader_id, sell_order->order_id, match_qty);
+
+    buy_order->qty -= match_qty;
+    sell_order->qty -= match_qty;
+
+    struct position_matrix *positions = &traders.positions;
+    POSITION_QTY(positions, buy_order->trader_id, product_idx) += match_qty;
+    POSITION_PROFIT(positions, buy_order->trader_id, product_idx) -= (match_value + buy_fee);
+    POSITION_QTY(positions, sell_order->trader_id, product_idx) -= match_qty;
+    POSITION_PROFIT(positions, sell_order->trader_id, product_idx) += (match_value - sell_fee);
+    mark_position_dirty(buy_order->trader_id, product_idx);
+    mark_position_dirty(sell_order->trader_id, product_idx);
+
+    order_book[product_idx].last_price = price;
+    exchange_fees += buy_fee + sell_fee;
+}
+
+int run_auction(int product_idx, int *fds_exchange) {
+    struct order_list *product_orders = &(order_book[product_idx]);
+    int had_batch = product_orders->batch_orders > 0;
+
+    // Close the batch, the orders arriving from now on join the next one
+    if(had_batch && config.batch_interval_ms > 0) {
+        num_pending_batches--;
+    }
+    product_orders->batch_orders = 0;
+
+    int clearing_qty;
+    int clearing_price = auction_clearing_price(product_idx, &clearing_qty);
+    if(clearing_qty > 0) {
+        PEX_LOG(LOG_MATCHES, LOG_PREFIX" Auction %s: %d at $%d\n", products.names[product_idx], clearing_qty, clearing_price);
+    }
+
+    // Both sides fill in price-time priority, the first clearing_qty of each side
+    // sits at levels that accept the clearing price
+    int remaining = clearing_qty;
+    while(remaining > 0) {
+        uint32_t buy_ref = product_orders->buy_head;
+        uint32_t sell_ref = product_orders->sell_head;
+        struct book_order *buy_order = ORDER_AT(buy_ref);
+        struct book_order *sell_order = ORDER_AT(sell_ref);
+
+        int match_qty = remaining;
+        if(buy_order->qty < match_qty) {
+            match_qty = buy_order->qty;
+        }
+        if(sell_order->qty < match_qty) {
+            match_qty = sell_order->qty;
+        }
+        execute_auction_match(buy_order, sell_order, match_qty, clearing_price, product_idx, fds_exchange);
+        mark_level_dirty(product_idx, BUY, buy_order->price);
+        mark_level_dirty(product_idx, SELL, sell_order->price);
+        LEVEL_AT(buy_order->level)->total_qty -= match_qty;
+        LEVEL_AT(sell_order->level)->total_qty -= match_qty;
+        remaining -= match_qty;
+
+        // Refill a filled iceberg from its reserve, or remove the filled order
+        if(buy_order->qty == 0) {
+            if(buy_order->reserve_qty > 0) {
+                replenish_iceberg(product_orders, BUY, buy_ref);
+            } else {
+                remove_book_order(product_orders, BUY, buy_ref);
+            }
+        }
+        if(sell_order->qty == 0) {
+            if(sell_order->reserve_qty > 0) {
+                replenish_iceberg(product_orders, SELL, sell_ref);
+            } else {
+                remove_book_order(product_orders, SELL, sell_ref);
+            }
+        }
+    }
+
+    if(clearing_qty > 0) {
+        trigger_stop_orders(product_idx, fds_exchange);
+    }
+    return clearing_qty;
+}
+
+int run_batch_auctions(int *fds_exchange, uint32_t now) {
+    int num_auctions = 0;
+    for(int i=0; i<products.num_products; i++) {
+        struct order_list *product_orders = &(order_book[i]);
+        if(product_orders->batch_orders == 0) {
+            continue;
+        }
+        int is_full = config.batch_size > 0 && product_orders->batch_orders >= config.batch_size;
+        int is_due = config.batch_interval_ms > 0 && (int32_t)(now - product_orders->batch_deadline) >= 0;
+        if(is_full || is_due) {
+            char record[INT_LEN + 9];
+            snprintf(record, sizeof(record), "AUCTION %d", i);
+            journal_event(record, fds_exchange);
+            run_auction(i, fds_exchange);
+            num_auctions++;
+        }
+    }
+
+    // Print the book once for all auctions
+    if(num_auctions > 0) {
+        show_book_update();
+    }
+    return num_auctions;
+}
+
+int open_market(int *fds_exchange) {
+    pre_open_pending = 0;
+    journal_event("OPEN", fds_exchange);
+    PEX_LOG(LOG_MATCHES, LOG_PREFIX" Opening auction\n");
+
+    int matched = 0;
+    for(int i=0; i<products.num_products; i++) {
+        matched += run_auction(i, fds_exchange);
+    }
+    show_book_update();
+    return matched;
+}
+
+void free_order_list(uint32_t head) {
+    uint32_t cursor;
 
-    while (head != NULL)
+    while (head != ORDER_NIL)
     {
        cursor = head;
-       head = head->next;
-       free(cursor);
+       head = ORDER_AT(head)->next;
+       release_book_order(&order_pool, cursor);
     }
 }
 
@@ -323,16 +1701,27 @@ void free_order_book(struct order_list *order_book, int num_products) {
         free_order_list(order_book[i].sell_head);
     }
 
+    for (int i = 0; i < num_products; i++) {
+        free(stop_books[i].buy_stops);
+        free(stop_books[i].sell_stops);
+    }
+    free(stop_books);
+
     free(order_book);
+    free_order_pool(&order_pool);
+    free_level_pool(&level_pool);
 }
 
 void show_pex_start(struct product_list *products) {
-    printf(LOG_PREFIX" Starting\n");
-    printf(LOG_PREFIX" Trading %d products:", products->num_products);
+    if(!LOG_ENABLED(LOG_FULL)) {
+        return;
+    }
+    log_printf(LOG_PREFIX" Starting\n");
+    log_printf(LOG_PREFIX" Trading %d products:", products->num_products);
     for(int i=0; i<products->num_products; i++) {
-        printf(" %s", products->names[i]);
+        log_printf(" %s", products->names[i]);
     }
-    printf("\n");
+    log_printf("\n");
 }
 
 void make_connect_fifos(int **fds_exchange, int **fds_trader, struct trader_list *traders) {
@@ -354,7 +1743,7 @@ void make_connect_fifos(int **fds_exchange, int **fds_trader, struct trader_list
             perror("Error making exchange fifo");
             exit(1);
         }
-        printf(LOG_PREFIX" Created FIFO %s\n", fifo_exchange);
+        PEX_LOG(LOG_FULL, LOG_PREFIX" Created FIFO %s\n", fifo_exchange);
 
 		unlink(fifo_trader);
         int mk_trader = mkfifo(fifo_trader, 0666);
@@ -362,7 +1751,7 @@ void make_connect_fifos(int **fds_exchange, int **fds_trader, struct trader_list
             perror("Error making trader fifo");
             exit(1);
         }
-        printf(LOG_PREFIX" Created FIFO %s\n", fifo_trader);
+        PEX_LOG(LOG_FULL, LOG_PREFIX" Created FIFO %s\n", fifo_trader);
 
         // Launch trader
         launch_trader(traders, id);
@@ -373,14 +1762,14 @@ void make_connect_fifos(int **fds_exchange, int **fds_trader, struct trader_list
             perror("Error opening fifo_exchange");
             exit(1);
         }
-        printf(LOG_PREFIX" Connected to %s\n", fifo_exchange);
+        PEX_LOG(LOG_FULL, LOG_PREFIX" Connected to %s\n", fifo_exchange);
 
         (*fds_trader)[id] = open(fifo_trader, O_RDONLY);
         if ((*fds_trader)[id] == -1) {
             perror("Error opening fifo_trader");
             exit(1);
         }
-        printf(LOG_PREFIX" Connected to %s\n", fifo_trader);
+        PEX_LOG(LOG_FULL, LOG_PREFIX" Connected to %s\n", fifo_trader);
     }
 }
 
@@ -391,7 +1780,7 @@ void launch_trader(struct trader_list *traders, int trader_id) {
         traders->trader_arr[trader_id].is_alive = 1;
         num_alive_traders++;
         traders->trader_arr[trader_id].pid = pid;
-        printf(LOG_PREFIX " Starting trader %d (%s)\n", trader_id, traders->trader_arr[trader_id].name);
+        PEX_LOG(LOG_FULL, LOG_PREFIX " Starting trader %d (%s)\n", trader_id, traders->trader_arr[trader_id].name);
     } else if (pid == 0) {
         // Child process, execute current trader
         char trader_id_str[INT_LEN] = {'\0'};
@@ -428,8 +1817,8 @@ int get_productid_by_name(char *product_name, struct product_list *products) {
 
 enum OrderResponseType parse_command(int *fds_trader, int trader_id, struct order *received_order) {
     // Read message from trader
-    char command[BUF_LEN] = {'\0'};
-    ssize_t read_len = read(fds_trader[trader_id], command, BUF_LEN-1);
+    char command[CMD_BUF_LEN] = {'\0'};
+    ssize_t read_len = read(fds_trader[trader_id], command, CMD_BUF_LEN-1);
     // If read nothing
     if(read_len <= 0) {
         return NORESPONSE;
@@ -437,45 +1826,215 @@ enum OrderResponseType parse_command(int *fds_trader, int trader_id, struct orde
 
     if(read_len > 0 && command[read_len-1] == ';') {
         command[read_len-1] = '\0';
-        printf(LOG_PREFIX" [T%d] Parsing command: <%s>\n", trader_id, command);
-
-        received_order->trader_id = trader_id;
-        // Check the command type
-        if(strstr(command, "BUY") && is_valid_buy(command, trader_id, received_order)) {
-            return ACCEPTED;
-        } else if(strstr(command, "SELL") && is_valid_sell(command, trader_id, received_order)){
-            return ACCEPTED;
-        } else if(strstr(command, "AMEND") && is_valid_amend(command, trader_id, received_order)) {
-            return AMENDED;
-        } else if(strstr(command, "CANCEL") && is_valid_cancel(command, trader_id, received_order)) {
-            return CANCELLED;
-        } else {
-            received_order->order_type = INVALID_ORDER;
-            return INVALID;
+        PEX_LOG(LOG_FULL, LOG_PREFIX" [T%d] Parsing command: <%s>\n", trader_id, command);
+
+        // Accepted commands join the open journal batch before any response
+        enum OrderResponseType response = classify_command(command, trader_id, received_order);
+        if(response != INVALID && config.journal_file != NULL) {
+            journal_append(&journal, trader_id, command, NULL);
         }
+        return response;
     }
 
     // Invalid reading or no semicolon at end
     return INVALID;
 }
 
+enum OrderResponseType classify_command(char *command, int trader_id, struct order *received_order) {
+    received_order->trader_id = trader_id;
+    // Check the command type, bulk and mass cancel also contain the other keywords
+    if(strncmp(command, "BULK ", 5) == 0) {
+        if(is_valid_bulk(command, trader_id, received_order, &bulk_order)) {
+            return BULK_ACCEPTED;
+        }
+        received_order->order_type = INVALID_ORDER;
+        return INVALID;
+    } else if(strstr(command, "MASSCANCEL")) {
+        if(is_valid_mass_cancel(command, trader_id, received_order)) {
+            return MASS_CANCELLED;
+        }
+        received_order->order_type = INVALID_ORDER;
+        return INVALID;
+    } else if(strstr(command, "BUY") && is_valid_buy(command, trader_id, received_order)) {
+        return ACCEPTED;
+    } else if(strstr(command, "SELL") && is_valid_sell(command, trader_id, received_order)){
+        return ACCEPTED;
+    } else if(strstr(command, "AMEND") && is_valid_amend(command, trader_id, received_order)) {
+        return AMENDED;
+    } else if(strstr(command, "CANCEL") && is_valid_cancel(command, trader_id, received_order)) {
+        return CANCELLED;
+    } else {
+        received_order->order_type = INVALID_ORDER;
+        return INVALID;
+    }
+}
+
+void open_journal(struct journal *journal, const char *filename, int num_traders, int num_products) {
+    journal->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if(journal->fd == -1) {
+        perror("Error opening journal");
+        exit(1);
+    }
+    struct stat journal_stat;
+    if(fstat(journal->fd, &journal_stat) == -1) {
+        perror("Error reading journal size");
+        exit(1);
+    }
+    journal->offset = journal_stat.st_size;
+    journal->buf = (char*)malloc(JOURNAL_BUF_LEN);
+    journal->len = 0;
+    journal->num_pending = 0;
+    journal->num_commits = 0;
+    journal->num_traders = num_traders;
+    journal->outboxes = (struct outbox*)malloc(num_traders * sizeof(struct outbox));
+    if(journal->buf == NULL || journal->outboxes == NULL) {
+        perror("Error allocating journal");
+        exit(1);
+    }
+    for(int id=0; id<num_traders; id++) {
+        journal->outboxes[id].buf = (char*)malloc(OUTBOX_LEN);
+        journal->outboxes[id].len = 0;
+        if(journal->outboxes[id].buf == NULL) {
+            perror("Error allocating outbox");
+            exit(1);
+        }
+    }
+
+    // A new journal starts with its header and a new id, an existing one is appended to under its id
+    if(journal->offset == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        journal->id = now.tv_sec * 1000000000L + now.tv_nsec;
+        journal->len = snprintf(journal->buf, JOURNAL_BUF_LEN, JOURNAL_MAGIC" %d %d %ld\n", num_traders, num_products, journal->id);
+        commit_journal(journal, NULL);
+    } else {
+        char header[BUF_LEN] = {0};
+        if(pread(journal->fd, header, sizeof(header) - 1, 0) == -1 || sscanf(header, JOURNAL_MAGIC" %*d %*d %ld", &journal->id) != 1) {
+            fprintf(stderr, "Error in journal %s header\n", filename);
+            exit(1);
+        }
+    }
+}
+
+void close_journal(struct journal *journal, int *fds_exchange) {
+    commit_journal(journal, fds_exchange);
+    close(journal->fd);
+    for(int id=0; id<journal->num_traders; id++) {
+        free(journal->outboxes[id].buf);
+    }
+    free(journal->outboxes);
+    free(journal->buf);
+    journal->outboxes = NULL;
+    journal->buf = NULL;
+    journal->fd = -1;
+}
+
+void journal_append(struct journal *journal, int trader_id, const char *record, int *fds_exchange) {
+    size_t record_len = strlen(record);
+    if(journal->len + record_len + 2 * INT_LEN + 3 > JOURNAL_BUF_LEN) {
+        commit_journal(journal, fds_exchange);
+    }
+    journal->len += format_int(journal->buf + journal->len, timer_wheel.now);
+    journal->buf[journal->len++] = ' ';
+    if(trader_id != -1) {
+        journal->len += format_int(journal->buf + journal->len, trader_id);
+        journal->buf[journal->len++] = ' ';
+    }
+    memcpy(journal->buf + journal->len, record, record_len);
+    journal->len += record_len;
+    journal->buf[journal->len++] = '\n';
+    journal->num_pending++;
+}
+
+void journal_event(const char *record, int *fds_exchange) {
+    if(config.journal_file != NULL && !replaying) {
+        journal_append(&journal, -1, record, fds_exchange);
+    }
+}
+
+void commit_journal(struct journal *journal, int *fds_exchange) {
+    if(journal->len > 0) {
+        write_all(journal->fd, journal->buf, journal->len);
+        if(config.journal_sync != JOURNAL_SYNC_NONE && fdatasync(journal->fd) == -1) {
+            perror("Error syncing journal");
+            exit(1);
+        }
+        journal->offset += journal->len;
+        journal->len = 0;
+        journal->num_commits++;
+    }
+    journal->num_pending = 0;
+
+    // The batch is durable, release its messages with one write and one signal per trader
+    for(int id=0; id<journal->num_traders && fds_exchange != NULL; id++) {
+        struct outbox *outbox = &journal->outboxes[id];
+        if(outbox->len > 0) {
+            if(traders.trader_arr[id].is_alive) {
+                write(fds_exchange[id], outbox->buf, outbox->len);
+                kill(traders.trader_arr[id].pid, SIGUSR1);
+            }
+            outbox->len = 0;
+        }
+    }
+}
+
+void send_to_trader(int *fds_exchange, int trader_id, const char *msg, size_t len) {
+    if(replaying) {
+        return;
+    }
+    if(config.journal_file == NULL) {
+        write(fds_exchange[trader_id], msg, len);
+        kill(traders.trader_arr[trader_id].pid, SIGUSR1);
+        return;
+    }
+
+    // Commit early rather than hold more than a pipe is sure to take
+    struct outbox *outbox = &journal.outboxes[trader_id];
+    if(outbox->len + len > OUTBOX_LEN) {
+        commit_journal(&journal, fds_exchange);
+    }
+    if(len > OUTBOX_LEN) {
+        write(fds_exchange[trader_id], msg, len);
+        kill(traders.trader_arr[trader_id].pid, SIGUSR1);
+        return;
+    }
+    memcpy(outbox->buf + outbox->len, msg, len);
+    outbox->len += len;
+}
+
 int is_valid_buy(char *command, int trader_id, struct order *received_order) {
     int order_id;
     char product[PRODUCT_NAME_MAX];
     int qty;
     int price;
 
-    int s_ret = sscanf(command, "BUY %d %s %d %d", &order_id, product, &qty, &price);
+    int suffix_offset = 0;
+
+    int s_ret = sscanf(command, "BUY %d %"TO_STRING(PRODUCT_STR_LEN)"s %d %d%n", &order_id, product, &qty, &price, &suffix_offset);
+
+    // A market order has MARKET in place of the price
+    int is_market = 0;
+    if(s_ret == BUY_CMD_ARGS - 1 && sscanf(command, "BUY %d %"TO_STRING(PRODUCT_STR_LEN)"s %d MARKET%n", &order_id, product, &qty, &suffix_offset) == BUY_CMD_ARGS - 1 && suffix_offset > 0) {
+        is_market = 1;
+        price = 0;
+        s_ret = BUY_CMD_ARGS;
+    }
+
     // Error handling
     // Check invalid format, 4 arguments
     if(s_ret != BUY_CMD_ARGS) {
         return 0;
     }
 
-    // Check whether reading result is the same as initial command
+    // Check whether reading result is the same as initial command, up to the optional suffix
     char read_buf[BUF_LEN] = {'\0'};
-    snprintf(read_buf, sizeof(read_buf),"BUY %d %s %d %d", order_id, product, qty, price);
-    if(strcmp(read_buf, command) != 0) {
+    int read_len;
+    if(is_market) {
+        read_len = snprintf(read_buf, sizeof(read_buf),"BUY %d %s %d MARKET", order_id, product, qty);
+    } else {
+        read_len = snprintf(read_buf, sizeof(read_buf),"BUY %d %s %d %d", order_id, product, qty, price);
+    }
+    if(read_len != suffix_offset || strncmp(read_buf, command, read_len) != 0) {
         return 0;
     }
 
@@ -499,7 +2058,7 @@ int is_valid_buy(char *command, int trader_id, struct order *received_order) {
     if(qty < MIN_VALUE || qty > MAX_VALUE) {
         return 0;
     }
-    if(price < MIN_VALUE || price > MAX_VALUE) {
+    if(!is_market && (price < MIN_VALUE || price > MAX_VALUE)) {
         return 0;
     }
     
@@ -510,9 +2069,18 @@ int is_valid_buy(char *command, int trader_id, struct order *received_order) {
     received_order->qty = qty;
     received_order->price = price;
     received_order->trader_id = trader_id;
-    received_order->next = NULL;
+    received_order->target = ORDER_NIL;
     // traders.trader_arr[trader_id].num_orders ++;
-    return 1;
+
+    // A market order takes no suffix
+    if(is_market) {
+        parse_order_suffix("", received_order);
+        received_order->tif = TIF_MARKET;
+        return command[suffix_offset] == '\0';
+    }
+
+    // Check the optional time in force, iceberg clip, expiry or stop price
+    return parse_order_suffix(command + suffix_offset, received_order);
 }
 
 int is_valid_sell(char *command, int trader_id, struct order *received_order) {
@@ -521,17 +2089,33 @@ int is_valid_sell(char *command, int trader_id, struct order *received_order) {
     int qty;
     int price;
 
-    int s_ret = sscanf(command, "SELL %d %s %d %d", &order_id, product, &qty, &price);
-    // Error handling
-    // Check invalid format
+    int suffix_offset = 0;
+
+    int s_ret = sscanf(command, "SELL %d %"TO_STRING(PRODUCT_STR_LEN)"s %d %d%n", &order_id, product, &qty, &price, &suffix_offset);
+
+    // A market order has MARKET in place of the price
+    int is_market = 0;
+    if(s_ret == SELL_CMD_ARGS - 1 && sscanf(command, "SELL %d %"TO_STRING(PRODUCT_STR_LEN)"s %d MARKET%n", &order_id, product, &qty, &suffix_offset) == SELL_CMD_ARGS - 1 && suffix_offset > 0) {
+        is_market = 1;
+        price = 0;
+        s_ret = SELL_CMD_ARGS;
+    }
+
+    // Error handling
+    // Check invalid format, 4 arguments
     if(s_ret != SELL_CMD_ARGS) {
         return 0;
     }
 
-    // Check whether reading result is the same as initial command
+    // Check whether reading result is the same as initial command, up to the optional suffix
     char read_buf[BUF_LEN] = {'\0'};
-    snprintf(read_buf, sizeof(read_buf),"SELL %d %s %d %d", order_id, product, qty, price);
-    if(strcmp(read_buf, command) != 0) {
+    int read_len;
+    if(is_market) {
+        read_len = snprintf(read_buf, sizeof(read_buf),"SELL %d %s %d MARKET", order_id, product, qty);
+    } else {
+        read_len = snprintf(read_buf, sizeof(read_buf),"SELL %d %s %d %d", order_id, product, qty, price);
+    }
+    if(read_len != suffix_offset || strncmp(read_buf, command, read_len) != 0) {
         return 0;
     }
 
@@ -555,7 +2139,7 @@ int is_valid_sell(char *command, int trader_id, struct order *received_order) {
     if(qty < MIN_VALUE || qty > MAX_VALUE) {
         return 0;
     }
-    if(price < MIN_VALUE || price > MAX_VALUE) {
+    if(!is_market && (price < MIN_VALUE || price > MAX_VALUE)) {
         return 0;
     }
 
@@ -566,9 +2150,18 @@ int is_valid_sell(char *command, int trader_id, struct order *received_order) {
     received_order->qty = qty;
     received_order->price = price;
     received_order->trader_id = trader_id;
-    received_order->next = NULL;
+    received_order->target = ORDER_NIL;
     // traders.trader_arr[trader_id].num_orders ++;
-    return 1;
+
+    // A market order takes no suffix
+    if(is_market) {
+        parse_order_suffix("", received_order);
+        received_order->tif = TIF_MARKET;
+        return command[suffix_offset] == '\0';
+    }
+
+    // Check the optional time in force, iceberg clip, expiry or stop price
+    return parse_order_suffix(command + suffix_offset, received_order);
 }
 
 int is_valid_amend(char *command, int trader_id, struct order *received_order) {
@@ -610,40 +2203,58 @@ int is_valid_amend(char *command, int trader_id, struct order *received_order) {
     // Valid amend order
     for(int i=0; i<products.num_products; i++) {
         struct order_list *product_orders = &(order_book[i]);
-        struct order *buy_cursor = product_orders->buy_head;
-        struct order *sell_cursor = product_orders->sell_head;
+        uint32_t buy_cursor = product_orders->buy_head;
+        uint32_t sell_cursor = product_orders->sell_head;
 
         // Check amend buy order
         while(buy_cursor) {
-            if(buy_cursor->order_id == order_id && buy_cursor->trader_id == trader_id) {
+            struct book_order *buy_order = ORDER_AT(buy_cursor);
+            if(buy_order->order_id == order_id && buy_order->trader_id == trader_id) {
                 received_order->order_id = order_id;
                 received_order->trader_id = trader_id;
                 received_order->order_type = BUY;
                 received_order->price = price;
-                strncpy(received_order->product, buy_cursor->product, sizeof(received_order->product) - 1);
-                received_order->next = buy_cursor; // Link the new order to the old one
+                strncpy(received_order->product, products.names[i], sizeof(received_order->product) - 1);
+                received_order->target = buy_cursor; // Link the new order to the old one
                 received_order->qty = qty;
+                received_order->tif = TIF_DAY;
+                received_order->display_qty = ORDER_INFO(buy_cursor)->display_qty; // An amended iceberg keeps its clip
+                received_order->stop_price = 0;
+                if(ORDER_INFO(buy_cursor)->timer_slot != TIMER_NONE) {
+                    // An amended good till time order keeps its expiry
+                    received_order->tif = TIF_GTT;
+                    received_order->expire_tick = ORDER_INFO(buy_cursor)->expire_tick;
+                }
 
                 return 1;
             } else{
-                buy_cursor = buy_cursor->next;
+                buy_cursor = buy_order->next;
             }
         }
 
         // Check amend sell order
         while(sell_cursor) {
-            if(sell_cursor->order_id == order_id && sell_cursor->trader_id == trader_id) {
+            struct book_order *sell_order = ORDER_AT(sell_cursor);
+            if(sell_order->order_id == order_id && sell_order->trader_id == trader_id) {
                 received_order->order_id = order_id;
                 received_order->trader_id = trader_id;
                 received_order->order_type = SELL;
                 received_order->price = price;
-                strncpy(received_order->product, sell_cursor->product, sizeof(received_order->product) - 1);
-                received_order->next = sell_cursor; // Link the new order to the old one
+                strncpy(received_order->product, products.names[i], sizeof(received_order->product) - 1);
+                received_order->target = sell_cursor; // Link the new order to the old one
                 received_order->qty = qty;
+                received_order->tif = TIF_DAY;
+                received_order->display_qty = ORDER_INFO(sell_cursor)->display_qty; // An amended iceberg keeps its clip
+                received_order->stop_price = 0;
+                if(ORDER_INFO(sell_cursor)->timer_slot != TIMER_NONE) {
+                    // An amended good till time order keeps its expiry
+                    received_order->tif = TIF_GTT;
+                    received_order->expire_tick = ORDER_INFO(sell_cursor)->expire_tick;
+                }
 
                 return 1;
             } else {
-                sell_cursor = sell_cursor->next;
+                sell_cursor = sell_order->next;
             }
         }
 
@@ -653,6 +2264,127 @@ int is_valid_amend(char *command, int trader_id, struct order *received_order) {
     return 0;
 }
 
+int is_valid_bulk(char *command, int trader_id, struct order *received_order, struct bulk_order *bulk) {
+    char mode[INT_LEN] = {'\0'};
+    int legs_offset = 0;
+    if(sscanf(command, "BULK %11s %n", mode, &legs_offset) != 1 || legs_offset == 0) {
+        return 0;
+    }
+    if(strcmp(mode, "ATOMIC") == 0) {
+        bulk->is_atomic = 1;
+    } else if(strcmp(mode, "EACH") == 0) {
+        bulk->is_atomic = 0;
+    } else {
+        return 0;
+    }
+
+    // Each leg must take the next order id, so the id is advanced as legs are accepted
+    struct trader *trader = &traders.trader_arr[trader_id];
+    int first_order_id = trader->num_orders;
+    int num_accepted = 0;
+    bulk->num_legs = 0;
+
+    char *cursor = command + legs_offset;
+    while(*cursor != '\0') {
+        if(bulk->num_legs == BULK_LEGS_MAX) {
+            trader->num_orders = first_order_id;
+            return 0;
+        }
+
+        // Cut out the next leg
+        char *leg_end = strchr(cursor, ',');
+        if(leg_end != NULL) {
+            *leg_end = '\0';
+        }
+
+        struct order *leg = &bulk->legs[bulk->num_legs];
+        int is_valid = 0;
+        if(strncmp(cursor, "BUY", 3) == 0) {
+            is_valid = is_valid_buy(cursor, trader_id, leg);
+        } else if(strncmp(cursor, "SELL", 4) == 0) {
+            is_valid = is_valid_sell(cursor, trader_id, leg);
+        }
+        if(is_valid) {
+            leg->trader_id = trader_id;
+            trader->num_orders++;
+            num_accepted++;
+        }
+        bulk->is_valid[bulk->num_legs] = is_valid;
+        bulk->num_legs++;
+
+        if(leg_end == NULL) {
+            break;
+        }
+        *leg_end = ',';
+        cursor = leg_end + 1;
+    }
+
+    // The order ids are taken when the responses are sent
+    trader->num_orders = first_order_id;
+
+    if(num_accepted == 0 || (bulk->is_atomic && num_accepted != bulk->num_legs)) {
+        return 0;
+    }
+
+    received_order->trader_id = trader_id;
+    received_order->order_type = INVALID_ORDER;
+    received_order->order_id = -1;
+    received_order->qty = num_accepted;
+    received_order->price = 0;
+    received_order->target = ORDER_NIL;
+    received_order->product[0] = '\0';
+    return 1;
+}
+
+int is_valid_mass_cancel(char *command, int trader_id, struct order *received_order) {
+    char product[PRODUCT_NAME_MAX] = {'\0'};
+    char side[PRODUCT_NAME_MAX] = {'\0'};
+
+    int s_ret = sscanf(command, "MASSCANCEL %"TO_STRING(PRODUCT_STR_LEN)"s %"TO_STRING(PRODUCT_STR_LEN)"s", product, side);
+    // Error handling
+    // Check invalid format, 2 arguments
+    if(s_ret != MASS_CANCEL_CMD_ARGS) {
+        return 0;
+    }
+
+    // Check whether reading result is the same as initial command
+    char read_buf[BUF_LEN] = {'\0'};
+    snprintf(read_buf, sizeof(read_buf),"MASSCANCEL %s %s", product, side);
+    if(strcmp(read_buf, command) != 0) {
+        return 0;
+    }
+
+    // Check product, * for all products
+    int product_idx = -1;
+    if(strcmp(product, "*") != 0) {
+        product_idx = get_productid_by_name(product, &products);
+        if(product_idx == -1) {
+            return 0;
+        }
+    }
+
+    // Check side, * for both sides
+    enum OrderType order_type;
+    if(strcmp(side, "BUY") == 0) {
+        order_type = BUY;
+    } else if(strcmp(side, "SELL") == 0) {
+        order_type = SELL;
+    } else if(strcmp(side, "*") == 0) {
+        order_type = ANY_SIDE;
+    } else {
+        return 0;
+    }
+
+    received_order->trader_id = trader_id;
+    received_order->order_type = order_type;
+    received_order->order_id = -1;
+    received_order->price = 0;
+    received_order->qty = count_trader_orders(trader_id, product_idx, order_type); // The orders to cancel
+    received_order->target = ORDER_NIL;
+    strcpy(received_order->product, product);
+    return 1;
+}
+
 int is_valid_cancel(char *command, int trader_id, struct order *received_order) {
     int order_id;
 
@@ -682,71 +2414,118 @@ int is_valid_cancel(char *command, int trader_id, struct order *received_order)
     // Exxisting order
     for(int i=0; i<products.num_products; i++) {
         struct order_list *product_orders = &(order_book[i]);
-        struct order *buy_cursor = product_orders->buy_head;
-        struct order *sell_cursor = product_orders->sell_head;
+        uint32_t buy_cursor = product_orders->buy_head;
+        uint32_t sell_cursor = product_orders->sell_head;
 
         // Find in buy orders
         while(buy_cursor) {
-            if(buy_cursor->order_id == order_id && buy_cursor->trader_id == trader_id) {
+            struct book_order *buy_order = ORDER_AT(buy_cursor);
+            if(buy_order->order_id == order_id && buy_order->trader_id == trader_id) {
                 received_order->trader_id = trader_id;
-                received_order->next = buy_cursor; // Points to the canceled order
+                received_order->target = buy_cursor; // Points to the canceled order
                 received_order->order_type = BUY;
                 received_order->order_id = order_id;
                 received_order->price = 0;
                 received_order->qty = 0;
-                strncpy(received_order->product, buy_cursor->product, sizeof(received_order->product) - 1);
+                strncpy(received_order->product, products.names[i], sizeof(received_order->product) - 1);
 
                 return 1;
             } else{
-                buy_cursor = buy_cursor->next;
+                buy_cursor = buy_order->next;
             }
         }
 
         // Check amend buy order
         while(sell_cursor) {
-            if(sell_cursor->order_id == order_id && sell_cursor->trader_id == trader_id) {
+            struct book_order *sell_order = ORDER_AT(sell_cursor);
+            if(sell_order->order_id == order_id && sell_order->trader_id == trader_id) {
                 received_order->trader_id = trader_id;
-                received_order->next = sell_cursor; // Points to the canceled order
+                received_order->target = sell_cursor; // Points to the canceled order
                 received_order->order_type = SELL;
                 received_order->order_id = order_id;
                 received_order->price = 0;
                 received_order->qty = 0;
-                strncpy(received_order->product, sell_cursor->product, sizeof(received_order->product) - 1);
+                strncpy(received_order->product, products.names[i], sizeof(received_order->product) - 1);
 
                 return 1;
             } else {
-                sell_cursor = sell_cursor->next;
+                sell_cursor = sell_order->next;
             }
         }
 
     }
 
+    // A pending stop order has no book entry
+    for(int i=0; i<products.num_products; i++) {
+        for(int is_buy = 0; is_buy <= 1; is_buy++) {
+            struct stop_order *stops = is_buy ? stop_books[i].buy_stops : stop_books[i].sell_stops;
+            int num_stops = is_buy ? stop_books[i].num_buy_stops : stop_books[i].num_sell_stops;
+            for(int j=0; j<num_stops; j++) {
+                if(stops[j].order.order_id == order_id && stops[j].order.trader_id == trader_id) {
+                    received_order->trader_id = trader_id;
+                    received_order->target = ORDER_NIL; // Not in the book
+                    received_order->order_type = is_buy ? BUY : SELL;
+                    received_order->order_id = order_id;
+                    received_order->price = 0;
+                    received_order->qty = 0;
+                    strncpy(received_order->product, products.names[i], sizeof(received_order->product) - 1);
+
+                    return 1;
+                }
+            }
+        }
+    }
+
     // No existing order to cancel
     return 0;
 
 }
 
 void send_order_response(enum OrderResponseType response, int *fds_exchange, struct order *received_order) {
-    char write_buf[BUF_LEN] = {'\0'};
+    char write_buf[BUF_LEN];
+    int write_len = 0;
     int order_id = received_order->order_id;
     int trader_id = received_order->trader_id;
 
     switch (response) {
         case ACCEPTED:
-            snprintf(write_buf, BUF_LEN,"ACCEPTED %d;", order_id);
-            traders.trader_arr[trader_id].num_orders++;
+            write_len = format_message(write_buf, MSG_PREFIX("ACCEPTED "), 1, (long int[]){order_id});
+            take_order_ids(response, received_order);
             break;
             
         case AMENDED:
-            snprintf(write_buf, BUF_LEN,"AMENDED %d;", order_id);
+            write_len = format_message(write_buf, MSG_PREFIX("AMENDED "), 1, (long int[]){order_id});
             break;
         
         case CANCELLED:
-            snprintf(write_buf, BUF_LEN,"CANCELLED %d;", order_id);
+            write_len = format_message(write_buf, MSG_PREFIX("CANCELLED "), 1, (long int[]){order_id});
+            break;
+
+        case MASS_CANCELLED:
+            // One summary for all cancelled orders
+            write_len = format_message(write_buf, MSG_PREFIX("MASSCANCELLED "), 1, (long int[]){received_order->qty});
             break;
 
+        case BULK_ACCEPTED: {
+            // One response per order, written at once
+            char bulk_buf[BULK_LEGS_MAX * INT_LEN * 2];
+            size_t bulk_len = 0;
+            for(int i=0; i<bulk_order.num_legs; i++) {
+                if(bulk_order.is_valid[i]) {
+                    bulk_len += format_message(bulk_buf + bulk_len, MSG_PREFIX("ACCEPTED "), 1, (long int[]){bulk_order.legs[i].order_id});
+                } else {
+                    memcpy(bulk_buf + bulk_len, "INVALID;", 8);
+                    bulk_len += 8;
+                }
+            }
+            send_to_trader(fds_exchange, trader_id, bulk_buf, bulk_len);
+            take_order_ids(response, received_order);
+            return;
+        }
+
         case INVALID:
-            strncpy(write_buf, "INVALID;", BUF_LEN);
+            memcpy(write_buf, "INVALID;", 8);
+            write_len = 8;
             break;
 
         default:
@@ -754,536 +2533,2036 @@ void send_order_response(enum OrderResponseType response, int *fds_exchange, str
     }
 
     // Write response to the trader
-    write(fds_exchange[trader_id], write_buf, strlen(write_buf));
-    kill(traders.trader_arr[trader_id].pid, SIGUSR1);
+    send_to_trader(fds_exchange, trader_id, write_buf, write_len);
+}
+
+void take_order_ids(enum OrderResponseType response, struct order *received_order) {
+    struct trader *trader = &traders.trader_arr[received_order->trader_id];
+    if(response == ACCEPTED) {
+        trader->num_orders++;
+    } else if(response == BULK_ACCEPTED) {
+        // One id per accepted leg
+        trader->num_orders += received_order->qty;
+    }
 }
 
 void notify_traders(enum OrderResponseType response, int *fds_exchange, struct order *received_order) {
-    char write_buf[BUF_LEN] = {'\0'};
+    char write_buf[BUF_LEN];
+    int write_len = 0;
     int trader_id = received_order->trader_id;
-    char *product = received_order->product;
     int qty = received_order->qty;
     int price = received_order->price;
 
+    // Only the clip of an iceberg is shown
+    if(received_order->display_qty > 0 && received_order->display_qty < qty) {
+        qty = received_order->display_qty;
+    }
+
+    // A pending stop order is not shown until it triggers, and a market order never rests
+    if((response == ACCEPTED && (received_order->stop_price > 0 || received_order->tif == TIF_MARKET)) ||
+        (response == CANCELLED && received_order->target == ORDER_NIL)) {
+        return;
+    }
+
+    // The preformatted "MARKET <side> <product> " of the order
+    int product_idx = -1;
+    enum OrderType side = received_order->order_type;
+    if(response == ACCEPTED || response == AMENDED || response == CANCELLED) {
+        product_idx = get_productid_by_name(received_order->product, &products);
+        if(product_idx == -1 || (side != BUY && side != SELL)) {
+            return;
+        }
+    }
+
     switch (response) {
         case ACCEPTED:
-            if(received_order->order_type == BUY) {
-                snprintf(write_buf, BUF_LEN,"MARKET BUY %s %d %d;",product, qty, price);
-            } else if(received_order->order_type == SELL) {
-                snprintf(write_buf, BUF_LEN, "MARKET SELL %s %d %d;",product, qty, price);
-            }
+            write_len = format_message(write_buf, products.market_prefixes[product_idx][side], products.market_prefix_lens[product_idx][side], 2, (long int[]){qty, price});
             break;
             
         case AMENDED:
-            if(received_order->order_type == BUY) {
-                snprintf(write_buf, BUF_LEN, "MARKET BUY %s %d %d;",product, qty, price);
-            } else if(received_order->order_type == SELL) {
-                snprintf(write_buf, BUF_LEN, "MARKET SELL %s %d %d;",product, qty, price);
-            }
+            write_len = format_message(write_buf, products.market_prefixes[product_idx][side], products.market_prefix_lens[product_idx][side], 2, (long int[]){qty, price});
             break;
         
         case CANCELLED:
-            if(received_order->order_type == BUY) {
-                snprintf(write_buf, BUF_LEN, "MARKET BUY %s 0 0;",product);
-            } else if(received_order->order_type == SELL) {
-                snprintf(write_buf, BUF_LEN, "MARKET SELL %s 0 0;",product);
-            }
+            write_len = format_message(write_buf, products.market_prefixes[product_idx][side], products.market_prefix_lens[product_idx][side], 2, (long int[]){0, 0});
             break;
 
+        case BULK_ACCEPTED: {
+            // The accepted orders in one batch
+            char bulk_buf[BULK_LEGS_MAX * BUF_LEN / 2];
+            size_t bulk_len = 0;
+            for(int i=0; i<bulk_order.num_legs; i++) {
+                struct order *leg = &bulk_order.legs[i];
+                if(bulk_order.is_valid[i] && leg->stop_price == 0 && leg->tif != TIF_MARKET) {
+                    int leg_qty = (leg->display_qty > 0 && leg->display_qty < leg->qty) ? leg->display_qty : leg->qty;
+                    int leg_product = get_productid_by_name(leg->product, &products);
+                    bulk_len += format_message(bulk_buf + bulk_len, products.market_prefixes[leg_product][leg->order_type], products.market_prefix_lens[leg_product][leg->order_type], 2, (long int[]){leg_qty, leg->price});
+                }
+            }
+            notify_traders_batch(fds_exchange, trader_id, bulk_buf, bulk_len);
+            return;
+        }
+
         default:
             return;
     }
 
     // Notify each trader in the exchange except the oder owner
+    notify_traders_batch(fds_exchange, trader_id, write_buf, write_len);
+}
+
+void notify_traders_batch(int *fds_exchange, int except_id, const char *batch, size_t batch_len) {
     for(int id=0; id<traders.num_traders; id++) {
-        if(traders.trader_arr[id].is_alive && id != trader_id) {
-            write(fds_exchange[id], write_buf, strlen(write_buf));
-            kill(traders.trader_arr[id].pid, SIGUSR1);
+        if(traders.trader_arr[id].is_alive && id != except_id) {
+            send_to_trader(fds_exchange, id, batch, batch_len);
         }
     }
 }
 
 // Process the order read from trader message
 void process_order(enum OrderResponseType response, int *fds_exchange, struct order *received_order) {
+    if(response == INVALID || response == NORESPONSE) {
+        return;
+    }
+    apply_command(response, fds_exchange, received_order);
+
+    // Orders joining an auction batch are shown when the batch is uncrossed
+    if(response == ACCEPTED || response == AMENDED) {
+        if(joins_batch(received_order)) {
+            return;
+        }
+    } else if(response == BULK_ACCEPTED && config.batch_auction) {
+        int all_joined = 1;
+        for(int i=0; i<bulk_order.num_legs; i++) {
+            if(bulk_order.is_valid[i] && !joins_batch(&bulk_order.legs[i])) {
+                all_joined = 0;
+            }
+        }
+        if(all_joined) {
+            return;
+        }
+    }
+
+    show_book_update();
+}
 
+void apply_command(enum OrderResponseType response, int *fds_exchange, struct order *received_order) {
     switch (response) {
         case ACCEPTED:
-            if(received_order->order_type == BUY) {
-                handle_buy(received_order, fds_exchange);
-            } else if(received_order->order_type == SELL) {
-                handle_sell(received_order, fds_exchange);
-            }
+            handle_new_order(received_order, fds_exchange);
             break;
  
         case AMENDED:
             handle_amend(received_order, fds_exchange);
+            trigger_stop_orders(get_productid_by_name(received_order->product, &products), fds_exchange);
             break;
         
         case CANCELLED:
             handle_cancel(received_order, fds_exchange);
             break;
 
+        case MASS_CANCELLED:
+            handle_mass_cancel(received_order, fds_exchange);
+            break;
+
+        case BULK_ACCEPTED:
+            handle_bulk(&bulk_order, fds_exchange);
+            break;
+
         default:
             return;
     }
-
-    show_order_book(order_book);
-    show_positions(&traders);
 }
 
+long int replay_journal(const char *filename, long int offset, long int journal_id) {
+    FILE *file = fopen(filename, "r");
+    if(file == NULL) {
+        perror("Error opening journal to replay");
+        exit(1);
+    }
 
-void handle_buy(struct order* received_order, int *fds_exchange) {
-    int product_idx = get_productid_by_name(received_order->product, &products);
+    // The journal must come from a run with the same traders and products
+    int num_traders = 0;
+    int num_products = 0;
+    long int id = 0;
+    if(fscanf(file, JOURNAL_MAGIC" %d %d %ld\n", &num_traders, &num_products, &id) != 3 || num_traders != traders.num_traders || num_products != products.num_products) {
+        fprintf(stderr, "Error in journal %s header\n", filename);
+        exit(1);
+    }
 
-    // Get the order list for current product
-    struct order_list* product_orders = &(order_book[product_idx]);
+    // The offset of a checkpoint is only meaningful in its own journal, which must still hold it
+    struct stat journal_stat;
+    if(fstat(fileno(file), &journal_stat) == -1) {
+        perror("Error reading journal size");
+        exit(1);
+    }
+    if(offset > 0 && (id != journal_id || offset > journal_stat.st_size)) {
+        fprintf(stderr, "Error: the checkpoint is not of journal %s\n", filename);
+        exit(1);
+    }
 
-    // Check the sell list for match orders
-    struct order* sell_cursor = product_orders->sell_head;
-    struct order* sell_prev = NULL;
-
-    // Iterate the sell list
-    while (sell_cursor) {
-		// Check enough quantity and price
-        if (received_order->price >= sell_cursor->price &&
-            received_order->qty > 0) {
-            int match_qty;
-            // The match qty should be the smaller one of two matching orders
-            if (sell_cursor->qty < received_order->qty) {
-                match_qty = sell_cursor->qty;
-            } else {
-                match_qty = received_order->qty;
+    // Skip the records a checkpoint already covers
+    if(offset > 0 && fseek(file, offset, SEEK_SET) == -1) {
+        perror("Error seeking journal");
+        exit(1);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Apply each record as the event loop did, with no messages and no logging
+    enum LogLevel verbosity = config.verbosity;
+    config.verbosity = LOG_SILENT;
+    replaying = 1;
+
+    char line[CMD_BUF_LEN + 2 * INT_LEN + 3];
+    long int num_records = 0;
+    long int line_num = 1;
+    while(fgets(line, sizeof(line), file) != NULL) {
+        line_num++;
+        uint32_t tick = 0;
+        int trader_id = -1;
+        int tick_offset = 0;
+        int command_offset = 0;
+        if(sscanf(line, "%u %n", &tick, &tick_offset) != 1 || tick_offset == 0) {
+            fprintf(stderr, "Error in journal %s line %ld\n", filename, line_num);
+            exit(1);
+        }
+        // Bring the clock to the tick of the record, which expires what the live run expired by then
+        expire_orders(NULL, tick);
+        if(sscanf(line + tick_offset, "%d %n", &trader_id, &command_offset) != 1) {
+            // An exchange event, the expiries were run by the clock
+            char *event = line + tick_offset;
+            event[strcspn(event, "\n")] = '\0';
+            int product_idx = -1;
+            if(strcmp(event, "OPEN") == 0) {
+                open_market(NULL);
+            } else if(sscanf(event, "AUCTION %d", &product_idx) == 1 && product_idx >= 0 && product_idx < products.num_products) {
+                run_auction(product_idx, NULL);
+                show_book_update();
+            } else if(strcmp(event, "EXPIRE") != 0) {
+                fprintf(stderr, "Error in journal %s line %ld\n", filename, line_num);
+                exit(1);
             }
+            num_records++;
+            continue;
+        }
+        if(command_offset == 0 || trader_id < 0 || trader_id >= traders.num_traders) {
+            fprintf(stderr, "Error in journal %s line %ld\n", filename, line_num);
+            exit(1);
+        }
+        char *command = line + tick_offset + command_offset;
+        command[strcspn(command, "\n")] = '\0';
 
-            long int match_value = (long int)match_qty * sell_cursor->price;
-            long int match_fee = (long int)round(match_value * FEE_PERCENTAGE / 100.0);
+        if(strcmp(command, "DISCONNECT") == 0) {
+            cancel_trader_orders(NULL, trader_id, -1, ANY_SIDE);
+        } else {
+            struct order received_order;
+            enum OrderResponseType response = classify_command(command, trader_id, &received_order);
+            if(response == INVALID) {
+                fprintf(stderr, "Error in journal %s line %ld\n", filename, line_num);
+                exit(1);
+            }
+            take_order_ids(response, &received_order);
+            apply_command(response, NULL, &received_order);
+        }
+        num_records++;
+    }
+    fclose(file);
 
-            // Print the matching infomation
-			printf(LOG_PREFIX" Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", sell_cursor->order_id, sell_cursor->trader_id, received_order->order_id, received_order->trader_id, match_value, match_fee);
+    replaying = 0;
+    config.verbosity = verbosity;
+    // The replayed changes are in the state, not pending diffs
+    if(TRACK_CHANGES) {
+        clear_book_diff(&book_diff);
+    }
 
-            // Notify corresponding traders
-            notify_filler(fds_exchange, sell_cursor->trader_id, sell_cursor->order_id, match_qty);
-            notify_filler(fds_exchange, received_order->trader_id, received_order->order_id, match_qty);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long int elapsed_us = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+    long int rate = elapsed_us > 0 ? num_records * 1000000L / elapsed_us : num_records;
+    PEX_LOG(LOG_ERRORS, LOG_PREFIX" Replayed %ld commands in %ld us (%ld orders/sec)\n", num_records, elapsed_us, rate);
+    return num_records;
+}
 
-			// Update qty after matching
-			received_order->qty -= match_qty;
-			sell_cursor->qty -= match_qty;
+size_t checkpoint_size(void) {
+    int num_cells = traders.num_traders * products.num_products;
+    size_t size = sizeof(struct checkpoint_header) + traders.num_traders * sizeof(int32_t) + num_cells * (sizeof(int32_t) + sizeof(int64_t));
+    for(int i=0; i<products.num_products; i++) {
+        size += sizeof(struct checkpoint_product);
+        size += (size_t)(order_book[i].buy_list_size + order_book[i].sell_list_size) * sizeof(struct checkpoint_order);
+        size += (size_t)(stop_books[i].num_buy_stops + stop_books[i].num_sell_stops) * sizeof(struct stop_order);
+    }
+    return size;
+}
 
-            // Update positions for buyer
-			traders.trader_arr[received_order->trader_id].positions[product_idx].qty += match_qty;
-			traders.trader_arr[received_order->trader_id].positions[product_idx].profit -= (match_value + match_fee);
+size_t serialize_checkpoint(char *buf, long int journal_offset) {
+    size_t len = 0;
+    struct checkpoint_header header = {0};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.num_traders = traders.num_traders;
+    header.num_products = products.num_products;
+    header.journal_id = journal.id;
+    header.journal_offset = journal_offset;
+    header.exchange_fees = exchange_fees;
+    header.stop_seq = stop_seq;
+    header.tick = timer_wheel.now;
+    header.pre_open_pending = pre_open_pending;
+    memcpy(buf + len, &header, sizeof(header));
+    len += sizeof(header);
+
+    // The order ids taken and the position matrix
+    int num_cells = traders.num_traders * products.num_products;
+    for(int id=0; id<traders.num_traders; id++) {
+        int32_t num_orders = traders.trader_arr[id].num_orders;
+        memcpy(buf + len, &num_orders, sizeof(num_orders));
+        len += sizeof(num_orders);
+    }
+    for(int i=0; i<num_cells; i++) {
+        int32_t qty = traders.positions.qty[i];
+        memcpy(buf + len, &qty, sizeof(qty));
+        len += sizeof(qty);
+    }
+    for(int i=0; i<num_cells; i++) {
+        int64_t profit = traders.positions.profit[i];
+        memcpy(buf + len, &profit, sizeof(profit));
+        len += sizeof(profit);
+    }
 
-			// Update positions for seller
-            traders.trader_arr[sell_cursor->trader_id].positions[product_idx].qty -= match_qty;
-            traders.trader_arr[sell_cursor->trader_id].positions[product_idx].profit += match_value;
+    for(int i=0; i<products.num_products; i++) {
+        struct order_list *product_orders = &(order_book[i]);
+        struct stop_book *book = &stop_books[i];
+        struct checkpoint_product product = {0};
+        strncpy(product.name, products.names[i], sizeof(product.name) - 1);
+        product.last_price = product_orders->last_price;
+        product.batch_orders = product_orders->batch_orders;
+        product.batch_ticks = product_orders->batch_deadline - timer_wheel.now;
+        product.num_buy_orders = product_orders->buy_list_size;
+        product.num_sell_orders = product_orders->sell_list_size;
+        product.num_buy_stops = book->num_buy_stops;
+        product.num_sell_stops = book->num_sell_stops;
+        memcpy(buf + len, &product, sizeof(product));
+        len += sizeof(product);
+
+        // Each side in price-time priority, so loading it in order keeps the priority
+        uint32_t heads[2] = {product_orders->buy_head, product_orders->sell_head};
+        for(int side=0; side<2; side++) {
+            for(uint32_t ref=heads[side]; ref; ref=ORDER_AT(ref)->next) {
+                struct book_order *order = ORDER_AT(ref);
+                struct order_info *info = ORDER_INFO(ref);
+                struct checkpoint_order saved = {
+                    .trader_id = order->trader_id,
+                    .order_id = order->order_id,
+                    .price = order->price,
+                    .qty = order->qty,
+                    .reserve_qty = order->reserve_qty,
+                    .display_qty = info->display_qty,
+                    .expire_ticks = CHECKPOINT_NO_EXPIRY
+                };
+                if(info->timer_slot != TIMER_NONE) {
+                    saved.expire_ticks = info->expire_tick - timer_wheel.now;
+                }
+                memcpy(buf + len, &saved, sizeof(saved));
+                len += sizeof(saved);
+            }
+        }
 
-			// Update sell list
-			if(sell_cursor->qty == 0) {
-                int removed_sell_level = 0; // The level to be removed from the sell list
-                // Check whether removing the order would reduce sell levels
-                if(sell_cursor->next == NULL || sell_cursor->price != sell_cursor->next->price) {
-                    removed_sell_level = 1;
+        // The stop heaps as they are, with their expiry made relative like the orders
+        struct stop_order *stops[2] = {book->buy_stops, book->sell_stops};
+        int num_stops[2] = {book->num_buy_stops, book->num_sell_stops};
+        for(int side=0; side<2; side++) {
+            for(int j=0; j<num_stops[side]; j++) {
+                struct stop_order stop = stops[side][j];
+                if(stop.order.tif == TIF_GTT) {
+                    stop.order.expire_tick -= timer_wheel.now;
                 }
+                memcpy(buf + len, &stop, sizeof(stop));
+                len += sizeof(stop);
+            }
+        }
+    }
+    return len;
+}
 
-                // Remove the matching sell order
-				if(sell_prev) {
-					sell_prev->next = sell_cursor->next;
-				} else {
-					product_orders->sell_head = sell_cursor->next;
-				}
+int write_checkpoint(const char *filename, const char *tmp_filename, const char *buf, size_t len) {
+    int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        return -1;
+    }
+    size_t written = 0;
+    while(written < len) {
+        ssize_t write_len = write(fd, buf + written, len - written);
+        if(write_len == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += write_len;
+    }
 
-				struct order *temp = sell_cursor;
-				sell_cursor = sell_cursor->next;
-				free(temp);
+    // Replace the old checkpoint only once the new one is on disk
+    int ok = written == len && fsync(fd) == 0;
+    if(close(fd) != 0) {
+        ok = 0;
+    }
+    if(!ok || rename(tmp_filename, filename) == -1) {
+        unlink(tmp_filename);
+        return -1;
+    }
+    return 0;
+}
 
-                // Update the sell list size and levels
-				product_orders->sell_list_size --;
-                product_orders->sell_levels -=  removed_sell_level;
-			}
+int start_checkpoint(int *fds_exchange) {
+    if(checkpoint_pid != 0) {
+        return 0;
+    }
 
-            // Update exchange fees
-            exchange_fees += match_fee;
-        } else {
-            // No matching order
-            // Since the sell list is arranged by price from lowest to highest
-            break;
-		}
+    // The checkpoint covers every command applied so far, so they must all be in the journal
+    commit_journal(&journal, fds_exchange);
+    long int journal_offset = journal.offset;
+
+    // The child of a threaded process may only make async-signal-safe calls, so the buffer and
+    // the file name are ready before the fork, and the state is serialized from the child's copy
+    size_t buf_len = checkpoint_size();
+    char *buf = (char*)malloc(buf_len);
+    if(buf == NULL) {
+        perror("Error allocating checkpoint buffer");
+        exit(1);
+    }
+    char tmp_filename[PATH_MAX];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s"CHECKPOINT_TMP_SUFFIX, config.checkpoint_file);
+
+    // The handler reaps the child, so it must know the pid before the child can exit
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    pid_t pid = fork();
+    if(pid == -1) {
+        perror("Error forking checkpoint");
+        exit(1);
     }
+    if(pid == 0) {
+        // The child only has the event loop thread, and must not run the exit handlers of the parent.
+        // A failure is reported by the parent from the exit status
+        size_t len = serialize_checkpoint(buf, journal_offset);
+        _exit(write_checkpoint(config.checkpoint_file, tmp_filename, buf, len) == -1);
+    }
+    // The child has its own copy of the buffer
+    free(buf);
+    checkpoint_pid = pid;
+    checkpoint_offset = journal_offset;
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return 1;
+}
 
+void finish_checkpoint(void) {
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    if(checkpoint_pid != 0 && checkpoint_exit == -1) {
+        int status;
+        if(waitpid(checkpoint_pid, &status, 0) == checkpoint_pid) {
+            checkpoint_exit = status;
+        }
+    }
+    // The SIGCHLD delivered on unblocking is then not taken for the checkpoint
+    checkpoint_pid = 0;
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
 
-	// Check remaining quantity in the received buy order
-	if(received_order->qty > 0) {
-		// Add new order node to buy list
-        struct order* new_node = (struct order*)malloc(sizeof(struct order));
-        memcpy(new_node, received_order, sizeof(struct order));
-        new_node->next = NULL;
+long int load_checkpoint(const char *filename, long int *journal_id) {
+    FILE *file = fopen(filename, "r");
+    if(file == NULL) {
+        perror("Error opening checkpoint");
+        exit(1);
+    }
 
-        int added_buy_level = 1; // The level to be added to the buy list
+    // The checkpoint must come from a run with the same traders and products
+    struct checkpoint_header header;
+    int num_cells = traders.num_traders * products.num_products;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+        header.num_traders == traders.num_traders && header.num_products == products.num_products;
 
-        // If empty list, add new node as head
-        if (product_orders->buy_list_size == 0) {
-            product_orders->buy_head = new_node;
-        } else {
-            // Add new node to buy list in sorted order (hign to low)
-            struct order* buy_cursor = product_orders->buy_head;  // Set cursor
-         	struct order* buy_prev = NULL;  // Set previous node of cursor
-            while (buy_cursor) {
-				// Check the price
-                if (buy_cursor->price >= new_node->price) {
-                    // If the buy level exists, no added level
-                    if(buy_cursor->price == new_node->price) {
-                        added_buy_level = 0;
-                    }   
-					buy_prev = buy_cursor;
-					buy_cursor = buy_cursor->next;
-				} else {
+    // The expiries are relative to the tick, and the journal after the checkpoint carries on from it
+    if(ok) {
+        timer_wheel.now = header.tick;
+        pre_open_pending = header.pre_open_pending;
+    }
+    for(int id=0; id<traders.num_traders && ok; id++) {
+        int32_t num_orders;
+        ok = fread(&num_orders, sizeof(num_orders), 1, file) == 1;
+        if(ok) {
+            traders.trader_arr[id].num_orders = num_orders;
+        }
+    }
+    for(int i=0; i<num_cells && ok; i++) {
+        int32_t qty;
+        ok = fread(&qty, sizeof(qty), 1, file) == 1;
+        if(ok) {
+            traders.positions.qty[i] = qty;
+        }
+    }
+    for(int i=0; i<num_cells && ok; i++) {
+        int64_t profit;
+        ok = fread(&profit, sizeof(profit), 1, file) == 1;
+        if(ok) {
+            traders.positions.profit[i] = profit;
+        }
+    }
+
+    int num_orders = 0;
+    for(int i=0; i<products.num_products && ok; i++) {
+        struct checkpoint_product product;
+        ok = fread(&product, sizeof(product), 1, file) == 1 && strncmp(product.name, products.names[i], PRODUCT_NAME_MAX) == 0;
+        if(!ok) {
+            break;
+        }
+        order_book[i].last_price = product.last_price;
+
+        // Rest the orders in priority order, then put back a partly filled iceberg clip
+        int sides[2][2] = {{BUY, product.num_buy_orders}, {SELL, product.num_sell_orders}};
+        for(int side=0; side<2 && ok; side++) {
+            for(int j=0; j<sides[side][1] && ok; j++) {
+                struct checkpoint_order saved;
+                ok = fread(&saved, sizeof(saved), 1, file) == 1 && saved.trader_id >= 0 && saved.trader_id < traders.num_traders;
+                if(!ok) {
                     break;
                 }
-			}
+                struct order received_order = {0};
+                received_order.trader_id = saved.trader_id;
+                received_order.order_type = sides[side][0];
+                received_order.order_id = saved.order_id;
+                received_order.qty = saved.qty + saved.reserve_qty;
+                received_order.price = saved.price;
+                received_order.display_qty = saved.display_qty;
+                received_order.tif = TIF_DAY;
+                if(saved.expire_ticks != CHECKPOINT_NO_EXPIRY) {
+                    received_order.tif = TIF_GTT;
+                    received_order.expire_tick = timer_wheel.now + saved.expire_ticks;
+                }
+                uint32_t ref = rest_order(&received_order, i);
+                struct book_order *order = ORDER_AT(ref);
+                struct price_level *level = LEVEL_AT(order->level);
+                level->total_qty += saved.qty - order->qty;
+                level->num_icebergs += (saved.reserve_qty > 0) - (order->reserve_qty > 0);
+                order->qty = saved.qty;
+                order->reserve_qty = saved.reserve_qty;
+                num_orders++;
+            }
+        }
 
-            // Insert the new node
-            if (buy_prev) {
-				new_node->next = buy_prev->next;
-				buy_prev->next = new_node;
-			} else {
-				// Insert before the head node as new head
-				new_node->next = product_orders->buy_head;
-				product_orders->buy_head = new_node;
-			}
+        // The stops are written as heaps and read back as they are
+        struct stop_book *book = &stop_books[i];
+        int num_stops[2] = {product.num_buy_stops, product.num_sell_stops};
+        struct stop_order **stops[2] = {&book->buy_stops, &book->sell_stops};
+        for(int side=0; side<2 && ok; side++) {
+            if(num_stops[side] == 0) {
+                continue;
+            }
+            struct stop_order *resized = (struct stop_order*)realloc(*stops[side], num_stops[side] * sizeof(struct stop_order));
+            ok = resized != NULL;
+            if(ok) {
+                *stops[side] = resized;
+                ok = fread(*stops[side], sizeof(struct stop_order), num_stops[side], file) == (size_t)num_stops[side];
+            }
+            for(int j=0; j<num_stops[side] && ok; j++) {
+                if((*stops[side])[j].order.tif == TIF_GTT) {
+                    (*stops[side])[j].order.expire_tick += timer_wheel.now;
+                }
+            }
+        }
+        if(!ok) {
+            break;
         }
+        book->num_buy_stops = book->buy_capacity = num_stops[0];
+        book->num_sell_stops = book->sell_capacity = num_stops[1];
 
-        // Update the buy list size and levels
-        product_orders->buy_list_size++;
-        product_orders->buy_levels += added_buy_level;
+        // The orders waiting for an auction are uncrossed at the next one
+        for(int j=0; j<product.batch_orders; j++) {
+            add_to_batch(i);
+        }
+        if(product.batch_orders > 0) {
+            order_book[i].batch_deadline = timer_wheel.now + product.batch_ticks;
+        }
+    }
+    fclose(file);
+    if(!ok) {
+        fprintf(stderr, "Error in checkpoint %s\n", filename);
+        exit(1);
     }
+    exchange_fees = header.exchange_fees;
+    stop_seq = header.stop_seq;
 
+    // The loaded orders are in the state, not pending diffs
+    if(TRACK_CHANGES) {
+        clear_book_diff(&book_diff);
+    }
+    PEX_LOG(LOG_ERRORS, LOG_PREFIX" Loaded %d orders from checkpoint at journal offset %ld\n", num_orders, (long int)header.journal_offset);
+    *journal_id = header.journal_id;
+    return header.journal_offset;
 }
 
 
-void handle_sell(struct order  *received_order, int *fds_exchange) {
+void handle_buy(struct order* received_order, int *fds_exchange) {
     int product_idx = get_productid_by_name(received_order->product, &products);
 
-    // Get the order list for current product
-    struct order_list* product_orders = &(order_book[product_idx]);
-
-    // Check the buy list for matching orders
-    struct order* buy_cursor = product_orders->buy_head;
-    struct order* buy_prev = NULL;
-
-    // Iterate the buy list
-    while (buy_cursor) {
-		// Check enough quantity and price
-        if (received_order->price <= buy_cursor->price &&
-            received_order->qty > 0) {
-            int match_qty;
-            // The match qty should be the smaller one of two matching orders
-            if (buy_cursor->qty < received_order->qty) {
-                match_qty = buy_cursor->qty;
-            } else {
-                match_qty = received_order->qty;
-            }
+    // In batch auction mode or before the opening auction the order waits in the book, and an
+    // immediate order first uncrosses the batch so it meets an uncrossed book
+    if(config.batch_auction || pre_open_pending) {
+        if(joins_batch(received_order)) {
+            rest_order(received_order, product_idx);
+            add_to_batch(product_idx);
+            return;
+        }
+        if(pre_open_pending) {
+            // Nothing trades before the opening auction
+            discard_remainder(received_order, fds_exchange);
+            return;
+        }
+        run_auction(product_idx, fds_exchange);
+    }
 
-            long int match_value = (long int)match_qty * buy_cursor->price;
-            long int match_fee = (long int)round(match_value * FEE_PERCENTAGE / 100.0);
+    // A fill or kill order is only matched if the sell levels can fill it completely
+    if(received_order->tif == TIF_FOK && !can_fill_order(received_order, product_idx)) {
+        discard_remainder(received_order, fds_exchange);
+        return;
+    }
 
-            // Print the matching infomation
-			printf(LOG_PREFIX" Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", buy_cursor->order_id, buy_cursor->trader_id, received_order->order_id, received_order->trader_id, match_value, match_fee);
+    // A market order is priced at the level its shown quantity reaches, which bounds the sweep
+    if(received_order->tif == TIF_MARKET) {
+        received_order->price = market_sweep_price(received_order, product_idx);
+    }
 
-            // Notify corresponding traders
-            notify_filler(fds_exchange, buy_cursor->trader_id, buy_cursor->order_id, match_qty);
-            notify_filler(fds_exchange, received_order->trader_id, received_order->order_id, match_qty);
+    // Match against the sell levels, from the lowest price
+    match_order(received_order, product_idx, fds_exchange);
 
-			// Update qty after matching
-			received_order->qty -= match_qty;
-			buy_cursor->qty -= match_qty;
+    // Check remaining quantity in the received buy order, only day and good till time orders rest
+    if(received_order->qty > 0) {
+        if(received_order->tif == TIF_DAY || received_order->tif == TIF_GTT) {
+            rest_order(received_order, product_idx);
+        } else {
+            discard_remainder(received_order, fds_exchange);
+        }
+    }
+}
 
-            // Update positions for seller
-			traders.trader_arr[received_order->trader_id].positions[product_idx].qty -= match_qty;
-			traders.trader_arr[received_order->trader_id].positions[product_idx].profit += (match_value - match_fee);
 
-			// Update positions for buyer
-			traders.trader_arr[buy_cursor->trader_id].positions[product_idx].qty += match_qty;
-			traders.trader_arr[buy_cursor->trader_id].positions[product_idx].profit -= match_value;
+void handle_sell(struct order  *received_order, int *fds_exchange) {
+    int product_idx = get_productid_by_name(received_order->product, &products);
 
-			// Update buy list
-			if(buy_cursor->qty == 0) {
-                int removed_buy_level = 0; // The level to be removed from the buy list
-                // Check whether removing the order would reduce buy levels
-                if(buy_cursor->next == NULL || buy_cursor->price != buy_cursor->next->price) {
-                    removed_buy_level = 1;
-                }
+    // In batch auction mode or before the opening auction the order waits in the book, and an
+    // immediate order first uncrosses the batch so it meets an uncrossed book
+    if(config.batch_auction || pre_open_pending) {
+        if(joins_batch(received_order)) {
+            rest_order(received_order, product_idx);
+            add_to_batch(product_idx);
+            return;
+        }
+        if(pre_open_pending) {
+            // Nothing trades before the opening auction
+            discard_remainder(received_order, fds_exchange);
+            return;
+        }
+        run_auction(product_idx, fds_exchange);
+    }
 
-				if(buy_prev) {
-					buy_prev->next = buy_cursor->next;
-				} else {
-					product_orders->buy_head = buy_cursor->next;
-				}
-
-				struct order *temp = buy_cursor;
-				buy_cursor = buy_cursor->next;
-				free(temp);
-
-                // Update he buy list size and levels
-				product_orders->buy_list_size --;
-                product_orders->buy_levels -= removed_buy_level;
-			}
-            // Update exchange fees
-            exchange_fees += match_fee;
-        } else {
-			// No matching order
-            // Since the buy list is arranged by price from highest to lowest
-			break;
-		}
+    // A fill or kill order is only matched if the buy levels can fill it completely
+    if(received_order->tif == TIF_FOK && !can_fill_order(received_order, product_idx)) {
+        discard_remainder(received_order, fds_exchange);
+        return;
     }
 
-	// Check remaining quantity in the sell order
-	if(received_order->qty > 0) {
-		// Add the new order node to sell list
-        struct order* new_node = (struct order*)malloc(sizeof(struct order));
-        memcpy(new_node, received_order, sizeof(struct order));
-        new_node->next = NULL;
+    // A market order is priced at the level its shown quantity reaches, which bounds the sweep
+    if(received_order->tif == TIF_MARKET) {
+        received_order->price = market_sweep_price(received_order, product_idx);
+    }
 
-        int added_sell_level = 1; // The level to be added to the sell list
+    // Match against the buy levels, from the highest price
+    match_order(received_order, product_idx, fds_exchange);
 
-        // If empty list, add new node as head
-        if (product_orders->sell_list_size == 0) {
-            product_orders->sell_head = new_node;
+    // Check remaining quantity in the sell order, only day and good till time orders rest
+    if(received_order->qty > 0) {
+        if(received_order->tif == TIF_DAY || received_order->tif == TIF_GTT) {
+            rest_order(received_order, product_idx);
         } else {
-            // Add new node to sell list in sorted order (low to high)
-            struct order* sell_cursor = product_orders->sell_head;  // Set cursor
-         	struct order* sell_prev = NULL;  // Set previous node of cursor
-
-            while (sell_cursor) {
-				// Check the price
-                if (sell_cursor->price <= new_node->price) {
-                    // If the sell level exists, no added level
-                    if(sell_cursor->price == new_node->price) {
-                        added_sell_level = 0;
-                    }   
-					sell_prev = sell_cursor;
-					sell_cursor = sell_cursor->next;
-				} else {
-                    break;
-                }
-			}
-
-            // Insert the new node
-            if (sell_prev) {
-				new_node->next = sell_prev->next;
-				sell_prev->next = new_node;
-			} else {
-				// Insert before the head node as new head
-				new_node->next = product_orders->sell_head;
-				product_orders->sell_head = new_node;
-			}
+            discard_remainder(received_order, fds_exchange);
         }
-
-        // Update the sell list size and levels
-        product_orders->sell_list_size++;
-        product_orders->sell_levels += added_sell_level;
     }
 }
 
+int parse_order_suffix(const char *suffix, struct order *received_order) {
+    received_order->tif = TIF_DAY;
+    received_order->display_qty = 0;
+    received_order->expire_tick = 0;
+    received_order->stop_price = 0;
+    if(suffix[0] == '\0') {
+        return 1;
+    }
 
-void handle_amend(struct order *received_order, int *fds_exchange) {
-
-    // Delete the old order --- received_order->next
-    handle_cancel(received_order, fds_exchange);
+    if(strcmp(suffix, " IOC") == 0) {
+        received_order->tif = TIF_IOC;
+        return 1;
+    } else if(strcmp(suffix, " FOK") == 0) {
+        received_order->tif = TIF_FOK;
+        return 1;
+    }
 
-    if(received_order->order_type == BUY) {
-        // Add the amended order and process it
+    // Stop, entered as a limit order when the last trade price reaches the trigger
+    int trigger;
+    if(sscanf(suffix, " STOP %d", &trigger) == 1) {
+        char read_buf[BUF_LEN] = {'\0'};
+        snprintf(read_buf, sizeof(read_buf), " STOP %d", trigger);
+        if(strcmp(read_buf, suffix) != 0 || trigger < MIN_VALUE || trigger > MAX_VALUE) {
+            return 0;
+        }
+        received_order->stop_price = trigger;
+        return 1;
+    }
+
+    // Good till time, the expiry is relative to now and rounded up to whole ticks
+    int expire_ms;
+    if(sscanf(suffix, " GTT %d", &expire_ms) == 1) {
+        char read_buf[BUF_LEN] = {'\0'};
+        snprintf(read_buf, sizeof(read_buf), " GTT %d", expire_ms);
+        if(strcmp(read_buf, suffix) != 0 || expire_ms < MIN_VALUE || expire_ms > GTT_MS_MAX) {
+            return 0;
+        }
+        received_order->tif = TIF_GTT;
+        received_order->expire_tick = timer_wheel.now + (expire_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        return 1;
+    }
+
+    // Iceberg, the clip is shown and the rest of the quantity is hidden
+    int clip;
+    if(sscanf(suffix, " ICEBERG %d", &clip) != 1) {
+        return 0;
+    }
+    char read_buf[BUF_LEN] = {'\0'};
+    snprintf(read_buf, sizeof(read_buf), " ICEBERG %d", clip);
+    if(strcmp(read_buf, suffix) != 0 || clip < MIN_VALUE || clip > received_order->qty) {
+        return 0;
+    }
+    received_order->display_qty = clip;
+    return 1;
+}
+
+void handle_new_order(struct order *received_order, int *fds_exchange) {
+    int product_idx = get_productid_by_name(received_order->product, &products);
+    if(received_order->stop_price > 0) {
+        add_stop_order(received_order, product_idx);
+    } else if(received_order->order_type == BUY) {
         handle_buy(received_order, fds_exchange);
     } else if(received_order->order_type == SELL) {
-        // Add the amended order and process it
         handle_sell(received_order, fds_exchange);
     }
+
+    // The order may have moved the price, or be a stop that has already triggered
+    trigger_stop_orders(product_idx, fds_exchange);
 }
 
-void handle_cancel(struct order* received_order, int *fds_exchange) {
-    // Retrive the order to be canceled
-    struct order *cancel_order = received_order->next;
+void add_stop_order(struct order *received_order, int product_idx) {
+    struct stop_book *book = &stop_books[product_idx];
+    int is_buy = received_order->order_type == BUY;
+    struct stop_order **stops = is_buy ? &book->buy_stops : &book->sell_stops;
+    int *num_stops = is_buy ? &book->num_buy_stops : &book->num_sell_stops;
+    int *capacity = is_buy ? &book->buy_capacity : &book->sell_capacity;
+
+    if(*num_stops == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : STOP_BOOK_BASE;
+        *stops = (struct stop_order*)realloc(*stops, *capacity * sizeof(struct stop_order));
+        if(*stops == NULL) {
+            perror("Error growing stop book");
+            exit(1);
+        }
+    }
 
-    int product_idx = get_productid_by_name(received_order->product, &products);
+    // Add at the last leaf and move it up to its place
+    struct stop_order *stop = &(*stops)[*num_stops];
+    stop->trigger = received_order->stop_price;
+    stop->seq = stop_seq++;
+    stop->order = *received_order;
+    stop->order.stop_price = 0;
+    sift_stop_up(*stops, *num_stops, is_buy);
+    (*num_stops)++;
+}
 
-    // Get the order list for current product
-    struct order_list* product_orders = &(order_book[product_idx]);
+int stop_triggers_first(struct stop_order *stop, struct stop_order *other, int is_buy) {
+    if(stop->trigger != other->trigger) {
+        return is_buy ? stop->trigger < other->trigger : stop->trigger > other->trigger;
+    }
+    return stop->seq < other->seq;
+}
 
-    if(cancel_order->order_type == BUY) {
-        // Cancel buy order
-        struct order *buy_cursor = product_orders->buy_head;
-        struct order *buy_prev = NULL;
-        int removed_level = 0; // The level to be removed from the buy list
-        // Delete the order in the buy list
-        while(buy_cursor) {
-            if(buy_cursor == cancel_order) {
-                // Check the removed level if deleting the order 
-                if((buy_prev == NULL || buy_prev->price != buy_cursor->price) &&
-                    (buy_cursor->next == NULL || buy_cursor->price != buy_cursor->next->price)) {
-                    removed_level = 1;
+void sift_stop_up(struct stop_order *stops, int idx, int is_buy) {
+    struct stop_order moved = stops[idx];
+    while(idx > 0) {
+        int parent = (idx - 1) / 2;
+        if(!stop_triggers_first(&moved, &stops[parent], is_buy)) {
+            break;
+        }
+        stops[idx] = stops[parent];
+        idx = parent;
+    }
+    stops[idx] = moved;
+}
+
+void sift_stop_down(struct stop_order *stops, int num_stops, int idx, int is_buy) {
+    struct stop_order moved = stops[idx];
+    while(1) {
+        int child = 2 * idx + 1;
+        if(child >= num_stops) {
+            break;
+        }
+        if(child + 1 < num_stops && stop_triggers_first(&stops[child + 1], &stops[child], is_buy)) {
+            child++;
+        }
+        if(!stop_triggers_first(&stops[child], &moved, is_buy)) {
+            break;
+        }
+        stops[idx] = stops[child];
+        idx = child;
+    }
+    stops[idx] = moved;
+}
+
+int trigger_stop_orders(int product_idx, int *fds_exchange) {
+    struct stop_book *book = &stop_books[product_idx];
+    int num_triggered = 0;
+
+    while(order_book[product_idx].last_price > 0) {
+        int last_price = order_book[product_idx].last_price;
+        struct stop_order *buy_stop = NULL;
+        struct stop_order *sell_stop = NULL;
+        if(book->num_buy_stops > 0 && book->buy_stops[0].trigger <= last_price) {
+            buy_stop = &book->buy_stops[0];
+        }
+        if(book->num_sell_stops > 0 && book->sell_stops[0].trigger >= last_price) {
+            sell_stop = &book->sell_stops[0];
+        }
+        if(buy_stop == NULL && sell_stop == NULL) {
+            break;
+        }
+
+        // Take the older of the two, so a cascade always runs in the same order, and pop it off its heap
+        struct order activated;
+        int trigger;
+        if(sell_stop == NULL || (buy_stop != NULL && buy_stop->seq < sell_stop->seq)) {
+            activated = buy_stop->order;
+            trigger = buy_stop->trigger;
+            book->num_buy_stops--;
+            if(book->num_buy_stops > 0) {
+                book->buy_stops[0] = book->buy_stops[book->num_buy_stops];
+                sift_stop_down(book->buy_stops, book->num_buy_stops, 0, 1);
+            }
+        } else {
+            activated = sell_stop->order;
+            trigger = sell_stop->trigger;
+            book->num_sell_stops--;
+            if(book->num_sell_stops > 0) {
+                book->sell_stops[0] = book->sell_stops[book->num_sell_stops];
+                sift_stop_down(book->sell_stops, book->num_sell_stops, 0, 0);
+            }
+        }
+        num_triggered++;
+
+        // Enter it as a new limit order
+        PEX_LOG(LOG_MATCHES, LOG_PREFIX" Stop order %d [T%d] triggered at $%d\n", activated.order_id, activated.trader_id, trigger);
+        notify_traders(ACCEPTED, fds_exchange, &activated);
+        if(activated.order_type == BUY) {
+            handle_buy(&activated, fds_exchange);
+        } else {
+            handle_sell(&activated, fds_exchange);
+        }
+    }
+    return num_triggered;
+}
+
+int remove_trader_stops(int trader_id, int product_idx, enum OrderType side, int order_id) {
+    int num_removed = 0;
+    for(int i=0; i<products.num_products; i++) {
+        if(product_idx != -1 && i != product_idx) {
+            continue;
+        }
+        for(int is_buy = 0; is_buy <= 1; is_buy++) {
+            if((side == BUY && !is_buy) || (side == SELL && is_buy)) {
+                continue;
+            }
+            struct stop_order *stops = is_buy ? stop_books[i].buy_stops : stop_books[i].sell_stops;
+            int *num_stops = is_buy ? &stop_books[i].num_buy_stops : &stop_books[i].num_sell_stops;
+
+            // Compact the kept orders in place, then rebuild the heap if any were removed
+            int kept = 0;
+            for(int j=0; j<*num_stops; j++) {
+                struct order *stop = &stops[j].order;
+                if(stop->trader_id == trader_id && (order_id == -1 || stop->order_id == order_id)) {
+                    num_removed++;
+                    continue;
                 }
-                // If the old order is the head
-                if(buy_prev == NULL) {
-                    product_orders->buy_head = buy_cursor->next;
-                } else {
-                    buy_prev->next = buy_cursor->next;
+                if(kept != j) {
+                    stops[kept] = stops[j];
+                }
+                kept++;
+            }
+            if(kept != *num_stops) {
+                *num_stops = kept;
+                for(int j=kept/2-1; j>=0; j--) {
+                    sift_stop_down(stops, kept, j, is_buy);
                 }
+            }
+        }
+    }
+    return num_removed;
+}
 
-                free(cancel_order);
-                product_orders->buy_levels -= removed_level;
-                product_orders->buy_list_size --;
-                break;
-            } else {
-                buy_prev = buy_cursor;
-                buy_cursor = buy_cursor->next;
+int count_trader_stops(int trader_id, int product_idx, enum OrderType side) {
+    int num_stops = 0;
+    for(int i=0; i<products.num_products; i++) {
+        if(product_idx != -1 && i != product_idx) {
+            continue;
+        }
+        if(side != SELL) {
+            for(int j=0; j<stop_books[i].num_buy_stops; j++) {
+                num_stops += stop_books[i].buy_stops[j].order.trader_id == trader_id;
             }
         }
-    } 
-    else if (received_order->order_type == SELL) {
-        // Cancel the cell order
-        struct order *sell_cursor = product_orders->sell_head;
-        struct order *sell_prev = NULL;
-        int removed_level = 0; // The level to be removed from the buy list
-        // Delet the old order in the buy list
-        while(sell_cursor) {
-            if(sell_cursor == cancel_order) {
-                // Check the removed level if deleting the order 
-                if((sell_prev == NULL || sell_prev->price != sell_cursor->price) &&
-                    (sell_cursor->next == NULL || sell_cursor->price != sell_cursor->next->price)) {
-                    removed_level = 1;
+        if(side != BUY) {
+            for(int j=0; j<stop_books[i].num_sell_stops; j++) {
+                num_stops += stop_books[i].sell_stops[j].order.trader_id == trader_id;
+            }
+        }
+    }
+    return num_stops;
+}
+
+int market_sweep_price(struct order *received_order, int product_idx) {
+    struct order_list* product_orders = &(order_book[product_idx]);
+    uint32_t level_ref = received_order->order_type == BUY ? product_orders->sell_level_head : product_orders->buy_level_head;
+
+    // Sum the aggregates from the best level, without visiting the orders
+    long int available = 0;
+    int sweep_price = 0;
+    while(level_ref) {
+        struct price_level *level = LEVEL_AT(level_ref);
+        sweep_price = level->price;
+        available += level->total_qty;
+        if(available >= received_order->qty) {
+            break;
+        }
+        level_ref = level->next;
+    }
+    return sweep_price;
+}
+
+int can_fill_order(struct order *received_order, int product_idx) {
+    struct order_list* product_orders = &(order_book[product_idx]);
+    int is_buy = received_order->order_type == BUY;
+    uint32_t level_ref = is_buy ? product_orders->sell_level_head : product_orders->buy_level_head;
+
+    // Sum the aggregates of the crossing levels, without visiting their orders
+    long int available = 0;
+    while(level_ref) {
+        struct price_level *level = LEVEL_AT(level_ref);
+        if((is_buy && received_order->price < level->price) ||
+            (!is_buy && received_order->price > level->price)) {
+            break;
+        }
+        available += level->total_qty;
+        if(available >= received_order->qty) {
+            return 1;
+        }
+        level_ref = level->next;
+    }
+    return 0;
+}
+
+void discard_remainder(struct order *received_order, int *fds_exchange) {
+    received_order->qty = 0;
+    int trader_id = received_order->trader_id;
+    if(traders.trader_arr[trader_id].is_alive) {
+        char write_buf[BUF_LEN];
+        int write_len = format_message(write_buf, MSG_PREFIX("CANCELLED "), 1, (long int[]){received_order->order_id});
+        send_to_trader(fds_exchange, trader_id, write_buf, write_len);
+    }
+}
+
+void match_order(struct order *received_order, int product_idx, int *fds_exchange) {
+    // Get the order list for current product
+    struct order_list* product_orders = &(order_book[product_idx]);
+    int is_buy = received_order->order_type == BUY;
+
+    // The opposite side of the book
+    enum OrderType contra_side = is_buy ? SELL : BUY;
+    uint32_t *contra_head = is_buy ? &product_orders->sell_head : &product_orders->buy_head;
+    uint32_t *contra_level_head = is_buy ? &product_orders->sell_level_head : &product_orders->buy_level_head;
+    int *contra_list_size = is_buy ? &product_orders->sell_list_size : &product_orders->buy_list_size;
+    int *contra_levels = is_buy ? &product_orders->sell_levels : &product_orders->buy_levels;
+
+    // The aggressor fills aggregated in this sweep
+    int initial_qty = received_order->qty;
+    long int filled_value = 0;
+
+    while(received_order->qty > 0 && *contra_level_head != LEVEL_NIL) {
+        uint32_t level_ref = *contra_level_head;
+        struct price_level *level = LEVEL_AT(level_ref);
+
+        // Check the price, the levels are sorted from the best price
+        if((is_buy && received_order->price < level->price) ||
+            (!is_buy && received_order->price > level->price)) {
+            break;
+        }
+
+        mark_level_dirty(product_idx, contra_side, level->price);
+
+        // Warm up the next level while this one is matched
+        if(level->next) {
+            __builtin_prefetch(LEVEL_AT(level->next));
+        }
+
+        if(received_order->qty >= level->total_qty && level->num_icebergs == 0) {
+            // The order takes the whole level, every resting order fills completely
+            uint32_t ref = level->head;
+            uint32_t after_level = ORDER_AT(level->tail)->next;
+            for(int n = level->num_orders; n > 0; n--) {
+                struct book_order *resting_order = ORDER_AT(ref);
+                uint32_t next = resting_order->next;
+
+                // The next order was prefetched one step ago, use it to prefetch
+                // the order after it and the position the next match updates
+                if(next) {
+                    struct book_order *upcoming = ORDER_AT(next);
+                    __builtin_prefetch(ORDER_AT(upcoming->next));
+                    __builtin_prefetch(&POSITION_PROFIT(&traders.positions, upcoming->trader_id, product_idx), 1);
+                }
+
+                filled_value += execute_match(received_order, resting_order, resting_order->qty, product_idx, fds_exchange);
+                unlink_trader_order(&traders.trader_arr[resting_order->trader_id], ref);
+                disarm_order_timer(&timer_wheel, ref);
+                release_book_order(&order_pool, ref);
+                ref = next;
+            }
+
+            // Detach the whole level from the order chain and the level list at once
+            *contra_head = after_level;
+            if(after_level) {
+                ORDER_AT(after_level)->prev = ORDER_NIL;
+            }
+            *contra_level_head = level->next;
+            if(level->next) {
+                LEVEL_AT(level->next)->prev = LEVEL_NIL;
+            }
+            *contra_list_size -= level->num_orders;
+            *contra_levels -= 1;
+            release_price_level(&level_pool, level_ref);
+        } else {
+            // The level outlasts the order or holds icebergs, fill in time priority
+            // until the order is done or the level is gone
+            while(received_order->qty > 0 && *contra_level_head == level_ref) {
+                uint32_t ref = level->head;
+                struct book_order *resting_order = ORDER_AT(ref);
+                if(resting_order->next) {
+                    __builtin_prefetch(ORDER_AT(resting_order->next));
                 }
 
-                // If the old order is the head
-                if(sell_prev == NULL) {
-                    product_orders->sell_head = sell_cursor->next;
+                // The match qty should be the smaller one of two matching orders
+                int match_qty;
+                if (resting_order->qty < received_order->qty) {
+                    match_qty = resting_order->qty;
                 } else {
-                    sell_prev->next = sell_cursor->next;
+                    match_qty = received_order->qty;
                 }
 
-                free(cancel_order);
-                product_orders->sell_levels -= removed_level;
-                product_orders->sell_list_size --;
-                break;
-            } else {
-                sell_prev = sell_cursor;
-                sell_cursor = sell_cursor->next;
+                filled_value += execute_match(received_order, resting_order, match_qty, product_idx, fds_exchange);
+                level->total_qty -= match_qty;
+
+                // Refill a filled iceberg from its reserve, or remove the filled order
+                if(resting_order->qty == 0) {
+                    if(resting_order->reserve_qty > 0) {
+                        replenish_iceberg(product_orders, contra_side, ref);
+                    } else {
+                        remove_book_order(product_orders, contra_side, ref);
+                    }
+                }
             }
         }
+    }
+
+    int filled_qty = initial_qty - received_order->qty;
+    if(config.fill_report != FILL_PER_MATCH && filled_qty > 0) {
+        notify_fill_summary(fds_exchange, received_order->trader_id, received_order->order_id, filled_qty, filled_value);
+    }
+}
+
+long int execute_match(struct order *received_order, struct book_order *resting_order, int match_qty, int product_idx, int *fds_exchange) {
+    long int match_value = (long int)match_qty * resting_order->price;
+    // The aggressor takes liquidity and the resting order makes it
+    long int taker_fee = compute_fee(match_value, FEE_TAKER_BPS(&traders.fees, received_order->trader_id, product_idx));
+    long int maker_fee = compute_fee(match_value, FEE_MAKER_BPS(&traders.fees, resting_order->trader_id, product_idx));
+    long int match_fee = taker_fee + maker_fee;
+
+    // Print the matching infomation
+    PEX_LOG(LOG_MATCHES, LOG_PREFIX" Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", resting_order->order_id, resting_order->trader_id, received_order->order_id, received_order->trader_id, match_value, match_fee);
+
+    // Notify corresponding traders, the aggressor fills may be aggregated by the caller
+    notify_filler(fds_exchange, resting_order->trader_id, resting_order->order_id, match_qty);
+    if(config.fill_report == FILL_PER_MATCH) {
+        notify_filler(fds_exchange, received_order->trader_id, received_order->order_id, match_qty);
+    }
 
+    // Update qty after matching
+    received_order->qty -= match_qty;
+    resting_order->qty -= match_qty;
+
+    // Both cells are in the column of the product
+    struct position_matrix *positions = &traders.positions;
+    int *aggressor_qty = &POSITION_QTY(positions, received_order->trader_id, product_idx);
+    long int *aggressor_profit = &POSITION_PROFIT(positions, received_order->trader_id, product_idx);
+    int *resting_qty = &POSITION_QTY(positions, resting_order->trader_id, product_idx);
+    long int *resting_profit = &POSITION_PROFIT(positions, resting_order->trader_id, product_idx);
+    if(received_order->order_type == BUY) {
+        // Update positions for buyer, the aggressor pays the taker fee
+        *aggressor_qty += match_qty;
+        *aggressor_profit -= (match_value + taker_fee);
+
+        // Update positions for seller, the resting order pays the maker fee
+        *resting_qty -= match_qty;
+        *resting_profit += (match_value - maker_fee);
+    } else {
+        // Update positions for seller, the aggressor pays the taker fee
+        *aggressor_qty -= match_qty;
+        *aggressor_profit += (match_value - taker_fee);
+
+        // Update positions for buyer, the resting order pays the maker fee
+        *resting_qty += match_qty;
+        *resting_profit -= (match_value + maker_fee);
     }
+    mark_position_dirty(received_order->trader_id, product_idx);
+    mark_position_dirty(resting_order->trader_id, product_idx);
+
+    // The last trade price triggers stop orders
+    order_book[product_idx].last_price = resting_order->price;
 
+    // Update exchange fees
+    exchange_fees += match_fee;
+    return match_value;
+}
+
+uint32_t rest_order(struct order *received_order, int product_idx) {
+    struct order_list* product_orders = &(order_book[product_idx]);
+    int is_buy = received_order->order_type == BUY;
+    int price = received_order->price;
+    uint32_t *level_head = is_buy ? &product_orders->buy_level_head : &product_orders->sell_level_head;
+    uint32_t *order_head = is_buy ? &product_orders->buy_head : &product_orders->sell_head;
+
+    // Find the level of the price, buy levels are sorted high to low and sell levels low to high
+    uint32_t level_prev = LEVEL_NIL;
+    uint32_t level_ref = *level_head;
+    while(level_ref) {
+        int level_price = LEVEL_AT(level_ref)->price;
+        if(level_price == price || (is_buy && level_price < price) || (!is_buy && level_price > price)) {
+            break;
+        }
+        level_prev = level_ref;
+        level_ref = LEVEL_AT(level_ref)->next;
+    }
+
+    if(level_ref == LEVEL_NIL || LEVEL_AT(level_ref)->price != price) {
+        // Add a new level between the better and the worse level
+        uint32_t new_level_ref = alloc_price_level(&level_pool);
+        struct price_level *new_level = LEVEL_AT(new_level_ref);
+        new_level->price = price;
+        new_level->num_orders = 0;
+        new_level->total_qty = 0;
+        new_level->num_icebergs = 0;
+        new_level->head = ORDER_NIL;
+        new_level->tail = ORDER_NIL;
+        new_level->prev = level_prev;
+        new_level->next = level_ref;
+        if(level_prev) {
+            LEVEL_AT(level_prev)->next = new_level_ref;
+        } else {
+            *level_head = new_level_ref;
+        }
+        if(level_ref) {
+            LEVEL_AT(level_ref)->prev = new_level_ref;
+        }
+
+        // Update the levels
+        if(is_buy) {
+            product_orders->buy_levels++;
+        } else {
+            product_orders->sell_levels++;
+        }
+        level_ref = new_level_ref;
+    }
+
+    // Add new order node at the back of its level
+    uint32_t new_ref = alloc_book_order(&order_pool);
+    struct book_order* new_node = ORDER_AT(new_ref);
+    struct price_level *level = LEVEL_AT(level_ref);
+    new_node->price = price;
+    new_node->qty = received_order->qty;
+    new_node->reserve_qty = 0;
+    if(received_order->display_qty > 0 && received_order->qty > received_order->display_qty) {
+        // Show only the clip of an iceberg
+        new_node->qty = received_order->display_qty;
+        new_node->reserve_qty = received_order->qty - received_order->display_qty;
+        level->num_icebergs++;
+    }
+    new_node->order_id = received_order->order_id;
+    new_node->trader_id = received_order->trader_id;
+    new_node->level = level_ref;
+    ORDER_INFO(new_ref)->product_idx = product_idx;
+    ORDER_INFO(new_ref)->order_type = received_order->order_type;
+    ORDER_INFO(new_ref)->display_qty = received_order->display_qty;
+    ORDER_INFO(new_ref)->timer_slot = TIMER_NONE;
+    link_trader_order(&traders.trader_arr[received_order->trader_id], new_ref);
+    if(received_order->tif == TIF_GTT) {
+        arm_order_timer(&timer_wheel, new_ref, received_order->expire_tick);
+    }
+
+    // Link after the tail of the level, or after the tail of the better level for a new level
+    uint32_t chain_prev = level->tail;
+    if(chain_prev == ORDER_NIL && level->prev) {
+        chain_prev = LEVEL_AT(level->prev)->tail;
+    }
+    new_node->prev = chain_prev;
+    if(chain_prev) {
+        new_node->next = ORDER_AT(chain_prev)->next;
+        ORDER_AT(chain_prev)->next = new_ref;
+    } else {
+        // Insert before the head node as new head
+        new_node->next = *order_head;
+        *order_head = new_ref;
+    }
+    if(new_node->next) {
+        ORDER_AT(new_node->next)->prev = new_ref;
+    }
+
+    // Update the level aggregate and the list size
+    if(level->head == ORDER_NIL) {
+        level->head = new_ref;
+    }
+    level->tail = new_ref;
+    level->num_orders++;
+    level->total_qty += new_node->qty;
+    mark_level_dirty(product_idx, received_order->order_type, price);
+    if(is_buy) {
+        product_orders->buy_list_size++;
+    } else {
+        product_orders->sell_list_size++;
+    }
+    return new_ref;
+}
+
+void remove_book_order(struct order_list *product_orders, enum OrderType side, uint32_t ref) {
+    struct book_order *order = ORDER_AT(ref);
+    uint32_t level_ref = order->level;
+    struct price_level *level = LEVEL_AT(level_ref);
+    mark_level_dirty(ORDER_INFO(ref)->product_idx, side, level->price);
+
+    // Unlink the order from the chain, it is doubly linked so no walk is needed
+    if(order->prev) {
+        ORDER_AT(order->prev)->next = order->next;
+    } else if(side == BUY) {
+        product_orders->buy_head = order->next;
+    } else {
+        product_orders->sell_head = order->next;
+    }
+    if(order->next) {
+        ORDER_AT(order->next)->prev = order->prev;
+    }
+
+    // Update the level aggregate
+    level->total_qty -= order->qty;
+    level->num_orders--;
+    if(order->reserve_qty > 0) {
+        level->num_icebergs--;
+    }
+    if(level->num_orders == 0) {
+        // Remove the empty level
+        if(level->prev) {
+            LEVEL_AT(level->prev)->next = level->next;
+        } else if(side == BUY) {
+            product_orders->buy_level_head = level->next;
+        } else {
+            product_orders->sell_level_head = level->next;
+        }
+        if(level->next) {
+            LEVEL_AT(level->next)->prev = level->prev;
+        }
+        release_price_level(&level_pool, level_ref);
+
+        if(side == BUY) {
+            product_orders->buy_levels--;
+        } else {
+            product_orders->sell_levels--;
+        }
+    } else {
+        if(level->head == ref) {
+            level->head = order->next;
+        }
+        if(level->tail == ref) {
+            level->tail = order->prev;
+        }
+    }
+
+    // Update the list size
+    if(side == BUY) {
+        product_orders->buy_list_size--;
+    } else {
+        product_orders->sell_list_size--;
+    }
+    unlink_trader_order(&traders.trader_arr[order->trader_id], ref);
+    disarm_order_timer(&timer_wheel, ref);
+    release_book_order(&order_pool, ref);
+}
+
+void replenish_iceberg(struct order_list *product_orders, enum OrderType side, uint32_t ref) {
+    struct book_order *order = ORDER_AT(ref);
+    struct price_level *level = LEVEL_AT(order->level);
+
+    // Show the next clip, the last clip may be smaller
+    int clip = ORDER_INFO(ref)->display_qty;
+    if(clip > order->reserve_qty) {
+        clip = order->reserve_qty;
+    }
+    order->qty = clip;
+    order->reserve_qty -= clip;
+    level->total_qty += clip;
+    if(order->reserve_qty == 0) {
+        level->num_icebergs--;
+    }
+
+    // The new clip loses time priority, move it behind the tail of its level
+    if(level->tail == ref) {
+        return;
+    }
+    if(level->head == ref) {
+        level->head = order->next;
+    }
+    if(order->prev) {
+        ORDER_AT(order->prev)->next = order->next;
+    } else if(side == BUY) {
+        product_orders->buy_head = order->next;
+    } else {
+        product_orders->sell_head = order->next;
+    }
+    ORDER_AT(order->next)->prev = order->prev;
+
+    uint32_t tail = level->tail;
+    order->prev = tail;
+    order->next = ORDER_AT(tail)->next;
+    ORDER_AT(tail)->next = ref;
+    if(order->next) {
+        ORDER_AT(order->next)->prev = ref;
+    }
+    level->tail = ref;
+}
+
+void link_trader_order(struct trader *trader, uint32_t ref) {
+    // Push at the head, the order of a trader's list does not matter
+    struct order_info *info = ORDER_INFO(ref);
+    info->trader_prev = ORDER_NIL;
+    info->trader_next = trader->order_head;
+    if(trader->order_head) {
+        ORDER_INFO(trader->order_head)->trader_prev = ref;
+    }
+    trader->order_head = ref;
+    trader->num_resting++;
+}
+
+void unlink_trader_order(struct trader *trader, uint32_t ref) {
+    struct order_info *info = ORDER_INFO(ref);
+    if(info->trader_prev) {
+        ORDER_INFO(info->trader_prev)->trader_next = info->trader_next;
+    } else {
+        trader->order_head = info->trader_next;
+    }
+    if(info->trader_next) {
+        ORDER_INFO(info->trader_next)->trader_prev = info->trader_prev;
+    }
+    trader->num_resting--;
+}
+
+int count_trader_orders(int trader_id, int product_idx, enum OrderType side) {
+    int num_orders = 0;
+    uint32_t ref = traders.trader_arr[trader_id].order_head;
+    while(ref) {
+        struct order_info *info = ORDER_INFO(ref);
+        if((product_idx == -1 || info->product_idx == product_idx) && (side == ANY_SIDE || info->order_type == side)) {
+            num_orders++;
+        }
+        ref = info->trader_next;
+    }
+    return num_orders + count_trader_stops(trader_id, product_idx, side);
+}
+
+int cancel_trader_orders(int *fds_exchange, int trader_id, int product_idx, enum OrderType side) {
+    struct trader *trader = &traders.trader_arr[trader_id];
+
+    // One MARKET message per order, sent together at the end
+    size_t batch_cap = (size_t)trader->num_resting * BUF_LEN + 1;
+    char *batch = (char*)malloc(batch_cap);
+    batch[0] = '\0';
+    size_t batch_len = 0;
+    int num_cancelled = 0;
+
+    // Walk the trader's own orders only
+    uint32_t ref = trader->order_head;
+    while(ref) {
+        struct order_info *info = ORDER_INFO(ref);
+        uint32_t next = info->trader_next;
+        if((product_idx == -1 || info->product_idx == product_idx) && (side == ANY_SIDE || info->order_type == side)) {
+            int order_product = info->product_idx;
+            enum OrderType order_side = info->order_type;
+            batch_len += format_message(batch + batch_len, products.market_prefixes[order_product][order_side], products.market_prefix_lens[order_product][order_side], 2, (long int[]){0, 0});
+            remove_book_order(&(order_book[order_product]), order_side, ref);
+            num_cancelled++;
+        }
+        ref = next;
+    }
+
+    if(num_cancelled > 0) {
+        notify_traders_batch(fds_exchange, trader_id, batch, batch_len);
+    }
+    free(batch);
+
+    // Pending stop orders were never shown to the market
+    num_cancelled += remove_trader_stops(trader_id, product_idx, side, -1);
+    return num_cancelled;
+}
+
+void purge_disconnected_traders(int *fds_exchange) {
+    // Block SIGCHLD so a disconnect during the purge is kept for the next call
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    disconnect_pending = 0;
+
+    int num_cancelled = 0;
+    for(int id=0; id<traders.num_traders; id++) {
+        if(!traders.trader_arr[id].is_alive && (traders.trader_arr[id].order_head != ORDER_NIL || count_trader_stops(id, -1, ANY_SIDE) > 0)) {
+            // Journal the disconnect so a replay cancels the same orders
+            if(config.journal_file != NULL) {
+                journal_append(&journal, id, "DISCONNECT", fds_exchange);
+            }
+            int trader_cancelled = cancel_trader_orders(fds_exchange, id, -1, ANY_SIDE);
+            PEX_LOG(LOG_ERRORS, LOG_PREFIX" Cancelled %d orders of trader %d\n", trader_cancelled, id);
+            num_cancelled += trader_cancelled;
+        }
+    }
+
+    // Print the book once for all cancelled orders
+    if(num_cancelled > 0) {
+        show_book_update();
+    }
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+
+void handle_amend(struct order *received_order, int *fds_exchange) {
+
+    // Delete the old order --- received_order->target
+    handle_cancel(received_order, fds_exchange);
+
+    if(received_order->order_type == BUY) {
+        // Add the amended order and process it
+        handle_buy(received_order, fds_exchange);
+    } else if(received_order->order_type == SELL) {
+        // Add the amended order and process it
+        handle_sell(received_order, fds_exchange);
+    }
+}
+
+void handle_cancel(struct order* received_order, int *fds_exchange) {
+    // Retrive the order to be canceled
+    uint32_t cancel_ref = received_order->target;
+    if(cancel_ref == ORDER_NIL) {
+        // A pending stop order
+        remove_trader_stops(received_order->trader_id, -1, ANY_SIDE, received_order->order_id);
+        return;
+    }
+    int product_idx = ORDER_INFO(cancel_ref)->product_idx;
+
+    // Remove it from the order list for its product
+    remove_book_order(&(order_book[product_idx]), ORDER_INFO(cancel_ref)->order_type, cancel_ref);
+}
+
+void handle_bulk(struct bulk_order *bulk, int *fds_exchange) {
+    // Same as one command per order, but the book is printed once at the end
+    for(int i=0; i<bulk->num_legs; i++) {
+        if(bulk->is_valid[i]) {
+            handle_new_order(&bulk->legs[i], fds_exchange);
+        }
+    }
+}
+
+void handle_mass_cancel(struct order* received_order, int *fds_exchange) {
+    int product_idx = -1;
+    if(strcmp(received_order->product, "*") != 0) {
+        product_idx = get_productid_by_name(received_order->product, &products);
+    }
+    cancel_trader_orders(fds_exchange, received_order->trader_id, product_idx, received_order->order_type);
+}
+
+int format_int(char *buf, long int value) {
+    char digits[20];
+    int pos = sizeof(digits);
+    unsigned long int rest = value < 0 ? -(unsigned long int)value : (unsigned long int)value;
+
+    // Two digits per division, from the lowest
+    while(rest >= 100) {
+        int pair = (rest % 100) * 2;
+        rest /= 100;
+        digits[--pos] = digit_pairs[pair + 1];
+        digits[--pos] = digit_pairs[pair];
+    }
+    if(rest >= 10) {
+        digits[--pos] = digit_pairs[rest * 2 + 1];
+        digits[--pos] = digit_pairs[rest * 2];
+    } else {
+        digits[--pos] = '0' + rest;
+    }
+    if(value < 0) {
+        digits[--pos] = '-';
+    }
+
+    int len = sizeof(digits) - pos;
+    memcpy(buf, digits + pos, len);
+    return len;
+}
+
+int format_message(char *buf, const char *prefix, int prefix_len, int num_values, const long int *values) {
+    memcpy(buf, prefix, prefix_len);
+    int len = prefix_len;
+    for(int i=0; i<num_values; i++) {
+        if(i > 0) {
+            buf[len++] = ' ';
+        }
+        len += format_int(buf + len, values[i]);
+    }
+    buf[len++] = ';';
+    return len;
 }
 
 void notify_filler(int *fds_exchange, int trader_id, int order_id, int fill_qty) {
     if(traders.trader_arr[trader_id].is_alive) {
-        char write_buf[BUF_LEN] = {'\0'};
-        snprintf(write_buf, BUF_LEN, "FILL %d %d;", order_id, fill_qty);
-        write(fds_exchange[trader_id], write_buf, strlen(write_buf));
-        kill(traders.trader_arr[trader_id].pid, SIGUSR1);
+        char write_buf[BUF_LEN];
+        int write_len = format_message(write_buf, MSG_PREFIX("FILL "), 2, (long int[]){order_id, fill_qty});
+        send_to_trader(fds_exchange, trader_id, write_buf, write_len);
+    }
+}
+
+void notify_fill_summary(int *fds_exchange, int trader_id, int order_id, int fill_qty, long int fill_value) {
+    if(traders.trader_arr[trader_id].is_alive) {
+        char write_buf[BUF_LEN];
+        int write_len;
+        if(config.fill_report == FILL_AGGREGATE_VWAP) {
+            // Average fill price rounded half up
+            long int vwap = (2 * fill_value + fill_qty) / (2L * fill_qty);
+            write_len = format_message(write_buf, MSG_PREFIX("FILL "), 3, (long int[]){order_id, fill_qty, vwap});
+        } else {
+            write_len = format_message(write_buf, MSG_PREFIX("FILL "), 2, (long int[]){order_id, fill_qty});
+        }
+        send_to_trader(fds_exchange, trader_id, write_buf, write_len);
     }
 }
 
 void show_order_book(struct order_list *order_book) {
-    printf(LOG_PREFIX"\t--ORDERBOOK--\n");
+    log_printf(LOG_PREFIX"\t--ORDERBOOK--\n");
 
     for(int i=0; i<products.num_products; i++) {
-        printf(LOG_PREFIX"\tProduct: %s; Buy levels: %d; Sell levels: %d\n",products.names[i], order_book[i].buy_levels, order_book[i].sell_levels);
-
-        // Print sell orders (reverse price printing highest to lowest)
-        int sell_count = order_book[i].sell_list_size;
-        struct order *sell_cursor = order_book[i].sell_head;
-        if(sell_cursor) {
-            // Reverse list storage, just like a stack
-            struct order **sell_stack = (struct order**)malloc(sell_count * sizeof(struct order*));
-            int *sell_qtys = (int*)malloc(sell_count * sizeof(int));
-            int *sell_counts = (int*)malloc(sell_count * sizeof(int));
-            int stack_index = 0;
-            int qty_sum_sell = sell_cursor->qty; // The quantity of order products at the same level
-            int level_orders_sell = 1; // The number of orders at the same level
-
-            while(sell_cursor->next) {
-                if(sell_cursor->price == sell_cursor->next->price) {
-                    // Iterate and add the same level quantity
-                    sell_cursor = sell_cursor->next;
-                    qty_sum_sell += sell_cursor->qty;
-                    level_orders_sell ++;
-                } else {
-                    // Store in stack
-                    sell_stack[stack_index] = sell_cursor;
-                    sell_qtys[stack_index] = qty_sum_sell;
-                    sell_counts[stack_index] = level_orders_sell;
-                    // The next count
-                    stack_index ++;
-                    sell_cursor = sell_cursor->next;
-                    qty_sum_sell = sell_cursor->qty;
-                    level_orders_sell = 1;
-                }
-            }
-            // Push the final order
-            sell_stack[stack_index] = sell_cursor;
-            sell_qtys[stack_index] = qty_sum_sell;
-            sell_counts[stack_index] = level_orders_sell;
-            stack_index ++;
-
-            // Implement reversing printing
-            for(int j = stack_index-1; j >= 0; j--) {
-                sell_cursor = sell_stack[j];
-                if(sell_counts[j] > 1) {
-                    printf(LOG_PREFIX"\t\tSELL %d @ $%d (%d orders)\n", sell_qtys[j], sell_cursor->price, sell_counts[j]);
-                } else{
-                    printf(LOG_PREFIX"\t\tSELL %d @ $%d (%d order)\n", sell_qtys[j], sell_cursor->price, sell_counts[j]);
-                }
+        log_printf(LOG_PREFIX"\tProduct: %s; Buy levels: %d; Sell levels: %d\n",products.names[i], order_book[i].buy_levels, order_book[i].sell_levels);
+
+        // Print sell levels (reverse price printing highest to lowest)
+        // Walk to the worst level first, then back along the prev links
+        uint32_t sell_level = order_book[i].sell_level_head;
+        while(sell_level && LEVEL_AT(sell_level)->next) {
+            sell_level = LEVEL_AT(sell_level)->next;
+        }
+        while(sell_level) {
+            struct price_level *level = LEVEL_AT(sell_level);
+            if(level->num_orders > 1) {
+                log_printf(LOG_PREFIX"\t\tSELL %ld @ $%d (%d orders)\n", level->total_qty, level->price, level->num_orders);
+            } else{
+                log_printf(LOG_PREFIX"\t\tSELL %ld @ $%d (%d order)\n", level->total_qty, level->price, level->num_orders);
             }
-            free(sell_stack);
-            free(sell_qtys);
-            free(sell_counts);
+            sell_level = level->prev;
         }
 
-
-        // Print buy orders
-        struct order *buy_cursor = order_book[i].buy_head;
-        while(buy_cursor) {
-            int qty_sum = buy_cursor->qty; // The quantity of order products at the same level
-            int level_orders = 1; // The number of orders at the same level
-            while(buy_cursor->next && buy_cursor->price == buy_cursor->next->price) {
-                // Iterate and add the same level quantity
-                buy_cursor = buy_cursor->next;
-                qty_sum += buy_cursor->qty;
-                level_orders ++;
-            }
-            if(level_orders > 1) {
-                printf(LOG_PREFIX"\t\tBUY %d @ $%d (%d orders)\n", qty_sum, buy_cursor->price, level_orders);
+        // Print buy levels
+        uint32_t buy_level = order_book[i].buy_level_head;
+        while(buy_level) {
+            struct price_level *level = LEVEL_AT(buy_level);
+            if(level->num_orders > 1) {
+                log_printf(LOG_PREFIX"\t\tBUY %ld @ $%d (%d orders)\n", level->total_qty, level->price, level->num_orders);
             } else{
-                printf(LOG_PREFIX"\t\tBUY %d @ $%d (%d order)\n", qty_sum, buy_cursor->price, level_orders);
+                log_printf(LOG_PREFIX"\t\tBUY %ld @ $%d (%d order)\n", level->total_qty, level->price, level->num_orders);
             }
-            buy_cursor = buy_cursor->next;
+            buy_level = level->next;
         }
     }
 }
 
 void show_positions(struct trader_list *traders) {
-    printf(LOG_PREFIX"\t--POSITIONS--\n");
+    log_printf(LOG_PREFIX"\t--POSITIONS--\n");
     for(int id=0; id<traders->num_traders; id++) {
-        printf(LOG_PREFIX"\tTrader %d: ", id);
+        log_printf(LOG_PREFIX"\tTrader %d: ", id);
         for(int i=0; i<products.num_products; i++) {
-            char *product_name = traders->trader_arr[id].positions[i].product;
-            int owned_qty = traders->trader_arr[id].positions[i].qty;
-            long int profit = traders->trader_arr[id].positions[i].profit;
+            char *product_name = products.names[i];
+            int owned_qty = POSITION_QTY(&traders->positions, id, i);
+            long int profit = POSITION_PROFIT(&traders->positions, id, i);
             if(i < products.num_products-1) {
-                printf("%s %d ($%ld), ",product_name, owned_qty, profit);
+                log_printf("%s %d ($%ld), ",product_name, owned_qty, profit);
             } else {
-                printf("%s %d ($%ld)\n",product_name, owned_qty, profit);
+                log_printf("%s %d ($%ld)\n",product_name, owned_qty, profit);
             }
         }
     }
 }
 
+void init_book_diff(struct book_diff *diff, int num_traders, int num_products) {
+    diff->levels = malloc(BOOK_DIFF_LEVELS_BASE * sizeof(struct level_mark));
+    diff->num_levels = 0;
+    diff->levels_capacity = BOOK_DIFF_LEVELS_BASE;
+    diff->cells = malloc(num_traders * num_products * sizeof(int));
+    diff->num_cells = 0;
+    diff->cell_dirty = calloc(num_traders * num_products, sizeof(unsigned char));
+    if(diff->levels == NULL || diff->cells == NULL || diff->cell_dirty == NULL) {
+        perror("Error allocating book diff");
+        exit(1);
+    }
+}
+
+void free_book_diff(struct book_diff *diff) {
+    free(diff->levels);
+    free(diff->cells);
+    free(diff->cell_dirty);
+    diff->levels = NULL;
+    diff->cells = NULL;
+    diff->cell_dirty = NULL;
+}
+
+void mark_level_dirty(int product_idx, enum OrderType side, int price) {
+    if(!config.book_diffs) {
+        return;
+    }
+    struct book_diff *diff = &book_diff;
+
+    // A sweep marks each level once, so only repeat the check against the last mark
+    if(diff->num_levels > 0) {
+        struct level_mark *last = &diff->levels[diff->num_levels-1];
+        if(last->product_idx == product_idx && last->side == side && last->price == price) {
+            return;
+        }
+    }
+    if(diff->num_levels == diff->levels_capacity) {
+        diff->levels_capacity *= 2;
+        diff->levels = realloc(diff->levels, diff->levels_capacity * sizeof(struct level_mark));
+        if(diff->levels == NULL) {
+            perror("Error growing book diff");
+            exit(1);
+        }
+    }
+    struct level_mark *mark = &diff->levels[diff->num_levels++];
+    mark->product_idx = product_idx;
+    mark->side = side;
+    mark->price = price;
+}
+
+void mark_position_dirty(int trader_id, int product_idx) {
+    if(!TRACK_CHANGES) {
+        return;
+    }
+    struct book_diff *diff = &book_diff;
+    int cell = product_idx * traders.positions.num_traders + trader_id;
+    if(!diff->cell_dirty[cell]) {
+        diff->cell_dirty[cell] = 1;
+        diff->cells[diff->num_cells++] = cell;
+    }
+}
+
+void clear_book_diff(struct book_diff *diff) {
+    for(int i=0; i<diff->num_cells; i++) {
+        diff->cell_dirty[diff->cells[i]] = 0;
+    }
+    diff->num_cells = 0;
+    diff->num_levels = 0;
+}
+
+int compare_level_marks(const void *a, const void *b) {
+    const struct level_mark *x = a;
+    const struct level_mark *y = b;
+    if(x->product_idx != y->product_idx) {
+        return x->product_idx - y->product_idx;
+    }
+    if(x->side != y->side) {
+        return x->side == SELL ? -1 : 1;
+    }
+    return (y->price > x->price) - (y->price < x->price);
+}
+
+int compare_position_cells(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    int num_traders = traders.positions.num_traders;
+    if(x % num_traders != y % num_traders) {
+        return x % num_traders - y % num_traders;
+    }
+    return x / num_traders - y / num_traders;
+}
+
+void show_book_diff(struct book_diff *diff) {
+    if(diff->num_levels > 0) {
+        // Sort the marks and drop the repeats
+        qsort(diff->levels, diff->num_levels, sizeof(struct level_mark), compare_level_marks);
+        int num_unique = 1;
+        for(int i=1; i<diff->num_levels; i++) {
+            if(compare_level_marks(&diff->levels[i], &diff->levels[num_unique-1]) != 0) {
+                diff->levels[num_unique++] = diff->levels[i];
+            }
+        }
+        diff->num_levels = num_unique;
+
+        // Look up the current state of each mark. Both level lists start at the best
+        // price, so each side is walked once and only as deep as its deepest mark.
+        int start = 0;
+        while(start < diff->num_levels) {
+            int product_idx = diff->levels[start].product_idx;
+            int end = start;
+            while(end < diff->num_levels && diff->levels[end].product_idx == product_idx) {
+                end++;
+            }
+            int buy_start = start;
+            while(buy_start < end && diff->levels[buy_start].side == SELL) {
+                buy_start++;
+            }
+
+            // Sell marks are high to low, walk them backwards from the lowest
+            uint32_t level_ref = order_book[product_idx].sell_level_head;
+            for(int i=buy_start-1; i>=start; i--) {
+                struct level_mark *mark = &diff->levels[i];
+                while(level_ref && LEVEL_AT(level_ref)->price < mark->price) {
+                    level_ref = LEVEL_AT(level_ref)->next;
+                }
+                if(level_ref && LEVEL_AT(level_ref)->price == mark->price) {
+                    mark->total_qty = LEVEL_AT(level_ref)->total_qty;
+                    mark->num_orders = LEVEL_AT(level_ref)->num_orders;
+                } else {
+                    mark->total_qty = 0;
+                    mark->num_orders = 0;
+                }
+            }
+
+            // Buy marks are high to low like the buy levels
+            level_ref = order_book[product_idx].buy_level_head;
+            for(int i=buy_start; i<end; i++) {
+                struct level_mark *mark = &diff->levels[i];
+                while(level_ref && LEVEL_AT(level_ref)->price > mark->price) {
+                    level_ref = LEVEL_AT(level_ref)->next;
+                }
+                if(level_ref && LEVEL_AT(level_ref)->price == mark->price) {
+                    mark->total_qty = LEVEL_AT(level_ref)->total_qty;
+                    mark->num_orders = LEVEL_AT(level_ref)->num_orders;
+                } else {
+                    mark->total_qty = 0;
+                    mark->num_orders = 0;
+                }
+            }
+            start = end;
+        }
+
+        log_printf(LOG_PREFIX"\t--ORDERBOOK CHANGES--\n");
+        for(int i=0; i<diff->num_levels; i++) {
+            struct level_mark *mark = &diff->levels[i];
+            if(i == 0 || mark->product_idx != diff->levels[i-1].product_idx) {
+                log_printf(LOG_PREFIX"\tProduct: %s; Buy levels: %d; Sell levels: %d\n", products.names[mark->product_idx], order_book[mark->product_idx].buy_levels, order_book[mark->product_idx].sell_levels);
+            }
+            const char *side_name = mark->side == BUY ? "BUY" : "SELL";
+            if(mark->num_orders == 1) {
+                log_printf(LOG_PREFIX"\t\t%s %ld @ $%d (%d order)\n", side_name, mark->total_qty, mark->price, mark->num_orders);
+            } else {
+                log_printf(LOG_PREFIX"\t\t%s %ld @ $%d (%d orders)\n", side_name, mark->total_qty, mark->price, mark->num_orders);
+            }
+        }
+    }
+
+    show_position_diff(diff);
+    clear_book_diff(diff);
+}
+
+void show_position_diff(struct book_diff *diff) {
+    if(diff->num_cells > 0) {
+        qsort(diff->cells, diff->num_cells, sizeof(int), compare_position_cells);
+        int num_traders = traders.positions.num_traders;
+        log_printf(LOG_PREFIX"\t--POSITION CHANGES--\n");
+        for(int i=0; i<diff->num_cells; i++) {
+            int trader_id = diff->cells[i] % num_traders;
+            int product_idx = diff->cells[i] / num_traders;
+            if(i == 0 || diff->cells[i-1] % num_traders != trader_id) {
+                log_printf(LOG_PREFIX"\tTrader %d: ", trader_id);
+            }
+            int owned_qty = POSITION_QTY(&traders.positions, trader_id, product_idx);
+            long int profit = POSITION_PROFIT(&traders.positions, trader_id, product_idx);
+            if(i < diff->num_cells-1 && diff->cells[i+1] % num_traders == trader_id) {
+                log_printf("%s %d ($%ld), ", products.names[product_idx], owned_qty, profit);
+            } else {
+                log_printf("%s %d ($%ld)\n", products.names[product_idx], owned_qty, profit);
+            }
+        }
+    }
+}
+
+void show_book_update(void) {
+    // A full snapshot on the count cadence or on request, which stands for the update when inline
+    num_book_updates++;
+    if(snapshot_requested || (config.snapshot_every > 0 && num_book_updates % config.snapshot_every == 0)) {
+        snapshot_requested = 0;
+        if(emit_book_snapshot()) {
+            if(TRACK_CHANGES) {
+                clear_book_diff(&book_diff);
+            }
+            return;
+        }
+    }
+
+    // The book is only part of the full output, the marks are dropped with it
+    if(!LOG_ENABLED(LOG_FULL)) {
+        if(TRACK_CHANGES) {
+            clear_book_diff(&book_diff);
+        }
+        return;
+    }
+    if(!TRACK_CHANGES) {
+        // On a cadence the book is not printed per update
+        if(!PERIODIC_SNAPSHOTS) {
+            show_order_book(order_book);
+            show_positions(&traders);
+        }
+        return;
+    }
+
+    // The changes since the last update
+    if(config.book_diffs) {
+        show_book_diff(&book_diff);
+    } else {
+        // The full book with the changed positions only
+        show_order_book(order_book);
+        show_position_diff(&book_diff);
+        clear_book_diff(&book_diff);
+    }
+}
+
+void copy_book_snapshot(struct book_snapshot *snapshot) {
+    // Size the arrays for the book on first use
+    if(snapshot->buy_levels == NULL) {
+        snapshot->num_products = products.num_products;
+        snapshot->num_traders = traders.positions.num_traders;
+        int num_cells = snapshot->num_products * snapshot->num_traders;
+        snapshot->buy_levels = (int*)malloc(snapshot->num_products * sizeof(int));
+        snapshot->sell_levels = (int*)malloc(snapshot->num_products * sizeof(int));
+        snapshot->qty = (int*)malloc(num_cells * sizeof(int));
+        snapshot->profit = (long int*)malloc(num_cells * sizeof(long int));
+        if(snapshot->buy_levels == NULL || snapshot->sell_levels == NULL || snapshot->qty == NULL || snapshot->profit == NULL) {
+            perror("Error allocating book snapshot");
+            exit(1);
+        }
+    }
+
+    int total_levels = 0;
+    for(int i=0; i<products.num_products; i++) {
+        total_levels += order_book[i].buy_levels + order_book[i].sell_levels;
+    }
+    if(total_levels > snapshot->levels_capacity) {
+        snapshot->levels_capacity = total_levels * 2;
+        free(snapshot->levels);
+        snapshot->levels = (struct level_mark*)malloc(snapshot->levels_capacity * sizeof(struct level_mark));
+        if(snapshot->levels == NULL) {
+            perror("Error allocating book snapshot levels");
+            exit(1);
+        }
+    }
+
+    // Only the level aggregates are copied, in print order
+    int num_levels = 0;
+    for(int i=0; i<products.num_products; i++) {
+        snapshot->buy_levels[i] = order_book[i].buy_levels;
+        snapshot->sell_levels[i] = order_book[i].sell_levels;
+
+        // The sells are printed highest first, fill them from the back
+        num_levels += order_book[i].sell_levels;
+        int sell_idx = num_levels;
+        for(uint32_t ref = order_book[i].sell_level_head; ref; ref = LEVEL_AT(ref)->next) {
+            struct level_mark *mark = &snapshot->levels[--sell_idx];
+            mark->product_idx = i;
+            mark->side = SELL;
+            mark->price = LEVEL_AT(ref)->price;
+            mark->total_qty = LEVEL_AT(ref)->total_qty;
+            mark->num_orders = LEVEL_AT(ref)->num_orders;
+        }
+        for(uint32_t ref = order_book[i].buy_level_head; ref; ref = LEVEL_AT(ref)->next) {
+            struct level_mark *mark = &snapshot->levels[num_levels++];
+            mark->product_idx = i;
+            mark->side = BUY;
+            mark->price = LEVEL_AT(ref)->price;
+            mark->total_qty = LEVEL_AT(ref)->total_qty;
+            mark->num_orders = LEVEL_AT(ref)->num_orders;
+        }
+    }
+    snapshot->num_levels = num_levels;
+
+    int num_cells = snapshot->num_products * snapshot->num_traders;
+    memcpy(snapshot->qty, traders.positions.qty, num_cells * sizeof(int));
+    memcpy(snapshot->profit, traders.positions.profit, num_cells * sizeof(long int));
+    snapshot->tick = current_tick();
+    snapshot->seq++;
+}
+
+void write_book_snapshot(FILE *fp, const struct book_snapshot *snapshot) {
+    fprintf(fp, LOG_PREFIX" Snapshot %u at %u ms\n", snapshot->seq, snapshot->tick * TIMER_TICK_MS);
+    fprintf(fp, LOG_PREFIX"\t--ORDERBOOK--\n");
+    int level_idx = 0;
+    for(int i=0; i<snapshot->num_products; i++) {
+        fprintf(fp, LOG_PREFIX"\tProduct: %s; Buy levels: %d; Sell levels: %d\n", products.names[i], snapshot->buy_levels[i], snapshot->sell_levels[i]);
+        while(level_idx < snapshot->num_levels && snapshot->levels[level_idx].product_idx == i) {
+            const struct level_mark *mark = &snapshot->levels[level_idx++];
+            const char *side_name = mark->side == BUY ? "BUY" : "SELL";
+            if(mark->num_orders > 1) {
+                fprintf(fp, LOG_PREFIX"\t\t%s %ld @ $%d (%d orders)\n", side_name, mark->total_qty, mark->price, mark->num_orders);
+            } else {
+                fprintf(fp, LOG_PREFIX"\t\t%s %ld @ $%d (%d order)\n", side_name, mark->total_qty, mark->price, mark->num_orders);
+            }
+        }
+    }
+
+    fprintf(fp, LOG_PREFIX"\t--POSITIONS--\n");
+    for(int id=0; id<snapshot->num_traders; id++) {
+        fprintf(fp, LOG_PREFIX"\tTrader %d: ", id);
+        for(int i=0; i<snapshot->num_products; i++) {
+            int cell = i * snapshot->num_traders + id;
+            if(i < snapshot->num_products-1) {
+                fprintf(fp, "%s %d ($%ld), ", products.names[i], snapshot->qty[cell], snapshot->profit[cell]);
+            } else {
+                fprintf(fp, "%s %d ($%ld)\n", products.names[i], snapshot->qty[cell], snapshot->profit[cell]);
+            }
+        }
+    }
+}
+
+void free_book_snapshot(struct book_snapshot *snapshot) {
+    free(snapshot->buy_levels);
+    free(snapshot->sell_levels);
+    free(snapshot->levels);
+    free(snapshot->qty);
+    free(snapshot->profit);
+    memset(snapshot, 0, sizeof(struct book_snapshot));
+}
+
+void start_snapshot_writer(struct snapshot_writer *writer, const char *filename) {
+    memset(&writer->snapshot, 0, sizeof(struct book_snapshot));
+    writer->fp = fopen(filename, "w");
+    if(writer->fp == NULL) {
+        perror("Error opening snapshot file");
+        exit(1);
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->ready, NULL);
+    atomic_init(&writer->pending, 0);
+    writer->running = 1;
+    writer->num_skipped = 0;
+
+    // Signals are left to the event loop, as for the log writer
+    sigset_t mask, oldmask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &oldmask);
+    if(pthread_create(&writer->thread, NULL, snapshot_writer_main, writer) != 0) {
+        perror("Error starting snapshot writer");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+void stop_snapshot_writer(struct snapshot_writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->running = 0;
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    fclose(writer->fp);
+    if(writer->num_skipped > 0) {
+        PEX_LOG(LOG_ERRORS, LOG_PREFIX" Skipped %d snapshots while the writer was busy\n", writer->num_skipped);
+    }
+    free_book_snapshot(&writer->snapshot);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->ready);
+}
+
+void *snapshot_writer_main(void *arg) {
+    struct snapshot_writer *writer = (struct snapshot_writer*)arg;
+    while(1) {
+        pthread_mutex_lock(&writer->lock);
+        while(!atomic_load(&writer->pending) && writer->running) {
+            pthread_cond_wait(&writer->ready, &writer->lock);
+        }
+        int running = writer->running;
+        pthread_mutex_unlock(&writer->lock);
+
+        // The copy is only written here while pending is set
+        if(atomic_load(&writer->pending)) {
+            write_book_snapshot(writer->fp, &writer->snapshot);
+            fflush(writer->fp);
+            atomic_store(&writer->pending, 0);
+        } else if(!running) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int emit_book_snapshot(void) {
+    if(config.snapshot_file == NULL) {
+        if(LOG_ENABLED(LOG_FULL)) {
+            show_order_book(order_book);
+            show_positions(&traders);
+        }
+        return 1;
+    }
+
+    // Skip the snapshot rather than wait while the last one is being written
+    if(atomic_load(&snapshot_writer.pending)) {
+        snapshot_writer.num_skipped++;
+        return 0;
+    }
+    copy_book_snapshot(&snapshot_writer.snapshot);
+    pthread_mutex_lock(&snapshot_writer.lock);
+    atomic_store(&snapshot_writer.pending, 1);
+    pthread_cond_signal(&snapshot_writer.ready);
+    pthread_mutex_unlock(&snapshot_writer.lock);
+    return 0;
+}
+
+void checkpoint_request_handler(int sig) {
+    // Taken by the event loop between commands
+    checkpoint_requested = 1;
+}
+
+void snapshot_request_handler(int sig) {
+    // Printed by the event loop, the handler may interrupt a book update
+    snapshot_requested = 1;
+}
+
 void show_trading_end(long int collected_fees) {
-    printf(LOG_PREFIX" Trading completed\n");
-	printf(LOG_PREFIX" Exchange fees collected: $%ld\n",collected_fees);
+    PEX_LOG(LOG_ERRORS, LOG_PREFIX" Trading completed\n");
+	PEX_LOG(LOG_ERRORS, LOG_PREFIX" Exchange fees collected: $%ld\n",collected_fees);
 }
 
 void free_product_list(struct product_list *products) {
     free(products->names);
+    free(products->market_prefixes);
+    free(products->market_prefix_lens);
 }
 
 void free_fds(int *fds_exchange, int *fds_trader) {
@@ -2,15 +2,369 @@
 #define PE_EXCHANGE_H
 
 #include "pe_common.h"
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 
 #define LOG_PREFIX "[PEX]"
+#define MSG_PREFIX(literal) literal, (int)(sizeof(literal) - 1) // A literal message prefix and its length
 #define QUEUE_SIZE_BASE 8
+#define ORDER_POOL_BASE 1024
+#define ORDER_NIL 0 // Slot 0 of the order pool is never used, so 0 is the null reference
+#define ORDER_AT(ref) (&order_pool.orders[(ref)])
+#define ORDER_INFO(ref) (&order_pool.info[(ref)])
+#define LEVEL_POOL_BASE 256
+#define LEVEL_NIL 0 // Slot 0 of the level pool is never used, so 0 is the null reference
+#define LEVEL_AT(ref) (&level_pool.levels[(ref)])
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4 // 64^4 ticks of 10 ms, about 46 hours
+#define TIMER_NONE -1
+#define GTT_MS_MAX 86400000 // Good till time orders expire within a day
+#define STOP_BOOK_BASE 16
+#define LOG_RING_SLOTS 1024 // A power of two
+#define LOG_ARGS_MAX 8
+#define LOG_TEXT_MAX 128
+#define LOG_BATCH_BYTES 65536
+#define LOG_RECORD_OUT_MAX 1024 // The longest formatted record, the batch is flushed before it could overflow
+#define LOG_IDLE_NS 1000000 // The writer sleeps 1 ms when the ring is empty
+#define LOG_FORMAT_LEN_MAX 512 // Longer format strings are written to a binary log as text
+
+enum FillReportMode {
+    FILL_PER_MATCH,
+    FILL_AGGREGATE,
+    FILL_AGGREGATE_VWAP
+}; // How the aggressor of a match is notified of its fills
+
+// The levels of the [PEX] output, a level prints its lines and those of the levels after it
+enum LogLevel {
+    LOG_FULL, // Everything the spec prints, the default
+    LOG_MATCHES, // Trades, auctions and triggered stops
+    LOG_ERRORS, // Disconnects and the end of trading
+    LOG_SILENT // Nothing, while the journal is replayed
+};
+
+// The lowest level compiled in, build with -DLOG_LEVEL_MIN=LOG_MATCHES or LOG_ERRORS
+// to compile the lines of the lower levels away, their args are never evaluated
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN LOG_FULL
+#endif
+
+#define LOG_ENABLED(level) ((level) >= LOG_LEVEL_MIN && (level) >= config.verbosity)
+#define PEX_LOG(level, ...) do { if(LOG_ENABLED(level)) { log_printf(__VA_ARGS__); } } while(0)
+
+enum JournalSync {
+    JOURNAL_SYNC_BATCH, // One fdatasync per group commit, the default
+    JOURNAL_SYNC_ALWAYS, // Commit and sync after every command
+    JOURNAL_SYNC_NONE // Write at each group commit, leave the sync to the OS
+}; // When the journal is synced to disk
+
+struct exchange_config {
+    enum FillReportMode fill_report;
+    const char *fee_file; // The fee schedule file, NULL for the default schedule
+    int cancel_on_disconnect; // Cancel the resting orders of a trader when it disconnects
+    int batch_auction; // Match in periodic auctions instead of on every order
+    int batch_interval_ms; // Uncross a batch this long after its first order, 0 for no limit
+    int batch_size; // Uncross a batch once it holds this many orders, 0 for no limit
+    int pre_open_ms; // The length of the opening call phase after MARKET OPEN, 0 to open at once
+    const char *binary_log; // Write the output as binary records to this file instead of stdout, NULL for text
+    int book_diffs; // Print only the levels and positions changed by each command
+    int compact_positions; // Print only the position cells changed by each command
+    int snapshot_every; // Print a full snapshot every this many book updates, 0 for none
+    int snapshot_interval_ms; // Print a full snapshot this often, 0 for none
+    const char *snapshot_file; // Write the snapshots to this file from a copy of the book, NULL to print them inline
+    enum LogLevel verbosity; // The lowest level printed, LOG_LEVEL_MIN still applies
+    const char *journal_file; // Append the accepted commands to this file, NULL for no journal
+    enum JournalSync journal_sync;
+    const char *replay_file; // Rebuild the book from this journal before trading, NULL for none
+    const char *checkpoint_file; // Write checkpoints of the exchange state to this file, NULL for none
+    int checkpoint_every; // Take a checkpoint after this many commands, 0 for on SIGHUP only
+    const char *recover_file; // Load this checkpoint before trading, NULL for none
+}; // The runtime options of the exchange
+
+extern struct exchange_config config;
+
+#define TRACK_CHANGES (config.book_diffs || config.compact_positions) // The dirty sets are kept
+#define PERIODIC_SNAPSHOTS (config.snapshot_every > 0 || config.snapshot_interval_ms > 0) // The book is printed on a cadence
+
+#define POSITION_QTY(list, trader_id, product_idx) ((list)->qty[(product_idx) * (list)->num_traders + (trader_id)])
+#define POSITION_PROFIT(list, trader_id, product_idx) ((list)->profit[(product_idx) * (list)->num_traders + (trader_id)])
+
+// The positions of all traders as one contiguous [product x trader] matrix per field.
+// A match updates two cells of the same product column, and per product
+// aggregations scan a contiguous column. Product names come from the product list.
+struct position_matrix {
+    int num_traders;
+    int num_products;
+    int *qty;
+    long int *profit;
+};
+
+#define FEE_TAKER_BPS(schedule, trader_id, product_idx) ((schedule)->taker_bps[(product_idx) * (schedule)->num_traders + (trader_id)])
+#define FEE_MAKER_BPS(schedule, trader_id, product_idx) ((schedule)->maker_bps[(product_idx) * (schedule)->num_traders + (trader_id)])
+
+// The fee rates of every trader in every product, in basis points, laid out
+// like the position matrix. The aggressor of a match pays the taker rate and
+// the resting order the maker rate, a negative rate is a rebate.
+struct fee_schedule {
+    int num_traders;
+    int num_products;
+    int *taker_bps;
+    int *maker_bps;
+};
 
 struct trader_list {
     int num_traders;
     struct trader *trader_arr;
+    struct position_matrix positions;
+    struct fee_schedule fees;
 }; // The list of traders
 
+// Pool of resting orders, linked by 32-bit slot indices instead of pointers.
+// Hot fields live in orders[], cold fields in the parallel info[] side table,
+// so a sweep only streams through records of half a cache line at most,
+// as the assert on struct book_order below checks.
+struct order_pool {
+    struct book_order *orders;
+    struct order_info *info;
+    uint32_t capacity;
+    uint32_t used; // The slots handed out so far, including the reserved slot 0
+    uint32_t free_head; // The released slots, linked through their next field
+};
+
+extern struct order_pool order_pool;
+
+// Pool of price levels. The orders of each side stay in one price-time
+// chain, and the levels index into it with their head and tail orders
+// and keep the aggregate quantity of the level.
+struct level_pool {
+    struct price_level *levels;
+    uint32_t capacity;
+    uint32_t used; // The slots handed out so far, including the reserved slot 0
+    uint32_t free_head; // The released slots, linked through their next field
+};
+
+extern struct level_pool level_pool;
+
+_Static_assert(sizeof(struct book_order) <= 32, "resting order record must fit in half a cache line");
+
+// Hierarchical timer wheel of the good till time orders. Level 0 has one
+// slot per tick, and each higher level one slot per full turn of the level
+// below. The orders of a slot are linked through the order info table, so
+// arming and disarming are O(1). A slot of a higher level is cascaded down
+// when the level below wraps, and a level 0 slot expires as a whole.
+struct timer_wheel {
+    uint32_t now; // The current tick
+    int num_timers;
+    uint32_t slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS]; // The first order of each slot
+};
+
+extern struct timer_wheel timer_wheel;
+
+struct stop_order {
+    int trigger; // The last trade price that activates the order
+    uint32_t seq; // The arrival sequence, breaks ties between triggered orders
+    struct order order; // The limit order entered on activation
+};
+
+// The pending stop orders of a product, each side a binary heap with the next
+// order to trigger at the root, so adding and triggering a stop are O(log n).
+// Buy stops trigger when the last trade price rises to their trigger and the
+// lowest trigger is on top. Sell stops trigger when it falls to their trigger
+// and the highest trigger is on top. Equal triggers put the oldest order first.
+struct stop_book {
+    struct stop_order *buy_stops;
+    int num_buy_stops;
+    int buy_capacity;
+    struct stop_order *sell_stops;
+    int num_sell_stops;
+    int sell_capacity;
+};
+
+extern struct stop_book *stop_books;
+
+// The orders of a bulk command, "BULK <ATOMIC|EACH> <order>,<order>,..."
+// Atomic bulks are rejected as a whole if any order is invalid, otherwise
+// each order is accepted or rejected on its own.
+struct bulk_order {
+    int is_atomic;
+    int num_legs;
+    struct order legs[BULK_LEGS_MAX];
+    int is_valid[BULK_LEGS_MAX];
+};
+
+extern struct bulk_order bulk_order;
+
+// One log line or part of one, kept unformatted until the writer thread formats it.
+// Format strings are literals, so only the pointer is kept. Integer args are kept as
+// long int, and string args are copied to text with their offset kept in args.
+struct log_record {
+    atomic_size_t seq; // The ring position the record can be written or read at
+    const char *fmt; // NULL for a chunk of preformatted text
+    int num_args; // The number of args, or the length of a text chunk
+    long int args[LOG_ARGS_MAX];
+    char text[LOG_TEXT_MAX];
+};
+
+// A bounded lock-free ring of log records, written by the event loop and signal
+// handlers and read by one writer thread. A producer claims a slot by advancing
+// enqueue_pos and publishes it through the slot seq, so a signal handler that
+// interrupts a producer claims the next slot instead of waiting for it.
+struct log_ring {
+    struct log_record *slots;
+    atomic_size_t enqueue_pos;
+    size_t dequeue_pos; // Only the writer thread reads records
+    atomic_int running;
+    int fd; // The fd the writer thread writes to
+    pid_t owner; // The process that started the writer, forked children never stop it
+    pthread_t writer;
+    int binary; // Write binary records instead of text
+    const char *formats[BINARY_LOG_FORMATS_MAX]; // The format strings written to a binary log so far, by id
+    int num_formats;
+};
+
+extern struct log_ring log_ring;
+
+#define BOOK_DIFF_LEVELS_BASE 16
+
+// A price level touched by the current command
+struct level_mark {
+    int product_idx;
+    enum OrderType side;
+    int price;
+    long int total_qty; // The state of the level when printed, 0 once removed
+    int num_orders;
+};
+
+// The levels and position cells changed since the last book update was printed.
+// The handlers mark what they touch, so printing an update costs the size of
+// the change instead of the whole book and every trader.
+struct book_diff {
+    struct level_mark *levels;
+    int num_levels;
+    int levels_capacity;
+    int *cells; // Dirty position cells as matrix indices
+    int num_cells;
+    unsigned char *cell_dirty; // One flag per position cell, so a cell is listed once
+};
+
+extern struct book_diff book_diff;
+extern volatile sig_atomic_t snapshot_requested;
+
+// A copy of the level aggregates and positions, in the order show_order_book prints them
+struct book_snapshot {
+    uint32_t seq; // The number of the snapshot
+    uint32_t tick; // The tick the copy was taken at
+    int num_products;
+    int num_traders;
+    int *buy_levels; // The level counts per product
+    int *sell_levels;
+    struct level_mark *levels; // Sells high to low, then buys high to low, per product
+    int num_levels;
+    int levels_capacity;
+    int *qty; // The position matrix
+    long int *profit;
+};
+
+// Writes the snapshots to the snapshot file on its own thread. The event loop
+// only copies the book into the snapshot while the writer is idle, and skips the
+// snapshot otherwise, so matching never waits for the file.
+struct snapshot_writer {
+    struct book_snapshot snapshot;
+    FILE *fp;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    atomic_int pending; // The snapshot holds a copy not written yet
+    int running;
+    int num_skipped; // Snapshots dropped while the writer was busy
+};
+
+extern struct snapshot_writer snapshot_writer;
+
+#define JOURNAL_MAGIC "PEXJOURNAL"
+#define JOURNAL_BATCH_MAX 64 // The commands in one group commit at most
+#define JOURNAL_BUF_LEN (JOURNAL_BATCH_MAX * (CMD_BUF_LEN + INT_LEN + 2))
+#define OUTBOX_LEN 16384 // The bytes held for one trader before the batch is committed early
+
+// The messages to a trader held until the commands that caused them are durable
+struct outbox {
+    char *buf;
+    size_t len;
+};
+
+// An append-only journal of everything that changes the book, after a
+// "PEXJOURNAL <num_traders> <num_products> <journal_id>" header, where the id is taken from
+// the clock when the file is created and checkpoints store it next to their offset. Each line starts with the timer wheel
+// tick it was applied at, then is "<trader_id> <command>" for an accepted command,
+// "<trader_id> DISCONNECT" for a cancel on disconnect, or one of the exchange events
+// "EXPIRE", "AUCTION <product_idx>" and "OPEN" that the clock drives. Records are buffered and
+// written with one write and one fdatasync per group commit. The messages to traders
+// wait in their outboxes until the commit, so no trader sees the result of a command
+// that is not in the journal yet.
+struct journal {
+    int fd;
+    char *buf; // The commands of the open batch
+    size_t len;
+    int num_pending; // The commands in the open batch
+    long int offset; // The bytes written to the journal file
+    long int id; // Written in the header of a new journal, so a checkpoint can tell its journal
+    long int num_commits;
+    struct outbox *outboxes; // One per trader
+    int num_traders;
+};
+
+extern struct journal journal;
+
+#define CHECKPOINT_MAGIC "PEXCKPT1"
+#define CHECKPOINT_TMP_SUFFIX ".tmp" // The checkpoint is written to its name with this suffix, then renamed
+#define CHECKPOINT_NO_EXPIRY -1
+
+// A checkpoint is the header, then the order ids taken by each trader, the position
+// matrix, and per product a struct checkpoint_product followed by its buy and sell
+// orders in price-time priority and its buy and sell stops. Integers are native
+// endian, a checkpoint is only read back by the same build.
+struct checkpoint_header {
+    char magic[8];
+    int32_t num_traders;
+    int32_t num_products;
+    int64_t journal_id; // The journal the offset is in
+    int64_t journal_offset; // The journal bytes the checkpoint covers, replay from here
+    int64_t exchange_fees;
+    uint32_t stop_seq;
+    uint32_t tick; // The timer wheel tick, the expiries and the journal ticks after it count from it
+    int32_t pre_open_pending;
+};
+
+struct checkpoint_product {
+    char name[PRODUCT_NAME_MAX];
+    int32_t last_price;
+    int32_t batch_orders;
+    int32_t batch_ticks; // The ticks left before the batch interval ends
+    int32_t num_buy_orders;
+    int32_t num_sell_orders;
+    int32_t num_buy_stops;
+    int32_t num_sell_stops;
+};
+
+struct checkpoint_order {
+    int32_t trader_id;
+    int32_t order_id;
+    int32_t price;
+    int32_t qty; // The shown quantity
+    int32_t reserve_qty;
+    int32_t display_qty;
+    int32_t expire_ticks; // The ticks left before a good till time order expires, CHECKPOINT_NO_EXPIRY otherwise
+};
+
+extern volatile sig_atomic_t checkpoint_pid;
+extern volatile sig_atomic_t checkpoint_exit;
+
 // Circular queue to store pids
 // Reference: https://edstem.org/au/courses/10466/discussion/1353883,
 // https://www.programiz.com/dsa/circular-queue
@@ -71,6 +425,117 @@ void exchange_handler(int sig, siginfo_t* info, void* ucontext);
  */
 void trader_disconnect_handler(int sig, siginfo_t* info, void* ucontext);
 
+/**
+ * Log the trader disconnects and the checkpoint exit the SIGCHLD handler recorded since the last call.
+ * The handler only records them, as it may interrupt a log producer.
+ */
+void report_child_exits(void);
+
+/**
+ * Handle the expiry clock signal, which only wakes up the event loop
+ * @param sig The received signal number
+ */
+void expiry_clock_handler(int sig);
+
+/**
+ * Run the expiry clock while the timer wheel has armed orders, a batch waits for its interval
+ * or the market waits for its opening auction, and stop it otherwise
+ */
+void update_expiry_clock(void);
+
+/**
+ * Start the writer thread, from then on log_printf only queues records for it.
+ * The thread blocks all signals, so they are still delivered to the event loop.
+ * @param ring The log ring
+ * @param fd The fd the writer thread writes to
+ * @param binary Write binary records for pe_logdecode if true 1, text otherwise
+ */
+void start_logger(struct log_ring *ring, int fd, int binary);
+
+/**
+ * Write the queued records and stop the writer thread, does nothing if it is not running
+ */
+void stop_logger(void);
+
+/**
+ * Print a log line with printf formatting. %d, %ld, %s and %% are queued unformatted,
+ * other lines are formatted by the caller and queued as text. Before the writer thread
+ * starts, the line is printed to stdout at once.
+ * @param fmt The format string, it must outlive the writer thread
+ */
+void log_printf(const char *fmt, ...);
+
+/**
+ * Queue preformatted text in chunks of LOG_TEXT_MAX bytes
+ * @param ring The log ring
+ * @param text The text
+ * @param len The length of the text
+ */
+void log_text(struct log_ring *ring, const char *text, size_t len);
+
+/**
+ * Claim the next free record of the ring, yielding while the ring is full
+ * @param ring The log ring
+ * @return struct log_record* The claimed record
+ */
+struct log_record *reserve_log_record(struct log_ring *ring);
+
+/**
+ * Hand a claimed record to the writer thread
+ * @param ring The log ring
+ * @param record The record
+ */
+void publish_log_record(struct log_ring *ring, struct log_record *record);
+
+/**
+ * Format a record into the output buffer
+ * @param record The record
+ * @param buf The buffer
+ * @param cap The free space of the buffer, at least LOG_RECORD_OUT_MAX
+ * @return size_t The formatted length
+ */
+size_t format_log_record(const struct log_record *record, char *buf, size_t cap);
+
+/**
+ * Encode a record for a binary log, the first record of a format string is preceded by its definition
+ * @param ring The log ring, which keeps the format ids
+ * @param record The record
+ * @param buf The buffer
+ * @param cap The free space of the buffer, at least LOG_RECORD_OUT_MAX
+ * @return size_t The encoded length
+ */
+size_t encode_log_record(struct log_ring *ring, const struct log_record *record, char *buf, size_t cap);
+
+/**
+ * The writer thread, formats or encodes the queued records and writes them in large batches
+ * @param arg The log ring
+ * @return void* NULL
+ */
+void *logger_main(void *arg);
+
+/**
+ * Write a whole buffer, retrying partial and interrupted writes
+ * @param fd The fd to write
+ * @param buf The buffer
+ * @param len The length of the buffer
+ */
+void write_all(int fd, const char *buf, size_t len);
+
+/**
+ * Parse the exchange options that precede the products file on the command line
+ * @param argc The number of command line arguments
+ * @param argv The command line arguments
+ * @param config The config to store the parsed options
+ * @return int The index of the first non-option argument, -1 if an option is invalid
+ */
+int parse_exchange_options(int argc, char **argv, struct exchange_config *config);
+
+/**
+ * Preformat the MARKET message prefix of each product and side, the names must be read
+ * @param products The product list to add the prefixes to
+ */
+void init_message_templates(struct product_list *products);
+
 /**
  * Read the products infomation form the given file
  * @param filename The product file to read
@@ -87,6 +552,79 @@ void read_product_file (const char *filename, struct product_list* products);
  */
 struct trader_list init_traders (int num_traders, char **trader_names, struct product_list *products);
 
+/**
+ * Refill the shown quantity of a filled iceberg order from its reserve, and move it to the back of its level
+ * @param product_orders The order list of the product
+ * @param side The side of the book the order rests on
+ * @param ref The reference of the filled iceberg order
+ */
+void replenish_iceberg(struct order_list *product_orders, enum OrderType side, uint32_t ref);
+
+/**
+ * Link a resting order into the order list of its trader
+ * @param trader The owner of the order
+ * @param ref The reference of the resting order
+ */
+void link_trader_order(struct trader *trader, uint32_t ref);
+
+/**
+ * Unlink a resting order from the order list of its trader
+ * @param trader The owner of the order
+ * @param ref The reference of the resting order
+ */
+void unlink_trader_order(struct trader *trader, uint32_t ref);
+
+/**
+ * Count the resting orders of a trader in a product and side
+ * @param trader_id The owner of the orders
+ * @param product_idx The index of the product, -1 for all products
+ * @param side The side of the orders, ANY_SIDE for both sides
+ * @return int The number of matching orders
+ */
+int count_trader_orders(int trader_id, int product_idx, enum OrderType side);
+
+/**
+ * Cancel the resting orders of a trader in a product and side, and notify the other traders in one batch
+ * @param fds_exchange The fds of exchange pipes
+ * @param trader_id The trader whose orders are cancelled
+ * @param product_idx The index of the product, -1 for all products
+ * @param side The side of the orders, ANY_SIDE for both sides
+ * @return int The number of cancelled orders
+ */
+int cancel_trader_orders(int *fds_exchange, int trader_id, int product_idx, enum OrderType side);
+
+/**
+ * Cancel the resting orders of the traders disconnected since the last call
+ * @param fds_exchange The fds of exchange pipes
+ */
+void purge_disconnected_traders(int *fds_exchange);
+
+/**
+ * Apply the rules of a fee schedule file on top of the default fees of the traders.
+ * Each line is "<product|*> <trader_id|*> <taker_bps> <maker_bps>", '#' starts a comment,
+ * and later rules override earlier ones.
+ * @param filename The fee schedule file to read
+ * @param traders The trader list holding the fee schedule
+ * @param products The products list in the exchange
+ */
+void read_fee_file(const char *filename, struct trader_list *traders, struct product_list *products);
+
+/**
+ * Compute the fee for a match value, rounding half away from zero
+ * @param match_value The value of the match
+ * @param bps The fee rate in basis points
+ * @return long int The fee, negative for a rebate
+ */
+long int compute_fee(long int match_value, int bps);
+
+/**
+ * Get the net position of all traders in a product
+ * @param traders The pointer to the trader list
+ * @param product_idx The index of the product
+ * @return long int The sum of the traders' quantities in the product
+ */
+long int product_net_exposure(struct trader_list *traders, int product_idx);
+
 /**
  * Free the memory allocated for the trader list
  * @param traders The trader list to free
@@ -101,6 +639,62 @@ void free_traders(struct trader_list *traders);
  */
 int get_traderid_by_pid(struct trader_list *traders, int pid);
 
+/**
+ * Initialize the pool that stores the resting orders
+ * @param pool The pointer to the pool to initialize
+ * @param capacity The initial number of order slots
+ */
+void init_order_pool(struct order_pool *pool, uint32_t capacity);
+
+/**
+ * Get a free order slot from the pool, growing it when it is full
+ * Growing moves the orders, so pointers from ORDER_AT must be fetched again after this call
+ * @param pool The pointer to the pool
+ * @return uint32_t The reference of the order slot
+ */
+uint32_t alloc_book_order(struct order_pool *pool);
+
+/**
+ * Return an order slot to the pool
+ * @param pool The pointer to the pool
+ * @param ref The reference of the order slot
+ */
+void release_book_order(struct order_pool *pool, uint32_t ref);
+
+/**
+ * Free the memory allocated for the order pool
+ * @param pool The pointer to the pool
+ */
+void free_order_pool(struct order_pool *pool);
+
+/**
+ * Initialize the pool that stores the price levels
+ * @param pool The pointer to the pool to initialize
+ * @param capacity The initial number of level slots
+ */
+void init_level_pool(struct level_pool *pool, uint32_t capacity);
+
+/**
+ * Get a free level slot from the pool, growing it when it is full
+ * Growing moves the levels, so pointers from LEVEL_AT must be fetched again after this call
+ * @param pool The pointer to the pool
+ * @return uint32_t The reference of the level slot
+ */
+uint32_t alloc_price_level(struct level_pool *pool);
+
+/**
+ * Return a level slot to the pool
+ * @param pool The pointer to the pool
+ * @param ref The reference of the level slot
+ */
+void release_price_level(struct level_pool *pool, uint32_t ref);
+
+/**
+ * Free the memory allocated for the level pool
+ * @param pool The pointer to the pool
+ */
+void free_level_pool(struct level_pool *pool);
+
 /**
  * Initialize the order book in the exchange, which includes the buy/sell order lists of each product
  * @param num_products The number of product types
@@ -109,10 +703,124 @@ int get_traderid_by_pid(struct trader_list *traders, int pid);
 struct order_list* init_order_book(int num_products);
 
 /**
- * Free the memory allocated for the order list
- * @param head The head node of the order list
+ * Release the orders of an order list back to the order pool
+ * @param head The reference of the head node of the order list
+ */
+void free_order_list(uint32_t head);
+
+/**
+ * Initialize an empty timer wheel at tick 0
+ * @param wheel The timer wheel to initialize
+ */
+void init_timer_wheel(struct timer_wheel *wheel);
+
+/**
+ * Get the current tick of the exchange clock, counted from the first call
+ * @return uint32_t The number of TIMER_TICK_MS ticks since the first call, after the tick the clock was resumed from
+ */
+uint32_t current_tick(void);
+
+/**
+ * Carry on the exchange clock from a recovered tick, so the ticks of this run follow the journaled ones
+ * @param tick The tick the recovered state was at
+ */
+void resume_clock(uint32_t tick);
+
+/**
+ * Link a resting order into the timer wheel slot of its expire tick, which must not be in the past
+ * @param wheel The timer wheel
+ * @param ref The reference of the resting order
+ */
+void place_order_timer(struct timer_wheel *wheel, uint32_t ref);
+
+/**
+ * Arm the expiry timer of a resting order
+ * @param wheel The timer wheel
+ * @param ref The reference of the resting order
+ * @param expire_tick The tick the order expires at, a past tick expires on the next tick
+ */
+void arm_order_timer(struct timer_wheel *wheel, uint32_t ref, uint32_t expire_tick);
+
+/**
+ * Disarm the expiry timer of a resting order, if it has one
+ * @param wheel The timer wheel
+ * @param ref The reference of the resting order
+ */
+void disarm_order_timer(struct timer_wheel *wheel, uint32_t ref);
+
+/**
+ * Advance the timer wheel to a tick, and collect the orders that expired on the way
+ * @param wheel The timer wheel
+ * @param target_tick The tick to advance to
+ * @return uint32_t The first expired order, the others are linked through timer_next
+ */
+uint32_t advance_timer_wheel(struct timer_wheel *wheel, uint32_t target_tick);
+
+/**
+ * Cancel the orders expired by a tick, and notify each trader once for all of them
+ * @param fds_exchange The fds of exchange pipes
+ * @param target_tick The tick to advance the timer wheel to
+ * @return int The number of expired orders
+ */
+int expire_orders(int *fds_exchange, uint32_t target_tick);
+
+/**
+ * Count an order that joined the auction batch of a product, starting the batch interval on the first one
+ * @param product_idx The index of the product
+ */
+void add_to_batch(int product_idx);
+
+/**
+ * Check whether an order waits in the book for the next auction instead of matching
+ * @param received_order The order
+ * @return int True 1 for a day or good till time order in batch auction mode or the opening call phase, false 0 otherwise
+ */
+int joins_batch(struct order *received_order);
+
+/**
+ * Find the single price a crossed book is uncrossed at, in one pass over the crossing levels
+ * from the cumulative level aggregates.
+ * It maximizes the matched quantity, then minimizes the unmatched quantity at that price,
+ * then is nearest to the last trade price, then lowest.
+ * @param product_idx The index of the product
+ * @param clearing_qty The quantity matched at the clearing price, 0 if the book is not crossed
+ * @return int The clearing price, 0 if the book is not crossed
+ */
+int auction_clearing_price(int product_idx, int *clearing_qty);
+
+/**
+ * Match a buy and a sell order in an auction at the clearing price, both sides pay their maker fee
+ * @param buy_order The resting buy order
+ * @param sell_order The resting sell order
+ * @param match_qty The quantity to match
+ * @param price The clearing price
+ * @param product_idx The index of the product
+ * @param fds_exchange The exchange fds to write
+ */
+void execute_auction_match(struct book_order *buy_order, struct book_order *sell_order, int match_qty, int price, int product_idx, int *fds_exchange);
+
+/**
+ * Uncross the book of a product at its clearing price and close its batch, the caller prints the book
+ * @param product_idx The index of the product
+ * @param fds_exchange The exchange fds to write
+ * @return int The matched quantity
+ */
+int run_auction(int product_idx, int *fds_exchange);
+
+/**
+ * Run the auctions of the batches that are full or whose interval has passed
+ * @param fds_exchange The exchange fds to write
+ * @param now The current tick
+ * @return int The number of auctions run
  */
-void free_order_list(struct order *head);
+int run_batch_auctions(int *fds_exchange, uint32_t now);
+
+/**
+ * End the opening call phase, uncross every product and start continuous trading
+ * @param fds_exchange The exchange fds to write
+ * @return int The quantity matched in the opening auction
+ */
+int open_market(int *fds_exchange);
 
 /**
  * Free the memory allocated for the order book including buy/sell order lists
@@ -158,7 +866,7 @@ void market_open_msg(int* fds_exchange, struct trader_list* traders);
 int get_productid_by_name(char* product_name, struct product_list* products);
 
 /**
- * Parse the command received from trader
+ * Parse the command received from trader, and journal it if it is accepted
  * @param fds_trader The trader fds to read from
  * @param trader_id The id of the trader that sends the message
  * @param received_order The order of the message after parsing the command
@@ -166,6 +874,63 @@ int get_productid_by_name(char* product_name, struct product_list* products);
  */
 enum OrderResponseType parse_command(int *fds_trader, int trader_id, struct order *received_order);
 
+/**
+ * Check a command without its ';' and fill the order it describes
+ * @param command The command text
+ * @param trader_id The id of the trader that sent the command
+ * @param received_order The order of the message after parsing the command
+ * @return enum OrderResponseType The type of the exchange response
+ */
+enum OrderResponseType classify_command(char *command, int trader_id, struct order *received_order);
+
+/**
+ * Open the journal for appending, writing the header with a new id to a new file, or reading the id of an existing one
+ * @param journal The journal to open
+ * @param filename The journal file
+ * @param num_traders The number of traders, one outbox each
+ * @param num_products The number of products, for the header
+ */
+void open_journal(struct journal *journal, const char *filename, int num_traders, int num_products);
+
+/**
+ * Commit the open batch and close the journal
+ * @param journal The journal to close
+ * @param fds_exchange The exchange fds to release the held messages to
+ */
+void close_journal(struct journal *journal, int *fds_exchange);
+
+/**
+ * Add a record stamped with the timer wheel tick to the open batch, committing first if the batch is full
+ * @param journal The journal to append to
+ * @param trader_id The id of the trader the record is about, -1 for an exchange event
+ * @param record The command, DISCONNECT, or the exchange event
+ * @param fds_exchange The exchange fds for an early commit, NULL if there is nothing to release
+ */
+void journal_append(struct journal *journal, int trader_id, const char *record, int *fds_exchange);
+
+/**
+ * Journal an exchange event driven by the clock, if a journal is open and it is not being replayed
+ * @param record The event, EXPIRE, AUCTION <product_idx> or OPEN
+ * @param fds_exchange The exchange fds for an early commit
+ */
+void journal_event(const char *record, int *fds_exchange);
+
+/**
+ * Write the open batch with one write, sync it as configured, then send the held messages
+ * @param journal The journal to commit
+ * @param fds_exchange The exchange fds to release the held messages to
+ */
+void commit_journal(struct journal *journal, int *fds_exchange);
+
+/**
+ * Send a message to a trader and signal it, or hold it in its outbox while a journal is open
+ * @param fds_exchange The exchange fds
+ * @param trader_id The id of the trader
+ * @param msg The message
+ * @param len The length of the message
+ */
+void send_to_trader(int *fds_exchange, int trader_id, const char *msg, size_t len);
+
 /**
  * Check whether the buy command is invalid
  * @param command The received command string
@@ -202,6 +967,26 @@ int is_valid_amend(char *command, int trader_id, struct order *received_order);
  */
 int is_valid_cancel(char *command, int trader_id, struct order *received_order);
 
+/**
+ * Check whether the bulk command is invalid, and store its orders in the bulk order.
+ * The orders take consecutive order ids from the trader's next order id.
+ * @param command The received command string
+ * @param trader_id The id of the trader that sends the message
+ * @param received_order The order of the message after parsing the command, qty is the number of accepted orders
+ * @param bulk The bulk order to store the parsed orders
+ * @return int True 1 if at least one order is accepted, false 0 otherwise
+ */
+int is_valid_bulk(char *command, int trader_id, struct order *received_order, struct bulk_order *bulk);
+
+/**
+ * Check whether the mass cancel command is invalid, "MASSCANCEL <product|*> <BUY|SELL|*>"
+ * @param command The received command string
+ * @param trader_id The id of the trader that sends the message
+ * @param received_order The order of the message after parsing the command, qty is the number of orders to cancel
+ * @return int True 1 if it is a valid mass cancel command, false 0 otherwise
+ */
+int is_valid_mass_cancel(char *command, int trader_id, struct order *received_order);
+
 /**
  * Send response to current order message sender
  * @param response The response type for the order message
@@ -210,6 +995,13 @@ int is_valid_cancel(char *command, int trader_id, struct order *received_order);
  */
 void send_order_response(enum OrderResponseType response, int *fds_exchange, struct order *received_order);
 
+/**
+ * Take the order ids of an accepted order or bulk order for its trader
+ * @param response The response type for the order message
+ * @param received_order The order in the message received after parsing the command
+ */
+void take_order_ids(enum OrderResponseType response, struct order *received_order);
+
 /**
  * Notify other traders in the exchange with the latest order message
  * @param response The response type for the order message
@@ -226,6 +1018,78 @@ void notify_traders(enum OrderResponseType response, int *fds_exchange, struct o
  */
 void process_order(enum OrderResponseType response, int *fds_exchange, struct order *received_order);
 
+/**
+ * Apply a command to the book through its handler, without printing the book
+ * @param response The response type for the order message
+ * @param fds_exchange The exchange fds to write
+ * @param received_order The order in the message received after parsing the command
+ */
+void apply_command(enum OrderResponseType response, int *fds_exchange, struct order *received_order);
+
+/**
+ * Rebuild the book, positions, fees and order ids from a journal, without messages or logging. The
+ * timer wheel is advanced to the tick of each record, and the journaled expiries and auctions are run
+ * where the live run ran them
+ * @param filename The journal file
+ * @param offset The byte offset to start from, as recorded by a checkpoint, 0 for the whole journal
+ * @param journal_id The journal id recorded by the checkpoint, which the journal must have when the offset is not 0
+ * @return long int The number of records replayed
+ */
+long int replay_journal(const char *filename, long int offset, long int journal_id);
+
+/**
+ * Get the size of the checkpoint of the current state, to allocate its buffer before the fork
+ * @return size_t The number of bytes serialize_checkpoint writes
+ */
+size_t checkpoint_size(void);
+
+/**
+ * Serialize the order book, order ids, positions, stops and fees into a buffer, with no allocation
+ * @param buf The buffer, at least checkpoint_size() bytes
+ * @param journal_offset The journal bytes the state covers
+ * @return size_t The number of bytes written
+ */
+size_t serialize_checkpoint(char *buf, long int journal_offset);
+
+/**
+ * Write a serialized checkpoint with raw open, write and fsync, which are safe in a forked child.
+ * It is written to a temporary file and renamed over the old checkpoint once synced.
+ * @param filename The checkpoint file
+ * @param tmp_filename The temporary file, named before the fork
+ * @param buf The serialized checkpoint
+ * @param len The length of the serialized checkpoint
+ * @return int 0 on success, -1 with errno set on a write error
+ */
+int write_checkpoint(const char *filename, const char *tmp_filename, const char *buf, size_t len);
+
+/**
+ * Fork a child that writes a checkpoint from its copy-on-write view of the state, while
+ * the parent keeps matching. The open journal batch is committed first, and the buffer is
+ * allocated before the fork, since the child of a threaded process must not call malloc or stdio.
+ * @param fds_exchange The exchange fds to release the held messages to
+ * @return int 1 if the child was started, 0 if the last checkpoint is still being written
+ */
+int start_checkpoint(int *fds_exchange);
+
+/**
+ * Wait for the checkpoint being written, if any, and record its exit for report_child_exits
+ */
+void finish_checkpoint(void);
+
+/**
+ * Load a checkpoint into an empty exchange with the same products and traders
+ * @param filename The checkpoint file
+ * @param journal_id Set to the id of the journal the checkpoint covers
+ * @return long int The journal offset to replay the journal from
+ */
+long int load_checkpoint(const char *filename, long int *journal_id);
+
+/**
+ * Signal handler for SIGHUP, asks for a checkpoint
+ * @param sig The signal number
+ */
+void checkpoint_request_handler(int sig);
+
 /**
  * Process the buy order command in the exchange
  * @param received_order The order in the message received after parsing the command
@@ -240,6 +1104,142 @@ void handle_buy(struct order* received_order, int *fds_exchange);
  */
 void handle_sell(struct order* received_order, int *fds_exchange);
 
+/**
+ * Parse the optional suffix of a buy or sell command, " IOC", " FOK", " ICEBERG <clip>", " GTT <ms>" or " STOP <trigger>"
+ * @param suffix The rest of the command after the price, empty for a day order
+ * @param received_order The parsed order, its time in force, clip, expiry and stop price are set
+ * @return int True 1 if the suffix is valid, false 0 otherwise
+ */
+int parse_order_suffix(const char *suffix, struct order *received_order);
+
+/**
+ * Enter a new buy or sell order, a stop order waits in the stop book until it triggers
+ * @param received_order The order in the message received after parsing the command
+ * @param fds_exchange The exchange fds to write
+ */
+void handle_new_order(struct order *received_order, int *fds_exchange);
+
+/**
+ * Add a pending stop order to the stop book of its product
+ * @param received_order The stop order
+ * @param product_idx The index of the product of the order
+ */
+void add_stop_order(struct order *received_order, int product_idx);
+
+/**
+ * Enter the stop orders triggered by the last trade price of a product, one at a time.
+ * Each activated order may trade and move the price, which is checked again before the next.
+ * Of a buy and a sell stop triggered at once, the older one goes first.
+ * @param product_idx The index of the product
+ * @param fds_exchange The exchange fds to write
+ * @return int The number of triggered stop orders
+ */
+int trigger_stop_orders(int product_idx, int *fds_exchange);
+
+/**
+ * Check whether a pending stop order triggers before another one
+ * @param stop The stop order
+ * @param other The other stop order, on the same side
+ * @param is_buy True 1 for buy stops
+ * @return int True 1 if the stop comes first, false 0 otherwise
+ */
+int stop_triggers_first(struct stop_order *stop, struct stop_order *other, int is_buy);
+
+/**
+ * Move a stop order towards the root of its heap until its parent comes first
+ * @param stops The heap of stop orders
+ * @param idx The index of the stop order
+ * @param is_buy True 1 for buy stops
+ */
+void sift_stop_up(struct stop_order *stops, int idx, int is_buy);
+
+/**
+ * Move a stop order towards the leaves of its heap until it comes before its children
+ * @param stops The heap of stop orders
+ * @param num_stops The number of stop orders in the heap
+ * @param idx The index of the stop order
+ * @param is_buy True 1 for buy stops
+ */
+void sift_stop_down(struct stop_order *stops, int num_stops, int idx, int is_buy);
+
+/**
+ * Remove the pending stop orders of a trader in a product and side
+ * @param trader_id The owner of the stop orders
+ * @param product_idx The index of the product, -1 for all products
+ * @param side The side of the orders, ANY_SIDE for both sides
+ * @param order_id The order id to remove, -1 for all orders
+ * @return int The number of removed stop orders
+ */
+int remove_trader_stops(int trader_id, int product_idx, enum OrderType side, int order_id);
+
+/**
+ * Count the pending stop orders of a trader in a product and side
+ * @param trader_id The owner of the stop orders
+ * @param product_idx The index of the product, -1 for all products
+ * @param side The side of the orders, ANY_SIDE for both sides
+ * @return int The number of matching stop orders
+ */
+int count_trader_stops(int trader_id, int product_idx, enum OrderType side);
+
+/**
+ * Size the sweep of a market order from the level aggregates of the opposite side
+ * @param received_order The market order
+ * @param product_idx The index of the product of the order
+ * @return int The price of the level where the shown quantity covers the order, or of the last level, 0 for an empty side
+ */
+int market_sweep_price(struct order *received_order, int product_idx);
+
+/**
+ * Check whether the opposite side of the book can fill an order completely, from the level aggregates
+ * @param received_order The order to fill
+ * @param product_idx The index of the product of the order
+ * @return int True 1 if the crossing levels hold at least the order quantity, false 0 otherwise
+ */
+int can_fill_order(struct order *received_order, int product_idx);
+
+/**
+ * Cancel the unfilled remainder of an order that must not rest, and tell its owner
+ * @param received_order The order with the remaining quantity
+ * @param fds_exchange The exchange fds to write
+ */
+void discard_remainder(struct order *received_order, int *fds_exchange);
+
+/**
+ * Match an order against the opposite side of the book, best level first
+ * A level smaller than the remaining quantity is consumed whole in a tight loop
+ * @param received_order The order in the message received after parsing the command
+ * @param product_idx The index of the product of the order
+ * @param fds_exchange The exchange fds to write
+ */
+void match_order(struct order *received_order, int product_idx, int *fds_exchange);
+
+/**
+ * Fill a resting order against the received order, and update the positions and fees
+ * @param received_order The aggressor order
+ * @param resting_order The resting order that is filled
+ * @param match_qty The quantity of the match
+ * @param product_idx The index of the product of the orders
+ * @param fds_exchange The exchange fds to write
+ * @return long int The value of the match
+ */
+long int execute_match(struct order *received_order, struct book_order *resting_order, int match_qty, int product_idx, int *fds_exchange);
+
+/**
+ * Add the remaining quantity of an order to the back of its price level
+ * @param received_order The order to rest in the book
+ * @param product_idx The index of the product of the order
+ * @return uint32_t The reference of the resting order
+ */
+uint32_t rest_order(struct order *received_order, int product_idx);
+
+/**
+ * Unlink a resting order from the book and its price level, and release it
+ * @param product_orders The order list of the product of the order
+ * @param side The side of the book the order rests on
+ * @param ref The reference of the resting order
+ */
+void remove_book_order(struct order_list *product_orders, enum OrderType side, uint32_t ref);
+
 /**
  * Process the amend order command in the exchange
  * @param received_order The order in the message received after parsing the command
@@ -254,6 +1254,20 @@ void handle_amend(struct order* received_order, int *fds_exchange);
  */
 void handle_cancel(struct order* received_order, int *fds_exchange);
 
+/**
+ * Match and rest the accepted orders of a bulk command in sequence
+ * @param bulk The bulk order to process
+ * @param fds_exchange The exchange fds to write
+ */
+void handle_bulk(struct bulk_order *bulk, int *fds_exchange);
+
+/**
+ * Process the mass cancel command in the exchange, the other traders are notified in one batch
+ * @param received_order The order in the message received after parsing the command
+ * @param fds_exchange The exchange fds to write
+ */
+void handle_mass_cancel(struct order* received_order, int *fds_exchange);
+
 /**
  * Send the notifing message to the trader when the order has been filled
  * @param fds_exchange The exchange fds to write
@@ -263,6 +1277,44 @@ void handle_cancel(struct order* received_order, int *fds_exchange);
  */
 void notify_filler(int *fds_exchange, int trader_id, int order_id, int fill_qty);
 
+/**
+ * Send one aggregated fill message to the aggressor after its order has swept the book
+ * @param fds_exchange The exchange fds to write
+ * @param trader_id The id of the trader
+ * @param order_id The id of the order that has been filled
+ * @param fill_qty The total quantity filled by the order in this command
+ * @param fill_value The total value of the fills, used for the volume weighted average price
+ */
+void notify_fill_summary(int *fds_exchange, int trader_id, int order_id, int fill_qty, long int fill_value);
+
+/**
+ * Send a batch of concatenated messages to every alive trader except one, with one write and one signal each
+ * @param fds_exchange The fds of exchange pipes
+ * @param except_id The trader to skip, -1 to send to all traders
+ * @param batch The concatenated messages
+ * @param batch_len The length of the batch
+ */
+void notify_traders_batch(int *fds_exchange, int except_id, const char *batch, size_t batch_len);
+
+/**
+ * Write the decimal digits of an integer, two digits per step from a table, without a terminator
+ * @param buf The buffer to write to, it must hold 20 chars
+ * @param value The integer to write
+ * @return The number of chars written
+ */
+int format_int(char *buf, long int value);
+
+/**
+ * Write a message of a prefix followed by integers separated by spaces and a ';', without a terminator
+ * @param buf The buffer to write to, it must hold prefix_len + 21 chars per value
+ * @param prefix The message prefix, including its trailing space
+ * @param prefix_len The length of the prefix
+ * @param num_values The number of integers
+ * @param values The integers to write
+ * @return The length of the message
+ */
+int format_message(char *buf, const char *prefix, int prefix_len, int num_values, const long int *values);
+
 /**
  * Print the order book information in the exchange
  * @param order_book The order book including the product order lists
@@ -275,6 +1327,128 @@ void show_order_book(struct order_list *order_book);
  */
 void show_positions(struct trader_list *traders);
 
+/**
+ * Initialize the dirty sets of the incremental book updates
+ * @param diff The book diff to initialize
+ * @param num_traders The number of traders
+ * @param num_products The number of products
+ */
+void init_book_diff(struct book_diff *diff, int num_traders, int num_products);
+
+/**
+ * Free the memory allocated for the dirty sets
+ * @param diff The book diff to free
+ */
+void free_book_diff(struct book_diff *diff);
+
+/**
+ * Record a price level touched by the current command, nothing unless book diffs are on
+ * @param product_idx The index of the product
+ * @param side The side of the level
+ * @param price The price of the level
+ */
+void mark_level_dirty(int product_idx, enum OrderType side, int price);
+
+/**
+ * Record a position cell changed by the current command, nothing unless changes are tracked
+ * @param trader_id The id of the trader
+ * @param product_idx The index of the product
+ */
+void mark_position_dirty(int trader_id, int product_idx);
+
+/**
+ * Empty the dirty sets after an update or a snapshot was printed
+ * @param diff The book diff to clear
+ */
+void clear_book_diff(struct book_diff *diff);
+
+/**
+ * qsort comparator of level marks, by product, sells before buys as in the full book, then price high to low
+ * @param a The first level mark
+ * @param b The second level mark
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+int compare_level_marks(const void *a, const void *b);
+
+/**
+ * qsort comparator of position cells, by trader then product
+ * @param a The first cell index
+ * @param b The second cell index
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+int compare_position_cells(const void *a, const void *b);
+
+/**
+ * Print the changed position cells only, grouped by trader. Untouched traders are skipped.
+ * @param diff The book diff holding the dirty cells
+ */
+void show_position_diff(struct book_diff *diff);
+
+/**
+ * Print the changed levels and positions only, then clear the dirty sets.
+ * Removed levels are printed with no quantity and no orders.
+ * @param diff The book diff to print
+ */
+void show_book_diff(struct book_diff *diff);
+
+/**
+ * Print the book and the positions after a command, in full or as the changes
+ * since the last update depending on the options, and take the snapshots that are due
+ */
+void show_book_update(void);
+
+/**
+ * Copy the level aggregates and positions of the book into a snapshot
+ * @param snapshot The snapshot to fill, its arrays are grown as needed
+ */
+void copy_book_snapshot(struct book_snapshot *snapshot);
+
+/**
+ * Print a snapshot in the format of show_order_book and show_positions, after a header line
+ * @param fp The file to print to
+ * @param snapshot The snapshot to print
+ */
+void write_book_snapshot(FILE *fp, const struct book_snapshot *snapshot);
+
+/**
+ * Free the arrays of a snapshot
+ * @param snapshot The snapshot to free
+ */
+void free_book_snapshot(struct book_snapshot *snapshot);
+
+/**
+ * Open the snapshot file and start the thread writing to it
+ * @param writer The snapshot writer to start
+ * @param filename The snapshot file, truncated
+ */
+void start_snapshot_writer(struct snapshot_writer *writer, const char *filename);
+
+/**
+ * Write the pending snapshot, stop the writer thread and close the file, and report the snapshots skipped
+ * @param writer The snapshot writer to stop
+ */
+void stop_snapshot_writer(struct snapshot_writer *writer);
+
+/**
+ * The snapshot writer thread, writes each copy handed over by the event loop
+ * @param arg The snapshot writer
+ * @return NULL
+ */
+void *snapshot_writer_main(void *arg);
+
+/**
+ * Take a full snapshot of the book now. With a snapshot file the book is copied and
+ * handed to the writer thread, otherwise it is printed inline.
+ * @return 1 if the snapshot was printed inline, 0 otherwise
+ */
+int emit_book_snapshot(void);
+
+/**
+ * Signal handler for SIGUSR2, asks for a full snapshot of the book
+ * @param sig The signal number
+ */
+void snapshot_request_handler(int sig);
+
 /**
  * Print the end information of the exchange, trading completed with the collected fees
  * @param collected_fees The exchange fees collected
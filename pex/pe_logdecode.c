@@ -0,0 +1,117 @@
+#include "pe_logdecode.h"
+
+int read_log_field(FILE *in, void *buf, size_t len) {
+    return fread(buf, 1, len, in) == len;
+}
+
+int decode_log_line(FILE *in, FILE *out, const char *fmt) {
+    for(const char *c = fmt; *c; c++) {
+        if(*c != '%') {
+            fputc(*c, out);
+            continue;
+        }
+        c++;
+        if(*c == '%') {
+            fputc('%', out);
+        } else if(*c == 's') {
+            // A length prefixed string
+            uint16_t len;
+            char str[UINT16_MAX + 1];
+            if(!read_log_field(in, &len, sizeof(len)) || !read_log_field(in, str, len)) {
+                return 0;
+            }
+            fwrite(str, 1, len, out);
+        } else {
+            // The integer of a %d or %ld
+            int64_t value;
+            if(!read_log_field(in, &value, sizeof(value))) {
+                return 0;
+            }
+            if(*c == 'l') {
+                fprintf(out, "%ld", (long int)value);
+                c++;
+            } else {
+                fprintf(out, "%d", (int)value);
+            }
+        }
+    }
+    return 1;
+}
+
+int decode_binary_log(FILE *in, FILE *out) {
+    char magic[BINARY_LOG_MAGIC_LEN];
+    if(!read_log_field(in, magic, BINARY_LOG_MAGIC_LEN) || memcmp(magic, BINARY_LOG_MAGIC, BINARY_LOG_MAGIC_LEN) != 0) {
+        return -1;
+    }
+
+    // The format strings defined so far, by id
+    char *formats[BINARY_LOG_FORMATS_MAX] = {NULL};
+    int ret = 0;
+    int type;
+    while((type = fgetc(in)) != EOF) {
+        uint16_t id;
+        uint16_t len;
+        if(type == LOG_RECORD_FORMAT) {
+            if(!read_log_field(in, &id, sizeof(id)) || !read_log_field(in, &len, sizeof(len)) || id >= BINARY_LOG_FORMATS_MAX) {
+                ret = -1;
+                break;
+            }
+            free(formats[id]);
+            formats[id] = (char*)calloc(len + 1, 1);
+            if(!read_log_field(in, formats[id], len)) {
+                ret = -1;
+                break;
+            }
+        } else if(type == LOG_RECORD_LINE) {
+            if(!read_log_field(in, &id, sizeof(id)) || id >= BINARY_LOG_FORMATS_MAX || formats[id] == NULL ||
+                !decode_log_line(in, out, formats[id])) {
+                ret = -1;
+                break;
+            }
+        } else if(type == LOG_RECORD_TEXT) {
+            char text[UINT16_MAX];
+            if(!read_log_field(in, &len, sizeof(len)) || !read_log_field(in, text, len)) {
+                ret = -1;
+                break;
+            }
+            fwrite(text, 1, len, out);
+        } else {
+            ret = -1;
+            break;
+        }
+    }
+
+    for(int i=0; i<BINARY_LOG_FORMATS_MAX; i++) {
+        free(formats[i]);
+    }
+    return ret;
+}
+
+#ifndef TESTING
+int main(int argc, char **argv) {
+    if(argc > 2) {
+        printf("Usage: %s [binary_log]\n", argv[0]);
+        return 1;
+    }
+
+    // Read the log file, or stdin
+    FILE *in = stdin;
+    if(argc == 2) {
+        in = fopen(argv[1], "rb");
+        if(in == NULL) {
+            perror("Error opening binary log");
+            exit(1);
+        }
+    }
+
+    int ret = decode_binary_log(in, stdout);
+    if(in != stdin) {
+        fclose(in);
+    }
+    if(ret == -1) {
+        fprintf(stderr, "Error decoding binary log\n");
+        return 1;
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,33 @@
+#ifndef PE_LOGDECODE_H
+#define PE_LOGDECODE_H
+
+#include "pe_common.h"
+
+/**
+ * Read a field of a binary log
+ * @param in The binary log
+ * @param buf The field to fill
+ * @param len The length of the field
+ * @return int True 1 if the whole field was read, false 0 at the end of the log
+ */
+int read_log_field(FILE *in, void *buf, size_t len);
+
+/**
+ * Write the text of a line record, reading its args from the log
+ * @param in The binary log, positioned after the format id
+ * @param out The text output
+ * @param fmt The format of the line
+ * @return int True 1 if all args were read, false 0 if the log is truncated
+ */
+int decode_log_line(FILE *in, FILE *out, const char *fmt);
+
+/**
+ * Reproduce the text output of the exchange from its binary log
+ * @param in The binary log
+ * @param out The text output
+ * @return int 0 on success, -1 if the log is not a binary log or is corrupt
+ */
+int decode_binary_log(FILE *in, FILE *out);
+
+
+#endif
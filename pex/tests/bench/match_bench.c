@@ -0,0 +1,230 @@
+// Microbenchmarks of the matching engine hot paths
+#include <time.h>
+#include <stddef.h>
+#include "../../pe_exchange.h"
+
+#define BENCH_ORDERS 1000000
+#define BENCH_LEVEL_ORDERS 100
+#define BENCH_TRADERS 64
+#define BENCH_DEEP_SWEEPS 100
+#define BENCH_DEEP_LEVELS 10
+#define BENCH_CACHE_BYTES (64 << 20)
+#define BENCH_STOPS 200000
+
+extern struct product_list products;
+extern struct trader_list traders;
+extern struct order_list *order_book;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *trader_names[BENCH_TRADERS];
+
+static void setup_exchange(int num_traders) {
+    products.num_products = 1;
+    products.names = (char(*)[PRODUCT_NAME_MAX])malloc(sizeof(char[PRODUCT_NAME_MAX]));
+    strcpy(products.names[0], "GPU");
+    init_message_templates(&products);
+    for(int i=0; i<num_traders; i++) {
+        trader_names[i] = "trader";
+    }
+    traders = init_traders(num_traders, trader_names, &products);
+    order_book = init_order_book(products.num_products);
+}
+
+// Write over a buffer larger than the last level cache so the next sweep starts cold
+static void evict_caches() {
+    static volatile char *buf = NULL;
+    if(buf == NULL) {
+        buf = (volatile char*)malloc(BENCH_CACHE_BYTES);
+    }
+    for(int i=0; i<BENCH_CACHE_BYTES; i += 64) {
+        buf[i] = (char)i;
+    }
+}
+
+static void teardown_exchange() {
+    free_order_book(order_book, products.num_products);
+    free_traders(&traders);
+    free_product_list(&products);
+}
+
+// Churn the order pool so consecutive orders land in scattered slots, as after a day of trading
+static void scatter_pool(int num_orders) {
+    uint32_t *refs = (uint32_t*)malloc(num_orders * sizeof(uint32_t));
+    for(int i=0; i<num_orders; i++) {
+        refs[i] = alloc_book_order(&order_pool);
+    }
+    srand(2017);
+    for(int i=num_orders-1; i>0; i--) {
+        int j = rand() % (i + 1);
+        uint32_t temp = refs[i];
+        refs[i] = refs[j];
+        refs[j] = temp;
+    }
+    for(int i=0; i<num_orders; i++) {
+        release_book_order(&order_pool, refs[i]);
+    }
+    free(refs);
+}
+
+// Rest num_orders sells, BENCH_LEVEL_ORDERS per level, inserting the best level last
+// The sellers rotate over all traders but the last one, which is left as the aggressor
+static void rest_sells(int num_orders) {
+    struct order sell = {0};
+    strcpy(sell.product, "GPU");
+    sell.order_type = SELL;
+    int num_levels = num_orders / BENCH_LEVEL_ORDERS;
+    for(int i=0; i<num_orders; i++) {
+        sell.order_id = i;
+        sell.trader_id = i % (traders.num_traders - 1);
+        sell.price = MIN_VALUE + num_levels - i / BENCH_LEVEL_ORDERS;
+        sell.qty = 1;
+        handle_sell(&sell, NULL);
+    }
+}
+
+static void bench_sweep() {
+    setup_exchange(2);
+    rest_sells(BENCH_ORDERS);
+
+    // Scan the whole book for an order at the far end, as a cancel does
+    struct order cancel;
+    traders.trader_arr[0].num_orders = BENCH_ORDERS;
+    char command[BUF_LEN];
+    snprintf(command, BUF_LEN, "CANCEL %d", BENCH_LEVEL_ORDERS - 1);
+    double start = now_sec();
+    int found = is_valid_cancel(command, 0, &cancel);
+    double scan = now_sec() - start;
+
+    // Walk the whole book once to print it
+    start = now_sec();
+    show_order_book(order_book);
+    double show = now_sec() - start;
+
+    // One buy that sweeps every resting order
+    struct order buy = {0};
+    strcpy(buy.product, "GPU");
+    buy.order_type = BUY;
+    buy.trader_id = 1;
+    buy.price = MAX_VALUE;
+    buy.qty = BENCH_ORDERS;
+    start = now_sec();
+    handle_buy(&buy, NULL);
+    double sweep = now_sec() - start;
+
+    fprintf(stderr, "sweep %d orders (found %d, left %d)\n", BENCH_ORDERS, found, order_book[0].sell_list_size);
+    fprintf(stderr, "  cancel scan: %8.2f ms %6.2f ns/order\n", scan * 1e3, scan * 1e9 / BENCH_ORDERS);
+    fprintf(stderr, "  book print:  %8.2f ms %6.2f ns/order\n", show * 1e3, show * 1e9 / BENCH_ORDERS);
+    fprintf(stderr, "  full sweep:  %8.2f ms %6.2f ns/order\n", sweep * 1e3, sweep * 1e9 / BENCH_ORDERS);
+    teardown_exchange();
+}
+
+static void bench_deep_sweep() {
+    setup_exchange(BENCH_TRADERS);
+    scatter_pool(BENCH_ORDERS);
+    rest_sells(BENCH_ORDERS);
+
+    // Each sweep takes the best BENCH_DEEP_LEVELS levels, starting from cold caches
+    struct order buy = {0};
+    strcpy(buy.product, "GPU");
+    buy.order_type = BUY;
+    buy.trader_id = BENCH_TRADERS - 1;
+    double total = 0;
+    for(int i=0; i<BENCH_DEEP_SWEEPS; i++) {
+        buy.order_id = i;
+        buy.price = ORDER_AT(order_book[0].sell_head)->price + BENCH_DEEP_LEVELS - 1;
+        buy.qty = BENCH_DEEP_LEVELS * BENCH_LEVEL_ORDERS;
+        evict_caches();
+        double start = now_sec();
+        handle_buy(&buy, NULL);
+        total += now_sec() - start;
+    }
+
+    int swept = BENCH_DEEP_SWEEPS * BENCH_DEEP_LEVELS * BENCH_LEVEL_ORDERS;
+    fprintf(stderr, "deep sweep %d x %d orders, %d traders, cold caches\n", BENCH_DEEP_SWEEPS, BENCH_DEEP_LEVELS * BENCH_LEVEL_ORDERS, BENCH_TRADERS);
+    fprintf(stderr, "  per sweep:   %8.2f ms %6.2f ns/order\n", total * 1e3 / BENCH_DEEP_SWEEPS, total * 1e9 / swept);
+    teardown_exchange();
+}
+
+// Build the MARKET and FILL messages of a match both ways
+static void bench_messages() {
+    setup_exchange(2);
+    char write_buf[BUF_LEN];
+    volatile size_t total_len = 0;
+
+    double start = now_sec();
+    for(int i=0; i<BENCH_ORDERS; i++) {
+        memset(write_buf, 0, BUF_LEN);
+        snprintf(write_buf, BUF_LEN, "MARKET SELL %s %d %d;", products.names[0], i % 1000, 100 + i % 50);
+        total_len += strlen(write_buf);
+        memset(write_buf, 0, BUF_LEN);
+        snprintf(write_buf, BUF_LEN, "FILL %d %d;", i, i % 1000);
+        total_len += strlen(write_buf);
+    }
+    double with_snprintf = now_sec() - start;
+
+    start = now_sec();
+    for(int i=0; i<BENCH_ORDERS; i++) {
+        total_len += format_message(write_buf, products.market_prefixes[0][SELL], products.market_prefix_lens[0][SELL], 2, (long int[]){i % 1000, 100 + i % 50});
+        total_len += format_message(write_buf, MSG_PREFIX("FILL "), 2, (long int[]){i, i % 1000});
+    }
+    double with_templates = now_sec() - start;
+
+    fprintf(stderr, "messages %d x (MARKET + FILL), %zu bytes\n", BENCH_ORDERS, (size_t)total_len);
+    fprintf(stderr, "  snprintf:    %8.2f ms %6.2f ns/pair\n", with_snprintf * 1e3, with_snprintf * 1e9 / BENCH_ORDERS);
+    fprintf(stderr, "  templates:   %8.2f ms %6.2f ns/pair\n", with_templates * 1e3, with_templates * 1e9 / BENCH_ORDERS);
+    teardown_exchange();
+}
+
+// Add a burst of buy stops with rising triggers, each one the new last to trigger,
+// then cancel them all
+static void bench_stops() {
+    setup_exchange(2);
+    struct order stop = {0};
+    stop.order_type = BUY;
+    strcpy(stop.product, "GPU");
+    stop.qty = 1;
+    stop.price = 1000000;
+
+    double start = now_sec();
+    for(int i=0; i<BENCH_STOPS; i++) {
+        stop.order_id = i;
+        stop.stop_price = 1 + i;
+        add_stop_order(&stop, 0);
+    }
+    double added = now_sec() - start;
+    start = now_sec();
+    int removed = remove_trader_stops(0, -1, ANY_SIDE, -1);
+    double cancelled = now_sec() - start;
+
+    fprintf(stderr, "stop burst %d orders, rising triggers\n", removed);
+    fprintf(stderr, "  add:         %8.2f ms %6.2f ns/stop\n", added * 1e3, added * 1e9 / BENCH_STOPS);
+    fprintf(stderr, "  cancel all:  %8.2f ms\n", cancelled * 1e3);
+    teardown_exchange();
+}
+
+int main(void) {
+    // The exchange log goes to stdout, keep it out of the results
+    if(freopen("/dev/null", "w", stdout) == NULL) {
+        perror("Error redirecting stdout");
+        return 1;
+    }
+
+    fprintf(stderr, "struct book_order: %zu bytes (price @%zu, qty @%zu, order_id @%zu, trader_id @%zu, next @%zu, prev @%zu, level @%zu)\n",
+        sizeof(struct book_order), offsetof(struct book_order, price), offsetof(struct book_order, qty),
+        offsetof(struct book_order, order_id), offsetof(struct book_order, trader_id),
+        offsetof(struct book_order, next), offsetof(struct book_order, prev),
+        offsetof(struct book_order, level));
+    fprintf(stderr, "struct order_info: %zu bytes (side table)\n", sizeof(struct order_info));
+    fprintf(stderr, "struct price_level: %zu bytes\n", sizeof(struct price_level));
+
+    bench_sweep();
+    bench_deep_sweep();
+    bench_messages();
+    bench_stops();
+    return 0;
+}
@@ -1,13 +1,60 @@
 // TODO
+// Before any header, as in pe_common.h, for mkstemp and sigaction under -std=c11
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <limits.h>
 #include "cmocka.h"
 #include "../pe_exchange.h"
+#include "../pe_logdecode.h"
 
 extern struct product_list products;
 extern struct trader_list traders;
 extern struct order_list *order_book;
+extern struct exchange_config config;
+extern long int exchange_fees;
+extern struct bulk_order bulk_order;
+extern struct timer_wheel timer_wheel;
+extern int pre_open_pending;
+extern struct log_ring log_ring;
+extern struct book_diff book_diff;
+extern struct snapshot_writer snapshot_writer;
+
+static int pipe_fds[3][2];
+static int fds_exchange[3];
+
+// Connect the traders to pipes so the messages sent by the exchange can be read back
+static void connect_test_pipes() {
+    signal(SIGUSR1, SIG_IGN);
+    for(int id=0; id<traders.num_traders; id++) {
+        pipe(pipe_fds[id]);
+        fcntl(pipe_fds[id][0], F_SETFL, O_NONBLOCK);
+        fds_exchange[id] = pipe_fds[id][1];
+        traders.trader_arr[id].pid = getpid();
+        traders.trader_arr[id].is_alive = 1;
+    }
+}
+
+static void close_test_pipes() {
+    for(int id=0; id<traders.num_traders; id++) {
+        close(pipe_fds[id][0]);
+        close(pipe_fds[id][1]);
+        traders.trader_arr[id].is_alive = 0;
+    }
+}
+
+// Read all pending messages sent to a trader
+static char* read_test_pipe(int id, char *buf, int len) {
+    memset(buf, 0, len);
+    ssize_t read_len = read(pipe_fds[id][0], buf, len-1);
+    if(read_len < 0) {
+        buf[0] = '\0';
+    }
+    return buf;
+}
 
 static int setup() {
     read_product_file("products.txt", &products);
@@ -100,8 +147,8 @@ static void test_init_traders() {
 
 static void test_init_order_book() {
     order_book = init_order_book(2);
-    assert_null(order_book[1].buy_head);
-    assert_null(order_book[1].sell_head);
+    assert_int_equal(order_book[1].buy_head, ORDER_NIL);
+    assert_int_equal(order_book[1].sell_head, ORDER_NIL);
     assert_int_equal(order_book[1].buy_levels, 0);
     assert_int_equal(order_book[1].buy_list_size, 0);
     assert_int_equal(order_book[1].sell_levels, 0);
@@ -110,6 +157,27 @@ static void test_init_order_book() {
     free_order_book(order_book, 2);
 }
 
+static void test_order_pool() {
+    struct order_pool pool;
+    init_order_pool(&pool, 2);
+
+    // Slot 0 is reserved as the null reference
+    uint32_t ref_1 = alloc_book_order(&pool);
+    assert_int_equal(ref_1, 1);
+
+    // Grows when full
+    uint32_t ref_2 = alloc_book_order(&pool);
+    assert_int_equal(ref_2, 2);
+    assert_int_equal(pool.capacity, 4);
+
+    // Released slots are reused first
+    release_book_order(&pool, ref_1);
+    assert_int_equal(alloc_book_order(&pool), ref_1);
+    assert_int_equal(alloc_book_order(&pool), 3);
+
+    free_order_pool(&pool);
+}
+
 static void test_buy_command() {
     struct order received_order;
 
@@ -223,8 +291,8 @@ static void test_amend_command() {
     handle_amend(&received_order, empty_fds);
     assert_int_equal(order_book[product_id].sell_list_size, 1);
     assert_int_equal(order_book[product_id].sell_levels, 1);
-    assert_int_equal(order_book[product_id].sell_head->price, 10);
-    assert_int_equal(order_book[product_id].sell_head->qty, 10);
+    assert_int_equal(ORDER_AT(order_book[product_id].sell_head)->price, 10);
+    assert_int_equal(ORDER_AT(order_book[product_id].sell_head)->qty, 10);
 
 }
 
@@ -264,7 +332,7 @@ static void test_cancel_command() {
 
     assert_int_equal(order_book[product_id].sell_list_size, 1);
     assert_int_equal(order_book[product_id].sell_levels, 1);
-    assert_non_null(order_book[product_id].sell_head);
+    assert_int_not_equal(order_book[product_id].sell_head, ORDER_NIL);
 
     char* command_1 = "CANCEL 0";
     assert_true(is_valid_cancel(command_1, 0, &received_order));
@@ -272,7 +340,7 @@ static void test_cancel_command() {
     handle_cancel(&received_order, empty_fds);
     assert_int_equal(order_book[product_id].sell_list_size, 0);
     assert_int_equal(order_book[product_id].sell_levels, 0);
-    assert_null(order_book[product_id].sell_head);
+    assert_int_equal(order_book[product_id].sell_head, ORDER_NIL);
 
 }
 
@@ -304,11 +372,11 @@ static void test_match() {
 
     assert_int_equal(order_book[product_id].sell_list_size, 0);
     assert_int_equal(order_book[product_id].sell_levels, 0);
-    assert_null(order_book[product_id].sell_head);
+    assert_int_equal(order_book[product_id].sell_head, ORDER_NIL);
 
     assert_int_equal(order_book[product_id].buy_list_size, 1);
     assert_int_equal(order_book[product_id].buy_levels, 1);
-    assert_non_null(order_book[product_id].buy_head);
+    assert_int_not_equal(order_book[product_id].buy_head, ORDER_NIL);
 
     // A valid sell2 to particially fill buy2
     char* command_sell2 = "SELL 1 GPU 10 10";
@@ -319,14 +387,1340 @@ static void test_match() {
 
     assert_int_equal(order_book[product_id].sell_list_size, 0);
     assert_int_equal(order_book[product_id].sell_levels, 0);
-    assert_null(order_book[product_id].sell_head);
+    assert_int_equal(order_book[product_id].sell_head, ORDER_NIL);
 
     assert_int_equal(order_book[product_id].buy_list_size, 1);
     assert_int_equal(order_book[product_id].buy_levels, 1);
-    assert_non_null(order_book[product_id].buy_head);
-    assert_int_equal(order_book[product_id].buy_head->qty, 10);
+    assert_int_not_equal(order_book[product_id].buy_head, ORDER_NIL);
+    assert_int_equal(ORDER_AT(order_book[product_id].buy_head)->qty, 10);
 }
 
+static void test_price_levels() {
+    struct order received_order;
+    int* empty_fds = NULL;
+
+    // Resting sells at three levels, two orders at the best one
+    char* command_sells[] = {"SELL 0 GPU 10 100", "SELL 1 GPU 5 100", "SELL 2 GPU 7 101", "SELL 3 GPU 3 102"};
+    for(int i=0; i<4; i++) {
+        assert_true(is_valid_sell(command_sells[i], 0, &received_order));
+        handle_sell(&received_order, empty_fds);
+        traders.trader_arr[0].num_orders++;
+    }
+    struct price_level *best = LEVEL_AT(order_book[0].sell_level_head);
+    assert_int_equal(order_book[0].sell_levels, 3);
+    assert_int_equal(best->price, 100);
+    assert_int_equal(best->total_qty, 15);
+    assert_int_equal(best->num_orders, 2);
+
+    // Cancel the back of the best level
+    assert_true(is_valid_cancel("CANCEL 1", 0, &received_order));
+    handle_cancel(&received_order, empty_fds);
+    best = LEVEL_AT(order_book[0].sell_level_head);
+    assert_int_equal(best->total_qty, 10);
+    assert_int_equal(best->num_orders, 1);
+    assert_int_equal(order_book[0].sell_list_size, 3);
+
+    // Takes the whole $100 level and part of the $101 level
+    assert_true(is_valid_buy("BUY 0 GPU 12 101", 1, &received_order));
+    handle_buy(&received_order, empty_fds);
+    traders.trader_arr[1].num_orders++;
+    best = LEVEL_AT(order_book[0].sell_level_head);
+    assert_int_equal(order_book[0].sell_levels, 2);
+    assert_int_equal(best->price, 101);
+    assert_int_equal(best->total_qty, 5);
+    assert_int_equal(ORDER_AT(order_book[0].sell_head)->order_id, 2);
+    assert_int_equal(ORDER_AT(order_book[0].sell_head)->qty, 5);
+    assert_int_equal(POSITION_QTY(&traders.positions, 1, 0), 12);
+
+    // Sweeps both remaining levels and rests the rest
+    assert_true(is_valid_buy("BUY 1 GPU 20 200", 1, &received_order));
+    handle_buy(&received_order, empty_fds);
+    assert_int_equal(order_book[0].sell_levels, 0);
+    assert_int_equal(order_book[0].sell_list_size, 0);
+    assert_int_equal(order_book[0].sell_head, ORDER_NIL);
+    assert_int_equal(order_book[0].buy_levels, 1);
+    assert_int_equal(LEVEL_AT(order_book[0].buy_level_head)->total_qty, 12);
+    assert_int_equal(POSITION_QTY(&traders.positions, 1, 0), 20);
+    assert_int_equal(POSITION_QTY(&traders.positions, 0, 0), -20);
+}
+
+static void test_position_matrix() {
+    struct order received_order;
+    int* empty_fds = NULL;
+
+    // Trader 0 sells 10 GPU to trader 1, and trader 2 sells 4 Router to trader 0
+    assert_true(is_valid_sell("SELL 0 GPU 10 100", 0, &received_order));
+    handle_sell(&received_order, empty_fds);
+    traders.trader_arr[0].num_orders++;
+    assert_true(is_valid_buy("BUY 0 GPU 10 100", 1, &received_order));
+    handle_buy(&received_order, empty_fds);
+    assert_true(is_valid_buy("BUY 1 Router 4 50", 0, &received_order));
+    handle_buy(&received_order, empty_fds);
+    assert_true(is_valid_sell("SELL 0 Router 4 50", 2, &received_order));
+    handle_sell(&received_order, empty_fds);
+
+    // The aggressor pays the fee
+    assert_int_equal(POSITION_QTY(&traders.positions, 0, 0), -10);
+    assert_int_equal(POSITION_PROFIT(&traders.positions, 0, 0), 1000);
+    assert_int_equal(POSITION_QTY(&traders.positions, 1, 0), 10);
+    assert_int_equal(POSITION_PROFIT(&traders.positions, 1, 0), -1010);
+    assert_int_equal(POSITION_QTY(&traders.positions, 0, 1), 4);
+    assert_int_equal(POSITION_PROFIT(&traders.positions, 0, 1), -200);
+    assert_int_equal(POSITION_QTY(&traders.positions, 2, 1), -4);
+    assert_int_equal(POSITION_PROFIT(&traders.positions, 2, 1), 198);
+
+    // A product column sums to zero, every unit bought was sold
+    assert_int_equal(product_net_exposure(&traders, 0), 0);
+    assert_int_equal(product_net_exposure(&traders, 1), 0);
+    POSITION_QTY(&traders.positions, 2, 1) = 0;
+    assert_int_equal(product_net_exposure(&traders, 1), 4);
+}
+
+static void test_fee_schedule() {
+    // The default schedule rounds exactly like the floating point percentage
+    for(long int value = 0; value < 200000; value++) {
+        assert_int_equal(compute_fee(value, FEE_PERCENTAGE * 100), (long int)round(value * FEE_PERCENTAGE / 100.0));
+    }
+    assert_int_equal(compute_fee(150, -100), -2);
+
+    // GPU makers get a rebate, trader 2 pays a lower taker fee everywhere
+    const char *fee_file = "/tmp/pe_test_fees.txt";
+    FILE *fp = fopen(fee_file, "w");
+    fprintf(fp, "# product trader taker maker\n\n* * 100 0\nGPU * 100 -10\n* 2 50 0 # tier\n");
+    fclose(fp);
+    read_fee_file(fee_file, &traders, &products);
+    remove(fee_file);
+    assert_int_equal(FEE_TAKER_BPS(&traders.fees, 0, 0), 100);
+    assert_int_equal(FEE_MAKER_BPS(&traders.fees, 0, 0), -10);
+    assert_int_equal(FEE_MAKER_BPS(&traders.fees, 0, 1), 0);
+    assert_int_equal(FEE_TAKER_BPS(&traders.fees, 2, 0), 50);
+    assert_int_equal(FEE_MAKER_BPS(&traders.fees, 2, 0), 0);
+
+    // Trader 2 takes 10 GPU from trader 0, value 1000
+    struct order received_order;
+    int* empty_fds = NULL;
+    exchange_fees = 0;
+    assert_true(is_valid_sell("SELL 0 GPU 10 100", 0, &received_order));
+    handle_sell(&received_order, empty_fds);
+    assert_true(is_valid_buy("BUY 0 GPU 10 100", 2, &received_order));
+    handle_buy(&received_order, empty_fds);
+    assert_int_equal(POSITION_PROFIT(&traders.positions, 2, 0), -1005);
+    assert_int_equal(POSITION_PROFIT(&traders.positions, 0, 0), 1001);
+    assert_int_equal(exchange_fees, 4);
+    exchange_fees = 0;
+}
+
+static void test_aggregated_fills() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+
+    // Three resting sells at different levels
+    char* command_sells[] = {"SELL 0 GPU 10 100", "SELL 1 GPU 10 101", "SELL 2 GPU 10 102"};
+    for(int i=0; i<3; i++) {
+        assert_true(is_valid_sell(command_sells[i], 0, &received_order));
+        handle_sell(&received_order, fds_exchange);
+        traders.trader_arr[0].num_orders++;
+    }
+
+    // Per match fills by default
+    char* command_buy1 = "BUY 0 GPU 5 100";
+    assert_true(is_valid_buy(command_buy1, 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[1].num_orders++;
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "FILL 0 5;");
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 0 5;");
+
+    // One aggregated fill for the aggressor, resting orders still get their own
+    config.fill_report = FILL_AGGREGATE;
+    char* command_buy2 = "BUY 1 GPU 10 101";
+    assert_true(is_valid_buy(command_buy2, 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[1].num_orders++;
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "FILL 0 5;FILL 1 5;");
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 1 10;");
+
+    // Aggregated fill with the average price, (5*101 + 10*102) / 15 = 101.67
+    config.fill_report = FILL_AGGREGATE_VWAP;
+    char* command_buy3 = "BUY 2 GPU 20 105";
+    assert_true(is_valid_buy(command_buy3, 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "FILL 1 5;FILL 2 10;");
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 2 15 102;");
+
+    config.fill_report = FILL_PER_MATCH;
+    close_test_pipes();
+}
+
+static void test_cancel_on_disconnect() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+
+    // Trader 0 rests three orders, trader 1 one
+    assert_true(is_valid_sell("SELL 0 GPU 10 100", 0, &received_order));
+    handle_sell(&received_order, fds_exchange);
+    traders.trader_arr[0].num_orders++;
+    assert_true(is_valid_buy("BUY 1 GPU 5 90", 0, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[0].num_orders++;
+    assert_true(is_valid_sell("SELL 2 Router 3 50", 0, &received_order));
+    handle_sell(&received_order, fds_exchange);
+    traders.trader_arr[0].num_orders++;
+    assert_true(is_valid_buy("BUY 0 Router 2 40", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    assert_int_equal(traders.trader_arr[0].num_resting, 3);
+
+    // A full fill leaves the trader's list as well
+    assert_true(is_valid_buy("BUY 0 GPU 10 100", 2, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    assert_int_equal(traders.trader_arr[0].num_resting, 2);
+    read_test_pipe(0, buf, sizeof(buf));
+    read_test_pipe(1, buf, sizeof(buf));
+
+    // Trader 0 disconnects, its orders go and the others get one batch
+    traders.trader_arr[0].is_alive = 0;
+    assert_int_equal(cancel_trader_orders(fds_exchange, 0, -1, ANY_SIDE), 2);
+    assert_int_equal(traders.trader_arr[0].order_head, ORDER_NIL);
+    assert_int_equal(traders.trader_arr[0].num_resting, 0);
+    assert_int_equal(order_book[0].buy_list_size, 0);
+    assert_int_equal(order_book[1].sell_list_size, 0);
+    assert_int_equal(order_book[1].buy_list_size, 1);
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "MARKET SELL Router 0 0;MARKET BUY GPU 0 0;");
+    assert_int_equal(traders.trader_arr[1].num_resting, 1);
+
+    close_test_pipes();
+}
+
+static void test_mass_cancel() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+
+    // Trader 0 quotes both sides of GPU and sells Router
+    char* command_orders[] = {"BUY 0 GPU 5 90", "BUY 1 GPU 5 91", "SELL 2 GPU 5 110", "SELL 3 Router 5 50"};
+    for(int i=0; i<4; i++) {
+        if(strstr(command_orders[i], "BUY")) {
+            assert_true(is_valid_buy(command_orders[i], 0, &received_order));
+            handle_buy(&received_order, fds_exchange);
+        } else {
+            assert_true(is_valid_sell(command_orders[i], 0, &received_order));
+            handle_sell(&received_order, fds_exchange);
+        }
+        traders.trader_arr[0].num_orders++;
+    }
+    read_test_pipe(1, buf, sizeof(buf));
+
+    // Invalid filters
+    assert_false(is_valid_mass_cancel("MASSCANCEL CPU *", 0, &received_order));
+    assert_false(is_valid_mass_cancel("MASSCANCEL GPU BOTH", 0, &received_order));
+    assert_false(is_valid_mass_cancel("MASSCANCEL GPU", 0, &received_order));
+
+    // Withdraw the GPU bids, one summary for the owner and one batch for the others
+    assert_true(is_valid_mass_cancel("MASSCANCEL GPU BUY", 0, &received_order));
+    assert_int_equal(received_order.order_type, BUY);
+    assert_int_equal(received_order.qty, 2);
+    send_order_response(MASS_CANCELLED, fds_exchange, &received_order);
+    notify_traders(MASS_CANCELLED, fds_exchange, &received_order);
+    handle_mass_cancel(&received_order, fds_exchange);
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "MASSCANCELLED 2;");
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "MARKET BUY GPU 0 0;MARKET BUY GPU 0 0;");
+    assert_int_equal(order_book[0].buy_list_size, 0);
+    assert_int_equal(order_book[0].sell_list_size, 1);
+
+    // Everything else
+    assert_true(is_valid_mass_cancel("MASSCANCEL * *", 0, &received_order));
+    assert_int_equal(received_order.qty, 2);
+    handle_mass_cancel(&received_order, fds_exchange);
+    assert_int_equal(traders.trader_arr[0].num_resting, 0);
+    assert_int_equal(order_book[0].sell_list_size, 0);
+    assert_int_equal(order_book[1].sell_list_size, 0);
+
+    close_test_pipes();
+}
+
+static void test_bulk_orders() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+
+    // An atomic bulk with an invalid leg is rejected as a whole
+    char command_atomic[] = "BULK ATOMIC BUY 0 GPU 10 100,SELL 1 CPU 10 110";
+    assert_false(is_valid_bulk(command_atomic, 0, &received_order, &bulk_order));
+    assert_int_equal(traders.trader_arr[0].num_orders, 0);
+
+    // A product token longer than a product name is cut at the name length and rejected
+    char long_name[CMD_BUF_LEN];
+    memset(long_name, 'G', sizeof(long_name));
+    long_name[sizeof(long_name) - 1] = '\0';
+    char command_long[CMD_BUF_LEN + BUF_LEN];
+    snprintf(command_long, sizeof(command_long), "BUY 0 %.3000s 10 100", long_name);
+    assert_false(is_valid_buy(command_long, 0, &received_order));
+    snprintf(command_long, sizeof(command_long), "SELL 0 %.3000s 10 MARKET", long_name);
+    assert_false(is_valid_sell(command_long, 0, &received_order));
+    snprintf(command_long, sizeof(command_long), "BULK EACH BUY 0 GPU 10 100,SELL 1 %.3000s 10 110", long_name);
+    assert_true(is_valid_bulk(command_long, 0, &received_order, &bulk_order));
+    assert_false(bulk_order.is_valid[1]);
+    assert_int_equal(received_order.qty, 1);
+
+    // Each leg on its own, ids are consecutive over the accepted legs
+    char command_each[] = "BULK EACH BUY 0 GPU 10 100,SELL 1 CPU 10 110,SELL 1 GPU 5 100,BUY 2 Router 3 50";
+    assert_true(is_valid_bulk(command_each, 0, &received_order, &bulk_order));
+    assert_int_equal(received_order.qty, 3);
+    assert_int_equal(bulk_order.num_legs, 4);
+    assert_false(bulk_order.is_valid[1]);
+
+    // One acknowledgement and one broadcast for the whole bulk
+    send_order_response(BULK_ACCEPTED, fds_exchange, &received_order);
+    notify_traders(BULK_ACCEPTED, fds_exchange, &received_order);
+    process_order(BULK_ACCEPTED, fds_exchange, &received_order);
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "ACCEPTED 0;INVALID;ACCEPTED 1;ACCEPTED 2;FILL 0 5;FILL 1 5;");
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "MARKET BUY GPU 10 100;MARKET SELL GPU 5 100;MARKET BUY Router 3 50;");
+    assert_int_equal(traders.trader_arr[0].num_orders, 3);
+
+    // The legs were matched in sequence, the sell crossed the resting buy
+    assert_int_equal(order_book[0].buy_list_size, 1);
+    assert_int_equal(ORDER_AT(order_book[0].buy_head)->qty, 5);
+    assert_int_equal(order_book[1].buy_list_size, 1);
+
+    close_test_pipes();
+}
+
+static void test_ioc_fok_orders() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+
+    // Two sell levels of 5 each
+    assert_true(is_valid_sell("SELL 0 GPU 5 100", 0, &received_order));
+    handle_sell(&received_order, fds_exchange);
+    traders.trader_arr[0].num_orders++;
+    assert_true(is_valid_sell("SELL 1 GPU 5 101", 0, &received_order));
+    handle_sell(&received_order, fds_exchange);
+    traders.trader_arr[0].num_orders++;
+
+    // Time in force grammar
+    assert_false(is_valid_buy("BUY 0 GPU 5 100 GTC", 1, &received_order));
+    assert_false(is_valid_buy("BUY 0 GPU 5 100 IOC extra", 1, &received_order));
+    assert_false(is_valid_buy("BUY 0 GPU 5 100  IOC", 1, &received_order));
+    assert_true(is_valid_buy("BUY 0 GPU 5 100", 1, &received_order));
+    assert_int_equal(received_order.tif, TIF_DAY);
+
+    // Fill or kill above the liquidity at its price is killed without a match
+    assert_true(is_valid_buy("BUY 0 GPU 8 100 FOK", 1, &received_order));
+    assert_int_equal(received_order.tif, TIF_FOK);
+    handle_buy(&received_order, fds_exchange);
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "CANCELLED 0;");
+    assert_int_equal(order_book[0].sell_list_size, 2);
+    assert_int_equal(order_book[0].buy_list_size, 0);
+    traders.trader_arr[1].num_orders++;
+
+    // Immediate or cancel fills what it can and never rests
+    assert_true(is_valid_buy("BUY 1 GPU 8 100 IOC", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 1 5;CANCELLED 1;");
+    assert_int_equal(order_book[0].sell_list_size, 1);
+    assert_int_equal(order_book[0].buy_list_size, 0);
+    traders.trader_arr[1].num_orders++;
+
+    // Fill or kill with enough liquidity over two levels fills completely
+    assert_true(is_valid_sell("SELL 2 GPU 5 102", 0, &received_order));
+    handle_sell(&received_order, fds_exchange);
+    assert_true(is_valid_buy("BUY 2 GPU 8 102 FOK", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 2 5;FILL 2 3;");
+    assert_int_equal(order_book[0].sell_list_size, 1);
+    assert_int_equal(order_book[0].buy_list_size, 0);
+
+    close_test_pipes();
+}
+
+static void test_iceberg_orders() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+
+    // Clip grammar
+    assert_false(is_valid_sell("SELL 0 GPU 10 100 ICEBERG 0", 0, &received_order));
+    assert_false(is_valid_sell("SELL 0 GPU 10 100 ICEBERG 11", 0, &received_order));
+    assert_false(is_valid_sell("SELL 0 GPU 10 100 ICEBERG", 0, &received_order));
+
+    // Trader 0 sells 10 showing 4, trader 2 rests 3 behind it at the same price
+    assert_true(is_valid_sell("SELL 0 GPU 10 100 ICEBERG 4", 0, &received_order));
+    assert_int_equal(received_order.display_qty, 4);
+    notify_traders(ACCEPTED, fds_exchange, &received_order);
+    handle_sell(&received_order, fds_exchange);
+    traders.trader_arr[0].num_orders++;
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "MARKET SELL GPU 4 100;");
+    read_test_pipe(2, buf, sizeof(buf));
+    assert_true(is_valid_sell("SELL 0 GPU 3 100", 2, &received_order));
+    handle_sell(&received_order, fds_exchange);
+    traders.trader_arr[2].num_orders++;
+    struct price_level *level = LEVEL_AT(order_book[0].sell_level_head);
+    assert_int_equal(level->total_qty, 7);
+    assert_int_equal(level->num_icebergs, 1);
+
+    // Taking the clip refills it at the back of the level, behind trader 2
+    assert_true(is_valid_buy("BUY 0 GPU 5 100", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[1].num_orders++;
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "FILL 0 4;");
+    assert_string_equal(read_test_pipe(2, buf, sizeof(buf)), "FILL 0 1;");
+    assert_int_equal(level->total_qty, 6);
+    assert_int_equal(ORDER_AT(level->head)->trader_id, 2);
+    assert_int_equal(ORDER_AT(level->tail)->trader_id, 0);
+    assert_int_equal(ORDER_AT(level->tail)->qty, 4);
+    assert_int_equal(ORDER_AT(level->tail)->reserve_qty, 2);
+
+    // A larger buy sweeps the level including the hidden reserve, the last clip is 2
+    assert_true(is_valid_buy("BUY 1 GPU 20 100", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "FILL 0 4;FILL 0 2;");
+    assert_string_equal(read_test_pipe(2, buf, sizeof(buf)), "FILL 0 2;");
+    assert_int_equal(order_book[0].sell_list_size, 0);
+    assert_int_equal(order_book[0].sell_levels, 0);
+    assert_int_equal(ORDER_AT(order_book[0].buy_head)->qty, 12);
+    assert_int_equal(POSITION_QTY(&traders.positions, 0, 0), -10);
+    assert_int_equal(traders.trader_arr[0].num_resting, 0);
+
+    close_test_pipes();
+}
+
+static void test_gtt_expiry() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+
+    // Expiry grammar, in milliseconds rounded up to ticks
+    assert_false(is_valid_sell("SELL 0 GPU 10 100 GTT 0", 0, &received_order));
+    assert_false(is_valid_sell("SELL 0 GPU 10 100 GTT", 0, &received_order));
+    assert_true(is_valid_sell("SELL 0 GPU 10 100 GTT 25", 0, &received_order));
+    assert_int_equal(received_order.tif, TIF_GTT);
+    assert_int_equal(received_order.expire_tick, 3);
+
+    // Orders expiring within a few ticks and after ten minutes, the best one is filled before it expires
+    int expire_ms[] = {25, 30, 700000, 40};
+    for(int i=0; i<4; i++) {
+        char command[BUF_LEN];
+        snprintf(command, BUF_LEN, "SELL %d GPU 10 %d GTT %d", i, 100 + i, expire_ms[i]);
+        assert_true(is_valid_sell(command, 0, &received_order));
+        handle_sell(&received_order, fds_exchange);
+        traders.trader_arr[0].num_orders++;
+    }
+    assert_int_equal(timer_wheel.num_timers, 4);
+    assert_true(is_valid_buy("BUY 0 GPU 10 103", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    assert_int_equal(timer_wheel.num_timers, 3);
+    read_test_pipe(0, buf, sizeof(buf));
+    read_test_pipe(1, buf, sizeof(buf));
+
+    // Nothing is due yet
+    assert_int_equal(expire_orders(fds_exchange, 2), 0);
+    assert_int_equal(order_book[0].sell_list_size, 3);
+
+    // The orders due at ticks 3 and 4 expire together, with one write per trader
+    assert_int_equal(expire_orders(fds_exchange, 10), 2);
+    assert_int_equal(order_book[0].sell_list_size, 1);
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "CANCELLED 1;CANCELLED 3;");
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "MARKET SELL GPU 0 0;MARKET SELL GPU 0 0;");
+
+    // The long expiry is cascaded down the wheel and fires on its exact tick
+    assert_int_equal(expire_orders(fds_exchange, 69999), 0);
+    assert_int_equal(timer_wheel.num_timers, 1);
+    assert_int_equal(expire_orders(fds_exchange, 70000), 1);
+    assert_int_equal(timer_wheel.num_timers, 0);
+    assert_int_equal(order_book[0].sell_list_size, 0);
+    assert_int_equal(traders.trader_arr[0].num_resting, 0);
+
+    close_test_pipes();
+}
+
+static void test_stop_heap() {
+    // Buy stops with repeated triggers from two traders, in no particular order
+    struct order stop = {0};
+    stop.order_type = BUY;
+    strcpy(stop.product, "GPU");
+    stop.qty = 1;
+    stop.price = 500;
+    for(int i=0; i<200; i++) {
+        stop.trader_id = i % 2;
+        stop.order_id = i;
+        stop.stop_price = 100 + (i * 37) % 50;
+        add_stop_order(&stop, 0);
+    }
+    assert_int_equal(count_trader_stops(1, 0, ANY_SIDE), 100);
+    assert_int_equal(count_trader_stops(1, 0, SELL), 0);
+    assert_int_equal(stop_books[0].num_buy_stops, 200);
+
+    // Counting leaves the heap alone, removing rebuilds it without the trader
+    assert_int_equal(remove_trader_stops(1, -1, ANY_SIDE, -1), 100);
+    assert_int_equal(count_trader_stops(1, -1, ANY_SIDE), 0);
+    assert_int_equal(stop_books[0].num_buy_stops, 100);
+
+    // Popping the root gives the lowest trigger first, and the oldest of equal triggers
+    struct stop_book *book = &stop_books[0];
+    struct stop_order last = book->buy_stops[0];
+    while(book->num_buy_stops > 0) {
+        struct stop_order root = book->buy_stops[0];
+        assert_true(root.trigger > last.trigger || (root.trigger == last.trigger && root.seq >= last.seq));
+        assert_int_equal(root.order.trader_id, 0);
+        last = root;
+        book->num_buy_stops--;
+        book->buy_stops[0] = book->buy_stops[book->num_buy_stops];
+        sift_stop_down(book->buy_stops, book->num_buy_stops, 0, 1);
+    }
+}
+
+static void test_stop_orders() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+
+    // Trigger grammar
+    assert_false(is_valid_buy("BUY 0 GPU 5 102 STOP 0", 2, &received_order));
+    assert_false(is_valid_buy("BUY 0 GPU 5 102 STOP", 2, &received_order));
+    assert_false(is_valid_buy("BUY 0 GPU 5 102 STOP 100x", 2, &received_order));
+
+    // Trader 0 offers three levels, trader 2 waits to buy above 100 and 102 and to sell below 90
+    for(int i=0; i<3; i++) {
+        char command[BUF_LEN];
+        snprintf(command, BUF_LEN, "SELL %d GPU 5 %d", i, 100 + 2 * i);
+        assert_true(is_valid_sell(command, 0, &received_order));
+        handle_new_order(&received_order, fds_exchange);
+        traders.trader_arr[0].num_orders++;
+    }
+    char *stops[] = {"BUY 0 GPU 5 102 STOP 100", "BUY 1 GPU 5 104 STOP 102", "SELL 2 GPU 1 50 STOP 90"};
+    for(int i=0; i<3; i++) {
+        assert_true(i == 2 ? is_valid_sell(stops[i], 2, &received_order) : is_valid_buy(stops[i], 2, &received_order));
+        notify_traders(ACCEPTED, fds_exchange, &received_order);
+        handle_new_order(&received_order, fds_exchange);
+        traders.trader_arr[2].num_orders++;
+    }
+    assert_int_equal(stop_books[0].num_buy_stops, 2);
+    assert_int_equal(stop_books[0].num_sell_stops, 1);
+    assert_int_equal(order_book[0].buy_list_size, 0);
+    read_test_pipe(1, buf, sizeof(buf));
+    assert_string_equal(buf, "");
+
+    // A trade at 100 triggers the first stop, whose trade at 102 triggers the second
+    assert_true(is_valid_buy("BUY 0 GPU 5 100", 1, &received_order));
+    handle_new_order(&received_order, fds_exchange);
+    traders.trader_arr[1].num_orders++;
+    assert_string_equal(read_test_pipe(2, buf, sizeof(buf)), "FILL 0 5;FILL 1 5;");
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 0 5;MARKET BUY GPU 5 102;MARKET BUY GPU 5 104;");
+    assert_int_equal(order_book[0].last_price, 104);
+    assert_int_equal(order_book[0].sell_list_size, 0);
+    assert_int_equal(stop_books[0].num_buy_stops, 0);
+    assert_int_equal(POSITION_QTY(&traders.positions, 2, 0), 10);
+    assert_int_equal(POSITION_QTY(&traders.positions, 0, 0), -15);
+
+    // The pending sell stop is cancelled without a market update
+    assert_int_equal(count_trader_orders(2, -1, ANY_SIDE), 1);
+    assert_true(is_valid_cancel("CANCEL 2", 2, &received_order));
+    assert_int_equal(received_order.target, ORDER_NIL);
+    notify_traders(CANCELLED, fds_exchange, &received_order);
+    handle_cancel(&received_order, fds_exchange);
+    assert_int_equal(stop_books[0].num_sell_stops, 0);
+    assert_false(is_valid_cancel("CANCEL 2", 2, &received_order));
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "FILL 0 5;MARKET BUY GPU 5 102;FILL 1 5;MARKET BUY GPU 5 104;FILL 2 5;");
+
+    close_test_pipes();
+}
+
+static void test_market_orders() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+
+    // MARKET takes the place of the price, with no suffix
+    assert_false(is_valid_buy("BUY 0 GPU 10 MARKET IOC", 1, &received_order));
+    assert_false(is_valid_buy("BUY 0 GPU 10 MARKETS", 1, &received_order));
+    assert_false(is_valid_buy("BUY 0 GPU 0 MARKET", 1, &received_order));
+    assert_true(is_valid_buy("BUY 0 GPU 12 MARKET", 1, &received_order));
+    assert_int_equal(received_order.tif, TIF_MARKET);
+
+    // Trader 0 offers 5 at 100, 5 at 101 and 5 at 102
+    for(int i=0; i<3; i++) {
+        char command[BUF_LEN];
+        snprintf(command, BUF_LEN, "SELL %d GPU 5 %d", i, 100 + i);
+        assert_true(is_valid_sell(command, 0, &received_order));
+        handle_sell(&received_order, fds_exchange);
+        traders.trader_arr[0].num_orders++;
+    }
+
+    // The sweep is bounded by the level where the shown quantity covers the order
+    assert_true(is_valid_buy("BUY 0 GPU 7 MARKET", 1, &received_order));
+    assert_int_equal(market_sweep_price(&received_order, 0), 101);
+    notify_traders(ACCEPTED, fds_exchange, &received_order);
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[1].num_orders++;
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 0 5;FILL 0 2;");
+    assert_string_equal(read_test_pipe(2, buf, sizeof(buf)), "");
+    assert_int_equal(order_book[0].sell_list_size, 2);
+    assert_int_equal(LEVEL_AT(order_book[0].sell_level_head)->total_qty, 3);
+
+    // A larger order takes everything and its remainder is cancelled instead of resting
+    assert_true(is_valid_buy("BUY 1 GPU 20 MARKET", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[1].num_orders++;
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 1 3;FILL 1 5;CANCELLED 1;");
+    assert_int_equal(order_book[0].sell_levels, 0);
+    assert_int_equal(order_book[0].buy_list_size, 0);
+    assert_int_equal(POSITION_QTY(&traders.positions, 1, 0), 15);
+
+    // Against an empty side nothing is filled
+    assert_true(is_valid_sell("SELL 0 GPU 4 MARKET", 2, &received_order));
+    handle_sell(&received_order, fds_exchange);
+    assert_string_equal(read_test_pipe(2, buf, sizeof(buf)), "CANCELLED 0;");
+    assert_int_equal(order_book[0].sell_list_size, 0);
+
+    close_test_pipes();
+}
+
+static void test_batch_auction() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+    config.batch_auction = 1;
+    config.batch_size = 4;
+
+    // Orders rest without matching, the book may cross until the batch is full
+    char *commands[] = {"SELL 0 GPU 5 100", "SELL 1 GPU 5 102", "BUY 0 GPU 4 103", "BUY 1 GPU 4 101"};
+    int owners[] = {0, 0, 1, 1};
+    for(int i=0; i<4; i++) {
+        int trader_id = owners[i];
+        assert_true(i < 2 ? is_valid_sell(commands[i], trader_id, &received_order) : is_valid_buy(commands[i], trader_id, &received_order));
+        handle_new_order(&received_order, fds_exchange);
+        traders.trader_arr[trader_id].num_orders++;
+    }
+    assert_int_equal(order_book[0].batch_orders, 4);
+    assert_int_equal(order_book[0].buy_list_size, 2);
+    assert_int_equal(order_book[0].sell_list_size, 2);
+
+    // 5 match at 100 and at 101, the lower price wins the tie without a last trade price
+    int clearing_qty;
+    assert_int_equal(auction_clearing_price(0, &clearing_qty), 100);
+    assert_int_equal(clearing_qty, 5);
+    assert_int_equal(run_batch_auctions(fds_exchange, 0), 1);
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 0 4;FILL 1 1;");
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "FILL 0 4;FILL 0 1;");
+    assert_int_equal(order_book[0].batch_orders, 0);
+    assert_int_equal(order_book[0].last_price, 100);
+    assert_int_equal(POSITION_QTY(&traders.positions, 1, 0), 5);
+    assert_int_equal(POSITION_PROFIT(&traders.positions, 1, 0), -500);
+    assert_int_equal(LEVEL_AT(order_book[0].buy_level_head)->total_qty, 3);
+    assert_int_equal(LEVEL_AT(order_book[0].sell_level_head)->price, 102);
+    assert_int_equal(auction_clearing_price(0, &clearing_qty), 0);
+
+    // An immediate order still matches on arrival, against the uncrossed book
+    assert_true(is_valid_buy("BUY 0 GPU 2 MARKET", 2, &received_order));
+    handle_new_order(&received_order, fds_exchange);
+    assert_string_equal(read_test_pipe(2, buf, sizeof(buf)), "FILL 0 2;");
+    assert_int_equal(LEVEL_AT(order_book[0].sell_level_head)->total_qty, 3);
+
+    config.batch_auction = 0;
+    config.batch_size = 0;
+    close_test_pipes();
+}
+
+static void test_opening_auction() {
+    struct order received_order;
+    char buf[BUF_LEN*4];
+    connect_test_pipes();
+    pre_open_pending = 1;
+
+    // During the call phase orders queue without matching
+    char *commands[] = {"SELL 0 GPU 3 98", "SELL 1 GPU 4 100", "SELL 2 GPU 5 103", "BUY 0 GPU 2 104", "BUY 1 GPU 4 101", "BUY 2 GPU 6 99"};
+    for(int i=0; i<6; i++) {
+        int trader_id = i < 3 ? 0 : 1;
+        assert_true(i < 3 ? is_valid_sell(commands[i], trader_id, &received_order) : is_valid_buy(commands[i], trader_id, &received_order));
+        handle_new_order(&received_order, fds_exchange);
+        traders.trader_arr[trader_id].num_orders++;
+    }
+    assert_int_equal(order_book[0].buy_levels, 3);
+    assert_int_equal(order_book[0].sell_levels, 3);
+
+    // An immediate order has nothing to match yet
+    assert_true(is_valid_buy("BUY 0 GPU 1 104 IOC", 2, &received_order));
+    handle_new_order(&received_order, fds_exchange);
+    assert_string_equal(read_test_pipe(2, buf, sizeof(buf)), "CANCELLED 0;");
+    assert_int_equal(order_book[0].buy_list_size, 3);
+
+    // 6 match at 100 and at 101 with the same imbalance, the lower price wins
+    int clearing_qty;
+    assert_int_equal(auction_clearing_price(0, &clearing_qty), 100);
+    assert_int_equal(clearing_qty, 6);
+    assert_int_equal(open_market(fds_exchange), 6);
+    assert_false(pre_open_pending);
+    assert_string_equal(read_test_pipe(1, buf, sizeof(buf)), "FILL 0 2;FILL 1 1;FILL 1 3;");
+    assert_string_equal(read_test_pipe(0, buf, sizeof(buf)), "FILL 0 2;FILL 0 1;FILL 1 3;");
+    assert_int_equal(LEVEL_AT(order_book[0].sell_level_head)->price, 100);
+    assert_int_equal(LEVEL_AT(order_book[0].sell_level_head)->total_qty, 1);
+    assert_int_equal(LEVEL_AT(order_book[0].buy_level_head)->price, 99);
+    assert_int_equal(POSITION_PROFIT(&traders.positions, 0, 0), 600);
+
+    // A new crossing buy is uncrossed at the price that matches the most
+    assert_true(is_valid_buy("BUY 3 GPU 4 103", 1, &received_order));
+    rest_order(&received_order, 0);
+    assert_int_equal(auction_clearing_price(0, &clearing_qty), 103);
+    assert_int_equal(clearing_qty, 4);
+
+    close_test_pipes();
+}
+
+static void test_book_diffs() {
+    struct order received_order;
+    connect_test_pipes();
+    config.book_diffs = 1;
+    init_book_diff(&book_diff, traders.num_traders, products.num_products);
+
+    // Trader 0 offers 5 at 100 and 5 at 101, a Router order is untouched later
+    char *commands[] = {"SELL 0 GPU 5 100", "SELL 1 GPU 5 101", "SELL 2 Router 5 50"};
+    for(int i=0; i<3; i++) {
+        assert_true(is_valid_sell(commands[i], 0, &received_order));
+        handle_sell(&received_order, fds_exchange);
+        traders.trader_arr[0].num_orders++;
+    }
+    assert_int_equal(book_diff.num_levels, 3);
+    assert_int_equal(book_diff.num_cells, 0);
+    clear_book_diff(&book_diff);
+
+    // The buy takes the level at 100 and part of 101
+    assert_true(is_valid_buy("BUY 0 GPU 7 101", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[1].num_orders++;
+    assert_int_equal(book_diff.num_levels, 2);
+    assert_int_equal(book_diff.num_cells, 2);
+
+    // Only the two levels and the two positions are printed, the removed level as empty
+    int log_pipe[2];
+    assert_int_equal(pipe(log_pipe), 0);
+    start_logger(&log_ring, log_pipe[1], 0);
+    show_book_update();
+    stop_logger();
+    close(log_pipe[1]);
+
+    char expected[BUF_LEN*4];
+    int expected_len = snprintf(expected, sizeof(expected),
+        LOG_PREFIX"\t--ORDERBOOK CHANGES--\n"
+        LOG_PREFIX"\tProduct: GPU; Buy levels: 0; Sell levels: 1\n"
+        LOG_PREFIX"\t\tSELL 3 @ $101 (1 order)\n"
+        LOG_PREFIX"\t\tSELL 0 @ $100 (0 orders)\n"
+        LOG_PREFIX"\t--POSITION CHANGES--\n"
+        LOG_PREFIX"\tTrader 0: GPU -7 ($%ld)\n"
+        LOG_PREFIX"\tTrader 1: GPU 7 ($%ld)\n",
+        POSITION_PROFIT(&traders.positions, 0, 0), POSITION_PROFIT(&traders.positions, 1, 0));
+    char output[BUF_LEN*4];
+    int output_len = 0;
+    ssize_t read_len;
+    while((read_len = read(log_pipe[0], output + output_len, sizeof(output) - output_len)) > 0) {
+        output_len += read_len;
+    }
+    close(log_pipe[0]);
+    assert_int_equal(output_len, expected_len);
+    assert_memory_equal(output, expected, expected_len);
+
+    // The sets are empty for the next command
+    assert_int_equal(book_diff.num_levels, 0);
+    assert_int_equal(book_diff.num_cells, 0);
+    assert_int_equal(book_diff.cell_dirty[0], 0);
+
+    free_book_diff(&book_diff);
+    config.book_diffs = 0;
+    close_test_pipes();
+}
+
+static void test_compact_positions() {
+    struct order received_order;
+    connect_test_pipes();
+    config.compact_positions = 1;
+    init_book_diff(&book_diff, traders.num_traders, products.num_products);
+
+    // Only the cells of a match are marked, the levels are not tracked for a full book
+    assert_true(is_valid_sell("SELL 0 Router 5 100", 0, &received_order));
+    handle_sell(&received_order, fds_exchange);
+    traders.trader_arr[0].num_orders++;
+    assert_true(is_valid_buy("BUY 0 Router 2 100", 2, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[2].num_orders++;
+    assert_int_equal(book_diff.num_levels, 0);
+    assert_int_equal(book_diff.num_cells, 2);
+
+    // Trader 1 is untouched and skipped, the book is printed in full
+    int log_pipe[2];
+    assert_int_equal(pipe(log_pipe), 0);
+    start_logger(&log_ring, log_pipe[1], 0);
+    show_book_update();
+    stop_logger();
+    close(log_pipe[1]);
+
+    char expected[BUF_LEN*4];
+    int expected_len = snprintf(expected, sizeof(expected),
+        LOG_PREFIX"\t--ORDERBOOK--\n"
+        LOG_PREFIX"\tProduct: GPU; Buy levels: 0; Sell levels: 0\n"
+        LOG_PREFIX"\tProduct: Router; Buy levels: 0; Sell levels: 1\n"
+        LOG_PREFIX"\t\tSELL 3 @ $100 (1 order)\n"
+        LOG_PREFIX"\t--POSITION CHANGES--\n"
+        LOG_PREFIX"\tTrader 0: Router -2 ($%ld)\n"
+        LOG_PREFIX"\tTrader 2: Router 2 ($%ld)\n",
+        POSITION_PROFIT(&traders.positions, 0, 1), POSITION_PROFIT(&traders.positions, 2, 1));
+    char output[BUF_LEN*4];
+    int output_len = 0;
+    ssize_t read_len;
+    while((read_len = read(log_pipe[0], output + output_len, sizeof(output) - output_len)) > 0) {
+        output_len += read_len;
+    }
+    close(log_pipe[0]);
+    assert_int_equal(output_len, expected_len);
+    assert_memory_equal(output, expected, expected_len);
+    assert_int_equal(book_diff.num_cells, 0);
+
+    free_book_diff(&book_diff);
+    config.compact_positions = 0;
+    close_test_pipes();
+}
+
+static void test_journal() {
+    struct order received_order;
+    char buf[BUF_LEN];
+    connect_test_pipes();
+    char journal_file[] = "/tmp/pe_journal_XXXXXX";
+    int fd = mkstemp(journal_file);
+    assert_true(fd != -1);
+    close(fd);
+    config.journal_file = journal_file;
+    open_journal(&journal, journal_file, traders.num_traders, products.num_products);
+
+    // A match is journaled, and its fills are held until the commit
+    assert_int_equal(classify_command("SELL 0 GPU 5 100", 0, &received_order), ACCEPTED);
+    journal_append(&journal, 0, "SELL 0 GPU 5 100", fds_exchange);
+    handle_sell(&received_order, fds_exchange);
+    traders.trader_arr[0].num_orders++;
+    assert_int_equal(classify_command("BUY 0 GPU 2 100", 1, &received_order), ACCEPTED);
+    journal_append(&journal, 1, "BUY 0 GPU 2 100", fds_exchange);
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[1].num_orders++;
+    assert_int_equal(journal.num_pending, 2);
+    assert_string_equal(read_test_pipe(0, buf, BUF_LEN), "");
+    assert_string_equal(read_test_pipe(1, buf, BUF_LEN), "");
+
+    commit_journal(&journal, fds_exchange);
+    assert_int_equal(journal.num_pending, 0);
+    assert_string_equal(read_test_pipe(0, buf, BUF_LEN), "FILL 0 2;");
+    assert_string_equal(read_test_pipe(1, buf, BUF_LEN), "FILL 0 2;");
+
+    // An invalid command is not journaled
+    assert_int_equal(classify_command("CANCEL 7", 0, &received_order), INVALID);
+    close_journal(&journal, fds_exchange);
+    config.journal_file = NULL;
+
+    // Reopening the journal appends to it under the same id
+    long int journal_id = journal.id;
+    open_journal(&journal, journal_file, traders.num_traders, products.num_products);
+    assert_int_equal(journal.id, journal_id);
+    close_journal(&journal, fds_exchange);
+
+    char expected[BUF_LEN];
+    snprintf(expected, BUF_LEN, JOURNAL_MAGIC" %d %d %ld\n0 0 SELL 0 GPU 5 100\n0 1 BUY 0 GPU 2 100\n", traders.num_traders, products.num_products, journal_id);
+    FILE *file = fopen(journal_file, "r");
+    size_t read_len = fread(buf, 1, BUF_LEN, file);
+    fclose(file);
+    unlink(journal_file);
+    assert_int_equal(read_len, strlen(expected));
+    assert_memory_equal(buf, expected, read_len);
+    close_test_pipes();
+}
+
+static void test_journal_replay() {
+    char journal_file[] = "/tmp/pe_replay_XXXXXX";
+    int fd = mkstemp(journal_file);
+    assert_true(fd != -1);
+    char records[BUF_LEN*4];
+    int records_len = snprintf(records, sizeof(records),
+        JOURNAL_MAGIC" %d %d 1\n"
+        "0 0 SELL 0 GPU 10 100\n"
+        "0 0 SELL 1 GPU 5 105\n"
+        "0 1 BUY 0 GPU 4 100\n"
+        "0 1 BULK EACH BUY 1 Router 3 20,SELL 2 Router 2 50\n"
+        "0 0 AMEND 1 5 104\n"
+        "0 1 DISCONNECT\n", traders.num_traders, products.num_products);
+    assert_int_equal(write(fd, records, records_len), records_len);
+    close(fd);
+
+    // The state is rebuilt without any message, the traders are not connected
+    long int fees = exchange_fees;
+    assert_int_equal(replay_journal(journal_file, 0, 0), 6);
+    unlink(journal_file);
+    assert_int_equal(config.verbosity, LOG_FULL);
+
+    assert_int_equal(order_book[0].sell_levels, 2);
+    assert_int_equal(order_book[0].buy_levels, 0);
+    assert_int_equal(order_book[1].buy_levels, 0);
+    assert_int_equal(order_book[1].sell_levels, 0);
+    assert_int_equal(POSITION_QTY(&traders.positions, 0, 0), -4);
+    assert_int_equal(POSITION_QTY(&traders.positions, 1, 0), 4);
+    assert_int_equal(exchange_fees - fees, 4);
+    assert_int_equal(traders.trader_arr[0].num_orders, 2);
+    assert_int_equal(traders.trader_arr[1].num_orders, 3);
+}
+
+// The positions and fees of a live run, to compare with the state rebuilt from it
+struct saved_positions {
+    int *qty;
+    long int *profit;
+    long int fees;
+};
+
+static struct saved_positions save_positions() {
+    int num_cells = traders.num_traders * products.num_products;
+    struct saved_positions saved;
+    saved.qty = (int*)calloc(num_cells, sizeof(int));
+    saved.profit = (long int*)calloc(num_cells, sizeof(long int));
+    for(int i=0; i<num_cells; i++) {
+        saved.qty[i] = traders.positions.qty[i];
+        saved.profit[i] = traders.positions.profit[i];
+    }
+    saved.fees = exchange_fees;
+    return saved;
+}
+
+static void assert_positions_equal(struct saved_positions *saved) {
+    int num_cells = traders.num_traders * products.num_products;
+    for(int i=0; i<num_cells; i++) {
+        assert_int_equal(traders.positions.qty[i], saved->qty[i]);
+        assert_int_equal(traders.positions.profit[i], saved->profit[i]);
+    }
+    assert_int_equal(exchange_fees, saved->fees);
+    free(saved->qty);
+    free(saved->profit);
+}
+
+// Apply a command as the event loop does, journaling it first
+static void apply_journaled(int trader_id, char *command) {
+    struct order received_order;
+    enum OrderResponseType response = classify_command(command, trader_id, &received_order);
+    assert_int_not_equal(response, INVALID);
+    journal_append(&journal, trader_id, command, fds_exchange);
+    take_order_ids(response, &received_order);
+    apply_command(response, fds_exchange, &received_order);
+}
+
+static void test_journal_clock_replay() {
+    connect_test_pipes();
+    config.batch_auction = 1;
+    config.batch_interval_ms = 5 * TIMER_TICK_MS;
+    exchange_fees = 0;
+    char journal_file[] = "/tmp/pe_journal_XXXXXX";
+    int fd = mkstemp(journal_file);
+    assert_true(fd != -1);
+    close(fd);
+    config.journal_file = journal_file;
+    open_journal(&journal, journal_file, traders.num_traders, products.num_products);
+
+    // A live session driven by the clock: batch auctions, a stop they trigger and a good till time expiry
+    apply_journaled(0, "SELL 0 GPU 5 100 GTT 200");
+    apply_journaled(1, "BUY 0 GPU 3 101");
+    apply_journaled(2, "SELL 0 Router 4 50");
+    apply_journaled(1, "BUY 1 Router 4 52");
+    apply_journaled(2, "SELL 1 GPU 1 90 STOP 100");
+    expire_orders(fds_exchange, 5);
+    assert_int_equal(run_batch_auctions(fds_exchange, 5), 2);
+    expire_orders(fds_exchange, 10);
+    apply_journaled(1, "BUY 2 GPU 4 99");
+    expire_orders(fds_exchange, 15);
+    run_batch_auctions(fds_exchange, 15);
+    assert_int_equal(expire_orders(fds_exchange, 20), 1);
+    apply_journaled(0, "SELL 1 GPU 2 98");
+    expire_orders(fds_exchange, 25);
+    assert_int_equal(run_batch_auctions(fds_exchange, 25), 1);
+    close_journal(&journal, fds_exchange);
+    config.journal_file = NULL;
+    close_test_pipes();
+
+    struct saved_positions saved = save_positions();
+    int buy_size = order_book[0].buy_list_size;
+    int sell_size = order_book[0].sell_list_size;
+    uint32_t tick = timer_wheel.now;
+
+    // Replaying into an empty exchange gives the same positions, fees and book
+    teardown();
+    setup();
+    exchange_fees = 0;
+    replay_journal(journal_file, 0, 0);
+    unlink(journal_file);
+    assert_positions_equal(&saved);
+    assert_int_equal(order_book[0].buy_list_size, buy_size);
+    assert_int_equal(order_book[0].sell_list_size, sell_size);
+    assert_int_equal(timer_wheel.now, tick);
+
+    config.batch_auction = 0;
+    config.batch_interval_ms = 0;
+}
+
+static void test_checkpoint() {
+    char journal_file[] = "/tmp/pe_replay_XXXXXX";
+    int fd = mkstemp(journal_file);
+    assert_true(fd != -1);
+    char records[BUF_LEN*4];
+    int records_len = snprintf(records, sizeof(records),
+        JOURNAL_MAGIC" %d %d 1\n"
+        "0 0 SELL 0 GPU 10 100 ICEBERG 4\n"
+        "0 1 BUY 0 GPU 3 100\n"
+        "0 0 SELL 1 GPU 5 105 GTT 700000\n"
+        "0 1 BUY 1 Router 3 20\n"
+        "0 1 BUY 2 GPU 2 110 STOP 106\n", traders.num_traders, products.num_products);
+    assert_int_equal(write(fd, records, records_len), records_len);
+    close(fd);
+    assert_int_equal(replay_journal(journal_file, 0, 0), 5);
+    unlink(journal_file);
+
+    char checkpoint_file[] = "/tmp/pe_checkpoint_XXXXXX";
+    fd = mkstemp(checkpoint_file);
+    assert_true(fd != -1);
+    close(fd);
+    char tmp_file[BUF_LEN];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", checkpoint_file);
+    size_t buf_len = checkpoint_size();
+    char *buf = (char*)malloc(buf_len);
+    assert_int_equal(serialize_checkpoint(buf, 1234), buf_len);
+    assert_int_equal(write_checkpoint(checkpoint_file, tmp_file, buf, buf_len), 0);
+    assert_int_equal(access(tmp_file, F_OK), -1);
+    free(buf);
+    long int fees = exchange_fees;
+    int qty = POSITION_QTY(&traders.positions, 1, 0);
+    long int profit = POSITION_PROFIT(&traders.positions, 1, 0);
+
+    // Load into an empty exchange
+    teardown();
+    setup();
+    exchange_fees = 0;
+    long int journal_id = -1;
+    assert_int_equal(load_checkpoint(checkpoint_file, &journal_id), 1234);
+    assert_int_equal(journal_id, journal.id);
+    unlink(checkpoint_file);
+
+    // The partly filled iceberg keeps its clip and priority, the expiry and the stop are back
+    assert_int_equal(order_book[0].sell_levels, 2);
+    struct price_level *best = LEVEL_AT(order_book[0].sell_level_head);
+    assert_int_equal(best->price, 100);
+    assert_int_equal(best->total_qty, 1);
+    assert_int_equal(best->num_icebergs, 1);
+    assert_int_equal(ORDER_AT(order_book[0].sell_head)->reserve_qty, 6);
+    assert_int_equal(ORDER_AT(order_book[0].sell_head)->qty, 1);
+    assert_int_equal(order_book[0].last_price, 100);
+    assert_int_equal(order_book[1].buy_levels, 1);
+    assert_int_equal(timer_wheel.num_timers, 1);
+    assert_int_equal(stop_books[0].num_buy_stops, 1);
+    assert_int_equal(traders.trader_arr[0].num_resting, 2);
+    assert_int_equal(traders.trader_arr[0].num_orders, 2);
+    assert_int_equal(traders.trader_arr[1].num_orders, 3);
+    assert_int_equal(POSITION_QTY(&traders.positions, 1, 0), qty);
+    assert_int_equal(POSITION_PROFIT(&traders.positions, 1, 0), profit);
+    assert_int_equal(exchange_fees, fees);
+
+    // A checkpoint needs the journal its offset is in, and room for its temporary file name
+    char long_path[PATH_MAX];
+    memset(long_path, 'c', sizeof(long_path) - 1);
+    long_path[sizeof(long_path) - 1] = '\0';
+    char *no_journal_args[] = {"pe_exchange", "--checkpoint", "ckpt", "products.txt", "./trader"};
+    assert_int_equal(parse_exchange_options(5, no_journal_args, &config), -1);
+    char *long_path_args[] = {"pe_exchange", "--journal", "jrnl", "--checkpoint", long_path, "products.txt", "./trader"};
+    assert_int_equal(parse_exchange_options(7, long_path_args, &config), -1);
+    char *checkpoint_args[] = {"pe_exchange", "--journal", "jrnl", "--checkpoint", "ckpt", "products.txt", "./trader"};
+    assert_int_equal(parse_exchange_options(7, checkpoint_args, &config), 5);
+    char *default_args[] = {"pe_exchange", "products.txt", "./trader"};
+    assert_int_equal(parse_exchange_options(3, default_args, &config), 1);
+}
+
+static void test_checkpoint_replay() {
+    connect_test_pipes();
+    exchange_fees = 0;
+    char journal_file[] = "/tmp/pe_journal_XXXXXX";
+    int fd = mkstemp(journal_file);
+    assert_true(fd != -1);
+    close(fd);
+    config.journal_file = journal_file;
+    open_journal(&journal, journal_file, traders.num_traders, products.num_products);
+
+    // A checkpoint in the middle of a journaled session
+    apply_journaled(0, "SELL 0 GPU 10 100");
+    apply_journaled(1, "BUY 0 GPU 4 100");
+    commit_journal(&journal, fds_exchange);
+    long int journal_offset = journal.offset;
+    char checkpoint_file[] = "/tmp/pe_checkpoint_XXXXXX";
+    fd = mkstemp(checkpoint_file);
+    assert_true(fd != -1);
+    close(fd);
+    char tmp_file[BUF_LEN];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", checkpoint_file);
+    size_t buf_len = checkpoint_size();
+    char *buf = (char*)malloc(buf_len);
+    assert_int_equal(write_checkpoint(checkpoint_file, tmp_file, buf, serialize_checkpoint(buf, journal_offset)), 0);
+    free(buf);
+    apply_journaled(2, "BUY 0 GPU 3 100");
+    apply_journaled(1, "SELL 1 Router 2 30");
+    close_journal(&journal, fds_exchange);
+    config.journal_file = NULL;
+    close_test_pipes();
+
+    struct saved_positions saved = save_positions();
+
+    // Only the records after the checkpoint are replayed, so the matches are counted once
+    teardown();
+    setup();
+    exchange_fees = 0;
+    long int journal_id = 0;
+    assert_int_equal(load_checkpoint(checkpoint_file, &journal_id), journal_offset);
+    assert_int_equal(journal_id, journal.id);
+    assert_int_equal(replay_journal(journal_file, journal_offset, journal_id), 2);
+    unlink(checkpoint_file);
+    unlink(journal_file);
+    assert_positions_equal(&saved);
+    assert_int_equal(POSITION_QTY(&traders.positions, 0, 0), -7);
+    assert_int_equal(LEVEL_AT(order_book[0].sell_level_head)->total_qty, 3);
+    assert_int_equal(traders.trader_arr[1].num_orders, 2);
+}
+
+static void test_finish_checkpoint() {
+    struct sigaction sa = {0};
+    sa.sa_sigaction = trader_disconnect_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    struct sigaction old_sa;
+    sigaction(SIGCHLD, &sa, &old_sa);
+
+    // The child exits while SIGCHLD is blocked, as at shutdown, so finish_checkpoint reaps it
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    pid_t pid = fork();
+    assert_true(pid != -1);
+    if(pid == 0) {
+        _exit(0);
+    }
+    checkpoint_pid = pid;
+    finish_checkpoint();
+
+    // The SIGCHLD delivered on unblocking finds nothing to reap and keeps the status
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    assert_int_equal(checkpoint_pid, 0);
+    assert_true(WIFEXITED(checkpoint_exit) && WEXITSTATUS(checkpoint_exit) == 0);
+    checkpoint_exit = -1;
+    sigaction(SIGCHLD, &old_sa, NULL);
+}
+static void test_book_snapshots() {
+    struct order received_order;
+    connect_test_pipes();
+
+    // Two sell levels and a buy level, with one match
+    char *commands[] = {"SELL 0 GPU 5 101", "SELL 1 GPU 5 100", "SELL 2 GPU 3 100"};
+    for(int i=0; i<3; i++) {
+        assert_true(is_valid_sell(commands[i], 0, &received_order));
+        handle_sell(&received_order, fds_exchange);
+        traders.trader_arr[0].num_orders++;
+    }
+    assert_true(is_valid_buy("BUY 0 GPU 2 100", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+    traders.trader_arr[1].num_orders++;
+    assert_true(is_valid_buy("BUY 1 Router 4 20", 1, &received_order));
+    handle_buy(&received_order, fds_exchange);
+
+    // The copy is in print order
+    struct book_snapshot snapshot = {0};
+    copy_book_snapshot(&snapshot);
+    assert_int_equal(snapshot.seq, 1);
+    assert_int_equal(snapshot.num_levels, 3);
+    assert_int_equal(snapshot.levels[0].price, 101);
+    assert_int_equal(snapshot.levels[1].price, 100);
+    assert_int_equal(snapshot.levels[1].total_qty, 6);
+    assert_int_equal(snapshot.levels[1].num_orders, 2);
+    assert_int_equal(snapshot.levels[2].side, BUY);
+    assert_int_equal(snapshot.levels[2].product_idx, 1);
+    free_book_snapshot(&snapshot);
+
+    // The writer thread prints the copy as show_order_book does, after a header
+    char snapshot_file[] = "/tmp/pe_snapshot_XXXXXX";
+    int fd = mkstemp(snapshot_file);
+    assert_true(fd != -1);
+    close(fd);
+    config.snapshot_file = snapshot_file;
+    start_snapshot_writer(&snapshot_writer, snapshot_file);
+    assert_int_equal(emit_book_snapshot(), 0);
+    stop_snapshot_writer(&snapshot_writer);
+    config.snapshot_file = NULL;
+
+    char expected[BUF_LEN*8];
+    snprintf(expected, sizeof(expected),
+        LOG_PREFIX"\t--ORDERBOOK--\n"
+        LOG_PREFIX"\tProduct: GPU; Buy levels: 0; Sell levels: 2\n"
+        LOG_PREFIX"\t\tSELL 5 @ $101 (1 order)\n"
+        LOG_PREFIX"\t\tSELL 6 @ $100 (2 orders)\n"
+        LOG_PREFIX"\tProduct: Router; Buy levels: 1; Sell levels: 0\n"
+        LOG_PREFIX"\t\tBUY 4 @ $20 (1 order)\n"
+        LOG_PREFIX"\t--POSITIONS--\n"
+        LOG_PREFIX"\tTrader 0: GPU -2 ($%ld), Router 0 ($0)\n"
+        LOG_PREFIX"\tTrader 1: GPU 2 ($%ld), Router 0 ($0)\n"
+        LOG_PREFIX"\tTrader 2: GPU 0 ($0), Router 0 ($0)\n",
+        POSITION_PROFIT(&traders.positions, 0, 0), POSITION_PROFIT(&traders.positions, 1, 0));
+    char output[BUF_LEN*8] = {'\0'};
+    FILE *fp = fopen(snapshot_file, "r");
+    assert_non_null(fp);
+    char header[BUF_LEN];
+    assert_non_null(fgets(header, sizeof(header), fp));
+    assert_memory_equal(header, LOG_PREFIX" Snapshot 1 at ", strlen(LOG_PREFIX" Snapshot 1 at "));
+    fread(output, 1, sizeof(output) - 1, fp);
+    fclose(fp);
+    unlink(snapshot_file);
+    assert_string_equal(output, expected);
+
+    close_test_pipes();
+}
+
+static void test_async_logger() {
+    int log_pipe[2];
+    assert_int_equal(pipe(log_pipe), 0);
+    start_logger(&log_ring, log_pipe[1], 0);
+
+    // Compact records, a string too long for a record, one too long for the line buffer and an unsupported conversion
+    char long_command[LOG_TEXT_MAX * 2];
+    memset(long_command, 'x', sizeof(long_command) - 1);
+    long_command[sizeof(long_command) - 1] = '\0';
+    char huge_command[BUF_LEN * 8];
+    memset(huge_command, 'y', sizeof(huge_command) - 1);
+    huge_command[sizeof(huge_command) - 1] = '\0';
+    log_printf(LOG_PREFIX" [T%d] Parsing command: <%s>\n", 1, "BUY 0 GPU 10 100");
+    log_printf(LOG_PREFIX" Match: value: $%ld, 100%%\n", 5000000000L);
+    log_printf(LOG_PREFIX" [T%d] Parsing command: <%s>\n", 2, long_command);
+    log_printf(LOG_PREFIX" [T%d] Parsing command: <%s>\n", 3, huge_command);
+    log_printf("%5d|%c\n", 42, 'z');
+    for(int i=0; i<LOG_RING_SLOTS * 2; i++) {
+        log_printf("%d ", i);
+    }
+    stop_logger();
+    assert_false(atomic_load(&log_ring.running));
+
+    // The output is the same as printf would give
+    char expected[LOG_RING_SLOTS * 16];
+    int expected_len = snprintf(expected, sizeof(expected), LOG_PREFIX" [T1] Parsing command: <BUY 0 GPU 10 100>\n"
+        LOG_PREFIX" Match: value: $5000000000, 100%%\n" LOG_PREFIX" [T2] Parsing command: <%s>\n"
+        LOG_PREFIX" [T3] Parsing command: <%s>\n%5d|%c\n", long_command, huge_command, 42, 'z');
+    for(int i=0; i<LOG_RING_SLOTS * 2; i++) {
+        expected_len += snprintf(expected + expected_len, sizeof(expected) - expected_len, "%d ", i);
+    }
+    char output[LOG_RING_SLOTS * 16];
+    close(log_pipe[1]);
+    int output_len = 0;
+    ssize_t read_len;
+    while((read_len = read(log_pipe[0], output + output_len, sizeof(output) - output_len)) > 0) {
+        output_len += read_len;
+    }
+    close(log_pipe[0]);
+    assert_int_equal(output_len, expected_len);
+    assert_memory_equal(output, expected, expected_len);
+}
+
+static void test_log_levels() {
+    // The spec output is the default
+    char *default_args[] = {"pe_exchange", "products.txt", "./trader"};
+    assert_int_equal(parse_exchange_options(3, default_args, &config), 1);
+    assert_int_equal(config.verbosity, LOG_FULL);
+    assert_true(LOG_ENABLED(LOG_FULL));
+
+    char *match_args[] = {"pe_exchange", "--verbosity", "matches", "products.txt", "./trader"};
+    assert_int_equal(parse_exchange_options(5, match_args, &config), 3);
+    assert_false(LOG_ENABLED(LOG_FULL));
+    assert_true(LOG_ENABLED(LOG_MATCHES));
+    assert_true(LOG_ENABLED(LOG_ERRORS));
+
+    char *error_args[] = {"pe_exchange", "--verbosity", "errors", "products.txt", "./trader"};
+    assert_int_equal(parse_exchange_options(5, error_args, &config), 3);
+    assert_false(LOG_ENABLED(LOG_MATCHES));
+    assert_true(LOG_ENABLED(LOG_ERRORS));
+
+    // Only the lines of the enabled levels reach the log
+    int log_pipe[2];
+    assert_int_equal(pipe(log_pipe), 0);
+    start_logger(&log_ring, log_pipe[1], 0);
+    PEX_LOG(LOG_FULL, LOG_PREFIX" [T%d] Parsing command: <%s>\n", 0, "BUY 0 GPU 1 1");
+    PEX_LOG(LOG_MATCHES, LOG_PREFIX" Match\n");
+    PEX_LOG(LOG_ERRORS, LOG_PREFIX" Trader %d disconnected\n", 0);
+    stop_logger();
+    close(log_pipe[1]);
+    char output[BUF_LEN];
+    memset(output, 0, sizeof(output));
+    assert_true(read(log_pipe[0], output, sizeof(output) - 1) > 0);
+    close(log_pipe[0]);
+    assert_string_equal(output, LOG_PREFIX" Trader 0 disconnected\n");
+
+    char *bad_args[] = {"pe_exchange", "--verbosity", "loud", "products.txt", "./trader"};
+    assert_int_equal(parse_exchange_options(5, bad_args, &config), -1);
+    config.verbosity = LOG_FULL;
+}
+
+static void test_message_format() {
+    char buf[BUF_LEN];
+
+    // The digits match printf at the edges of each pair step
+    long int values[] = {0, 7, 10, 99, 100, 999, 1000, 12345, -1, -100, 2147483647, -2147483648L, LONG_MAX, LONG_MIN};
+    for(int i=0; i<(int)(sizeof(values) / sizeof(values[0])); i++) {
+        char expected[BUF_LEN];
+        int expected_len = snprintf(expected, BUF_LEN, "%ld", values[i]);
+        memset(buf, 0, BUF_LEN);
+        assert_int_equal(format_int(buf, values[i]), expected_len);
+        assert_string_equal(buf, expected);
+    }
+
+    memset(buf, 0, BUF_LEN);
+    assert_int_equal(format_message(buf, MSG_PREFIX("FILL "), 2, (long int[]){3, 25}), 10);
+    assert_string_equal(buf, "FILL 3 25;");
+
+    // The prefixes are made when the products are read
+    read_product_file("products.txt", &products);
+    assert_string_equal(products.market_prefixes[1][SELL], "MARKET SELL Router ");
+    memset(buf, 0, BUF_LEN);
+    int len = format_message(buf, products.market_prefixes[0][BUY], products.market_prefix_lens[0][BUY], 2, (long int[]){10, 0});
+    assert_int_equal(len, strlen("MARKET BUY GPU 10 0;"));
+    assert_string_equal(buf, "MARKET BUY GPU 10 0;");
+    free_product_list(&products);
+}
+
+static void test_binary_log() {
+    FILE *log_file = tmpfile();
+    start_logger(&log_ring, fileno(log_file), 1);
+
+    // The same format twice is defined once, other lines are kept as text
+    char long_command[LOG_TEXT_MAX * 2];
+    memset(long_command, 'x', sizeof(long_command) - 1);
+    long_command[sizeof(long_command) - 1] = '\0';
+    for(int i=0; i<2; i++) {
+        log_printf(LOG_PREFIX"\t\tSELL %ld @ $%d (%d orders)\n", 30L + i, 100, 2);
+    }
+    log_printf(LOG_PREFIX"\tProduct: %s; Buy levels: %d; Sell levels: %d\n", "GPU", 0, 1);
+    log_printf(LOG_PREFIX" [T%d] Parsing command: <%s>\n", 2, long_command);
+    log_printf("%5d|%c\n", 42, 'z');
+    stop_logger();
+
+    char expected[BUF_LEN * 8];
+    snprintf(expected, sizeof(expected), LOG_PREFIX"\t\tSELL 30 @ $100 (2 orders)\n" LOG_PREFIX"\t\tSELL 31 @ $100 (2 orders)\n"
+        LOG_PREFIX"\tProduct: GPU; Buy levels: 0; Sell levels: 1\n" LOG_PREFIX" [T2] Parsing command: <%s>\n%5d|%c\n", long_command, 42, 'z');
+
+    // Decoding gives back the text
+    rewind(log_file);
+    FILE *text_file = tmpfile();
+    assert_int_equal(decode_binary_log(log_file, text_file), 0);
+    char decoded[BUF_LEN * 8] = {'\0'};
+    rewind(text_file);
+    size_t decoded_len = fread(decoded, 1, sizeof(decoded) - 1, text_file);
+    assert_int_equal(decoded_len, strlen(expected));
+    assert_string_equal(decoded, expected);
+
+    // A text log is rejected
+    rewind(text_file);
+    assert_int_equal(decode_binary_log(text_file, log_file), -1);
+    fclose(text_file);
+    fclose(log_file);
+}
 
 int main(void) {
     const struct CMUnitTest tests[] = {
@@ -334,11 +1728,40 @@ int main(void) {
         cmocka_unit_test(test_pid_queue),
         cmocka_unit_test(test_init_traders),
         cmocka_unit_test(test_init_order_book),
+        cmocka_unit_test(test_order_pool),
         cmocka_unit_test_setup_teardown(test_buy_command, setup, teardown),
         cmocka_unit_test_setup_teardown(test_sell_command, setup, teardown),
         cmocka_unit_test_setup_teardown(test_amend_command, setup, teardown),
         cmocka_unit_test_setup_teardown(test_cancel_command, setup, teardown),
-        cmocka_unit_test_setup_teardown(test_match, setup, teardown)
+        cmocka_unit_test_setup_teardown(test_match, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_price_levels, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_position_matrix, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_fee_schedule, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_aggregated_fills, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_cancel_on_disconnect, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_mass_cancel, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_bulk_orders, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_ioc_fok_orders, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_iceberg_orders, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_gtt_expiry, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_stop_orders, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_market_orders, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_batch_auction, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_opening_auction, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_book_diffs, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_compact_positions, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_book_snapshots, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_stop_heap, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_journal, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_journal_replay, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_journal_clock_replay, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_checkpoint, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_checkpoint_replay, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_finish_checkpoint, setup, teardown),
+        cmocka_unit_test(test_async_logger),
+        cmocka_unit_test(test_binary_log),
+        cmocka_unit_test(test_log_levels),
+        cmocka_unit_test(test_message_format)
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
\ No newline at end of file